@@ -0,0 +1,169 @@
+#!/bin/bash
+# Benchmark harness: runs the cable emulator and both endpoints without
+# interaction, sweeping file size, baud rate, BER, propagation delay and frame
+# size, and writes one CSV row per run comparing the measured efficiency
+# S = R / C with the theoretical Stop-and-Wait efficiency S = (1 - FER) / (1 + 2a).
+# Both count file bits per bit of line capacity: the theoretical one is scaled
+# by 8/10 (8-N-1) and by the share of content in a frame, so what is left
+# between them is the acknowledgements, byte stuffing and retransmissions.
+#
+# Every parameter can be overridden from the environment (or from make):
+#   BENCH_SIZES    file sizes in bytes
+#   BENCH_BAUDS    baud rates (must be supported by main and the cable)
+#   BENCH_BERS     bit error rates
+#   BENCH_PROPS    propagation delays in microseconds
+#   BENCH_FRAMES   content bytes per data packet (LL_FRAME_SIZE)
+#   BENCH_REPEAT   runs per point
+#   BENCH_CSV      output file
+#   BENCH_TIMEOUT  seconds before a run is abandoned
+#   BENCH_SCENARIO cable scenario started with every transfer (see the cable's
+#                  help), e.g. to turn the cable off for a while mid-transfer
+#   BENCH_SIM      if set, use the simulated link (virtual clock) instead of
+#                  the cable, so points take milliseconds instead of minutes
+#
+# Run n of every point seeds the cable's error generators with n (like the
+# simulated link), so the same traffic meets the same errors when repeated.
+# Each cable run also records the cable's pacing statistics (the share of byte
+# slots it served late and its worst wakeup past a deadline): a run where they
+# are high measured the emulator rather than the protocol.
+
+BIN=${BIN:-bin}
+TX_SERIAL_PORT=${TX_SERIAL_PORT:-/dev/ttyS10}
+RX_SERIAL_PORT=${RX_SERIAL_PORT:-/dev/ttyS11}
+
+BENCH_SIZES=${BENCH_SIZES:-"10000 50000"}
+BENCH_BAUDS=${BENCH_BAUDS:-"9600 38400 115200"}
+BENCH_BERS=${BENCH_BERS:-"0 0.00001 0.0001"}
+BENCH_PROPS=${BENCH_PROPS:-"0 10000"}
+BENCH_FRAMES=${BENCH_FRAMES:-"997 500 100"}
+BENCH_REPEAT=${BENCH_REPEAT:-3}
+BENCH_CSV=${BENCH_CSV:-bench.csv}
+BENCH_TIMEOUT=${BENCH_TIMEOUT:-300}
+BENCH_SCENARIO=${BENCH_SCENARIO:-}
+
+# Bytes added to the content of a data packet on the wire: packet header (3)
+# and frame header and trailer (6), before byte stuffing
+PACKET_OVERHEAD=3
+FRAME_OVERHEAD=6
+
+WORK=$(mktemp -d)
+CABLE_PID=
+
+cleanup() {
+    if [ -n "$CABLE_PID" ]; then
+        echo quit >&3
+        wait "$CABLE_PID" 2>/dev/null
+    fi
+    exec 3>&-
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Send a command to the cable and give it time to apply it
+cable() {
+    echo "$1" >&3
+    sleep 0.2
+}
+
+# Pacing statistics of the cable since the last "stats reset": percentage of
+# late byte slots and worst wakeup error in usec
+pacing() {
+    [ -n "$BENCH_SIM" ] && { echo "0 0"; return; }
+    cable "stats"
+    local late=$(grep -o 'late by over [0-9]* usec ([0-9.]*%)' "$WORK/cable.log" | tail -n 1 | grep -o '([0-9.]*' | tr -d '(')
+    local wake=$(grep -o 'at most [0-9.]* usec$' "$WORK/cable.log" | tail -n 1 | cut -d' ' -f3)
+    echo "${late:-0} ${wake:-0}"
+}
+
+# Value of a numeric field of a JSON statistics line
+field() {
+    grep -o "\"$2\":[0-9.e+-]*" <<< "$1" | head -n 1 | cut -d: -f2
+}
+
+if [ -n "$BENCH_SIM" ]; then
+    cable() { :; }
+else
+    # Start the cable with its commands read from a FIFO (line buffered, so its
+    # messages reach the log as they are printed)
+    mkfifo "$WORK/commands"
+    stdbuf -oL "./$BIN/cable" "$TX_SERIAL_PORT" "$RX_SERIAL_PORT" < "$WORK/commands" > "$WORK/cable.log" 2>&1 &
+    CABLE_PID=$!
+    exec 3> "$WORK/commands"
+    for _ in $(seq 50); do
+        [ -e "$TX_SERIAL_PORT" ] && [ -e "$RX_SERIAL_PORT" ] && grep -q "Cable ready" "$WORK/cable.log" && break
+        sleep 0.1
+    done
+    if ! grep -q "Cable ready" "$WORK/cable.log"; then
+        echo "The cable didn't start:" >&2
+        cat "$WORK/cable.log" >&2
+        exit 1
+    fi
+fi
+
+echo "file_size,baud,ber,prop_us,frame_size,run,ok,transfer_s,rej,timeouts,measured_s_file_bits_per_line_bit,fer,a,theoretical_s_file_bits_per_line_bit,late_slots_pct,wake_error_max_us" > "$BENCH_CSV"
+points=0
+for size in $BENCH_SIZES; do
+    head -c "$size" /dev/urandom > "$WORK/input"
+    for baud in $BENCH_BAUDS; do
+        cable "baud $baud"
+        for ber in $BENCH_BERS; do
+            cable "ber $ber"
+            for prop in $BENCH_PROPS; do
+                cable "prop $prop"
+                for frame in $BENCH_FRAMES; do
+                    for run in $(seq "$BENCH_REPEAT"); do
+                        rm -f "$WORK/output" "$WORK/rx.json"
+                        cable "stats reset"
+                        cable "seed $run"
+                        rxPort=$RX_SERIAL_PORT
+                        txPort=$TX_SERIAL_PORT
+                        if [ -n "$BENCH_SIM" ]; then
+                            rxPort="sim:$WORK/link,prop=$prop,ber=$ber,seed=$run"
+                            txPort="sim:$WORK/link"
+                        fi
+                        LL_STATS_FORMAT=json LL_STATS_FILE="$WORK/rx.json" timeout "$BENCH_TIMEOUT" \
+                            "./$BIN/main" "$rxPort" "$baud" rx "$WORK/output" > "$WORK/rx.log" 2>&1 &
+                        rx=$!
+                        sleep 0.3
+                        # The scenario's clock starts with the transmitter
+                        [ -n "$BENCH_SCENARIO" ] && [ -z "$BENCH_SIM" ] && echo "scenario $BENCH_SCENARIO" >&3
+                        LL_FRAME_SIZE="$frame" timeout "$BENCH_TIMEOUT" \
+                            "./$BIN/main" "$txPort" "$baud" tx "$WORK/input" > "$WORK/tx.log" 2>&1
+                        wait "$rx"
+                        [ -n "$BENCH_SCENARIO" ] && cable "scenario off"
+
+                        ok=0
+                        cmp -s "$WORK/input" "$WORK/output" && ok=1
+                        stats=$(tail -n 1 "$WORK/rx.json" 2>/dev/null)
+                        transfer=$(field "$stats" transfer_s)
+                        rej=$(field "$stats" rej)
+                        timeouts=$(field "$stats" timeout)
+                        read -r late wake <<< "$(pacing)"
+
+                        # R / C: file bits per second over the channel capacity
+                        # (the cable sends 10 bits per byte, 8-N-1)
+                        awk -v size="$size" -v baud="$baud" -v ber="$ber" -v prop="$prop" -v frame="$frame" \
+                            -v run="$run" -v ok="$ok" -v transfer="${transfer:-0}" -v rej="${rej:-0}" \
+                            -v timeouts="${timeouts:-0}" -v late="$late" -v wake="$wake" \
+                            -v overhead=$((PACKET_OVERHEAD + FRAME_OVERHEAD)) '
+                            BEGIN {
+                                measured = (ok && transfer > 0) ? size * 8 / transfer / baud : 0
+                                frameBits = (frame + overhead) * 8
+                                fer = 1 - exp(frameBits * log(1 - ber))
+                                a = (prop / 1e6) / ((frame + overhead) * 10 / baud)
+                                theoretical = (1 - fer) / (1 + 2 * a) * 8 / 10 * frame / (frame + overhead)
+                                printf "%d,%d,%g,%d,%d,%d,%d,%.6f,%d,%d,%.4f,%.6f,%.6f,%.4f,%.4f,%.1f\n",
+                                       size, baud, ber, prop, frame, run, ok, transfer, rej, timeouts,
+                                       measured, fer, a, theoretical, late, wake
+                            }' >> "$BENCH_CSV"
+                        points=$((points + 1))
+                        printf "\r%d runs, last: size=%s baud=%s ber=%s prop=%s frame=%s ok=%s" \
+                               "$points" "$size" "$baud" "$ber" "$prop" "$frame" "$ok"
+                    done
+                done
+            done
+        done
+    done
+done
+printf "\nResults written to %s\n" "$BENCH_CSV"
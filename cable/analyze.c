@@ -0,0 +1,766 @@
+// Frame-level analyzer of the cable's binary captures (see capture.h).
+//
+//   analyze frames FILE   one line per frame that left the cable (what the
+//                         ports received), with the time of its opening flag,
+//                         its direction and type, the acknowledgement it got
+//                         or what went wrong with it, then the report
+//   analyze report FILE   only the report: frames per type and direction,
+//                         errors the cable put in them and whether the BCCs
+//                         caught them, goodput, acknowledgement latency,
+//                         retransmissions by cause and idle gaps
+//
+// The frames are decoded with the link layer's definitions (frame.h) from
+// both sides of the cable: the bytes that entered it are the frames as sent,
+// and tell the information frames, their retransmissions and the responses
+// apart; the bytes that left it are the frames as received. The capture is
+// read once, in blocks, so its size doesn't matter.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "capture.h"
+#include "frame.h"
+
+#define FALSE 0
+#define TRUE 1
+
+#define READ_RECORDS 65536      // Records read at once
+#define MAX_FRAME 8192          // Bytes of a frame kept, after destuffing (longer ones are only counted)
+#define IDLE_GAP_NSEC 10000000LL // Silences of the line reported as idle gaps
+#define LONGEST_GAPS 5
+#define LATENCY_BUCKETS 32      // Acknowledgement latency, usec in powers of two
+
+#define SENT 0                  // Decoders of the bytes entering the cable,
+#define RECEIVED 1              // and of those leaving it
+
+// What a decoded frame looks like
+#define FRAME_OK 0
+#define FRAME_SHORT 1           // No room for | A | C | BCC1 |, or for the BCC2 it needs
+#define FRAME_BCC1 2
+#define FRAME_BCC2 3
+#define FRAME_LONG 4            // Longer than MAX_FRAME
+#define FRAME_UNKNOWN 5         // Control field of no frame
+#define FRAME_LENGTH 6          // Bytes after the BCC1 of a frame without information
+
+// Fate of an information frame at the receiver, in increasing order of success
+#define ARRIVAL_NONE 0          // Nothing came out of the cable
+#define ARRIVAL_GARBLED 1       // Dropped by the receiver without an answer
+#define ARRIVAL_BCC2 2          // Rejected
+#define ARRIVAL_OK 3
+
+// Why an information frame was sent again
+#define CAUSE_REJECTED 0
+#define CAUSE_LOST 1
+#define CAUSE_GARBLED 2
+#define CAUSE_RESPONSE_LOST 3
+#define CAUSE_NO_RESPONSE 4
+#define CAUSES 5
+
+#define NO_TYPE (-1)
+
+static const struct {
+    unsigned char control;
+    const char *name;
+    int data;                   // Has an information field and a BCC2
+} frameTypes[] = {
+    { C_SET, "SET", FALSE }, { C_UA, "UA", FALSE }, { C_DISC, "DISC", FALSE },
+    { C_N0, "I0", TRUE }, { C_N1, "I1", TRUE },
+    { C_RR0, "RR0", FALSE }, { C_RR1, "RR1", FALSE }, { C_REJ0, "REJ0", FALSE }, { C_REJ1, "REJ1", FALSE },
+    { C_CAPS, "CAPS", TRUE }, { C_BAUD, "BAUD", TRUE }, { C_PROBE, "PROBE", TRUE },
+    { C_REPORT, "REPORT", TRUE }, { C_BAUD_DONE, "BAUD_DONE", TRUE },
+};
+#define FRAME_TYPES (int) (sizeof(frameTypes) / sizeof(frameTypes[0]))
+
+static const char *causeNames[CAUSES] = {
+    "rejected (BCC2 error)", "timeout, frame lost", "timeout, header garbled",
+    "timeout, response lost", "timeout, no response",
+};
+
+static const char *directionNames[2] = { "Tx->Rx", "Rx->Tx" };
+
+// Frame being put together from the bytes of one side of a direction
+struct Decoder {
+    unsigned char data[MAX_FRAME];  // | A | C | BCC1 | data | BCC2 |, destuffed
+    int length;
+    int open;                   // After a flag
+    int escaped;
+    uint64_t start;             // Time of the opening flag
+    int corrupted, dropped, inserted;   // Bytes the cable hit
+    long long stray;            // Bytes outside the flags
+};
+
+// A decoded frame
+struct Frame {
+    int direction;
+    uint64_t start;             // Times of the opening and closing flags
+    uint64_t end;
+    int status;                 // FRAME_*
+    int type;                   // Index in frameTypes, or NO_TYPE
+    unsigned char address, control;
+    int dataLength;             // Of the information field
+    int corrupted, dropped, inserted;
+};
+
+// Last information frame sent in a direction, as its sender sees it
+struct Transmission {
+    int active;                 // Until the next one
+    int sequence;
+    int dataLength;
+    uint64_t start;             // First byte into the cable
+    int arrival;                // ARRIVAL_*
+    int answered;               // The receiver sent an RR or a REJ for it
+    int acked;
+    int rejected;
+    int cause;                  // CAUSE_* if it is a retransmission, -1 if not
+};
+
+struct Direction {
+    struct Decoder decoders[2];
+    struct Transmission transmission;
+    int expected;               // Sequence number the receiver accepts next
+    long long frames[2][FRAME_TYPES];
+    long long hit;              // Frames received with bytes the cable hit,
+    long long caught[FRAME_LENGTH + 1];    // by what they looked like
+    long long undetected;       // Hit but accepted by the BCCs
+    long long lost;             // Information frames of which nothing arrived
+    long long informationSent;
+    long long retransmissions[CAUSES];
+    long long delivered;        // Information field bytes accepted for the first time
+    long long duplicates;
+    uint64_t firstSent;         // First information frame into the cable
+    uint64_t lastAcked;         // and last acknowledgement out of it
+    double firstCapacity;       // Bytes the direction could carry up to them
+    double lastCapacity;
+    uint32_t baud;              // Baud rate of the direction,
+    uint64_t baudSince;         // since then,
+    double capacity;            // and the bytes it could carry before
+    int baudChanges;
+    long long acks;
+    long long latencies[LATENCY_BUCKETS];
+    uint64_t latencySum, latencyMin, latencyMax;
+};
+
+struct Gap {
+    uint64_t start;
+    uint64_t length;
+    char after[48];             // Last frame received before it
+};
+
+static struct Direction directions[2];
+static struct Gap gaps[LONGEST_GAPS];
+static int listFrames;
+static uint64_t lastTime;       // Of the last slot with a byte
+static int busy;
+static uint64_t idleTotal;
+static long long idleGaps;
+static uint64_t idleGapsTotal;
+static uint64_t slotNsec;
+static char lastFrame[48] = "the start";
+static long long cableOffs;
+static uint64_t endTime;
+
+
+// Bytes a direction could carry from the start of the capture to time, at 10
+// bits per byte and the baud rates it had
+double capacity_at(const struct Direction *direction, uint64_t time)
+{
+    return direction->capacity + ((double) time - (double) direction->baudSince) * direction->baud / 1e10;
+}
+
+
+// The byte slots are those of the faster direction
+void set_slot_time(void)
+{
+    uint32_t baud = directions[0].baud > directions[1].baud ? directions[0].baud : directions[1].baud;
+    slotNsec = baud > 0 ? 10000000000ULL / baud : 0;
+}
+
+
+int frame_type(unsigned char control)
+{
+    for (int type = 0; type < FRAME_TYPES; type++)
+    {
+        if (frameTypes[type].control == control)
+        {
+            return type;
+        }
+    }
+    return NO_TYPE;
+}
+
+
+void print_time(uint64_t time)
+{
+    printf("%6llu.%06llu", (unsigned long long) (time / 1000000000ULL),
+           (unsigned long long) (time % 1000000000ULL / 1000));
+}
+
+
+// Errors of the cable in a received frame, for the frame list
+void print_hits(const struct Frame *frame)
+{
+    const char *separator = "  (";
+    if (frame->corrupted > 0)
+    {
+        printf("%s%d corrupted", separator, frame->corrupted);
+        separator = ", ";
+    }
+    if (frame->dropped > 0)
+    {
+        printf("%s%d dropped", separator, frame->dropped);
+        separator = ", ";
+    }
+    if (frame->inserted > 0)
+    {
+        printf("%s%d inserted", separator, frame->inserted);
+        separator = ", ";
+    }
+    if (separator[0] == ',')
+    {
+        printf(")");
+    }
+}
+
+
+// An information frame entered the cable
+void sent_information(struct Direction *direction, const struct Frame *frame)
+{
+    struct Transmission *t = &direction->transmission;
+    int sequence = frame->control == C_N1;
+    int cause = -1;
+
+    if (t->active && !t->acked && t->sequence == sequence)
+    {
+        cause = t->rejected ? CAUSE_REJECTED :
+                t->arrival == ARRIVAL_NONE ? CAUSE_LOST :
+                t->arrival == ARRIVAL_GARBLED ? CAUSE_GARBLED :
+                t->answered ? CAUSE_RESPONSE_LOST : CAUSE_NO_RESPONSE;
+        direction->retransmissions[cause]++;
+    }
+    if (t->active && t->arrival == ARRIVAL_NONE)
+    {
+        direction->lost++;
+        if (listFrames)
+        {
+            printf("              %s  I%d     %5d bytes  LOST, sent at ", directionNames[frame->direction],
+                   t->sequence, t->dataLength);
+            print_time(t->start);
+            printf("\n");
+        }
+    }
+
+    if (direction->informationSent++ == 0)
+    {
+        direction->firstSent = frame->start;
+        direction->firstCapacity = capacity_at(direction, frame->start);
+    }
+    t->active = TRUE;
+    t->sequence = sequence;
+    t->dataLength = frame->dataLength;
+    t->start = frame->start;
+    t->arrival = ARRIVAL_NONE;
+    t->answered = FALSE;
+    t->acked = FALSE;
+    t->rejected = FALSE;
+    t->cause = cause;
+}
+
+
+// A frame entered the cable
+void sent(const struct Frame *frame)
+{
+    struct Direction *direction = &directions[frame->direction];
+    if (frame->status != FRAME_OK)
+    {
+        return;
+    }
+    direction->frames[SENT][frame->type]++;
+
+    if (frame->control == C_N0 || frame->control == C_N1)
+    {
+        sent_information(direction, frame);
+    }
+    else if (frame->control == C_RR0 || frame->control == C_RR1 ||
+             frame->control == C_REJ0 || frame->control == C_REJ1)
+    {
+        // The receiver answers the frames of the other direction
+        directions[!frame->direction].transmission.answered = TRUE;
+    }
+}
+
+
+// A frame left the cable
+void received(const struct Frame *frame)
+{
+    struct Direction *direction = &directions[frame->direction];
+    struct Transmission *t = &direction->transmission;
+    struct Transmission *answered = &directions[!frame->direction].transmission;
+    int hit = frame->corrupted + frame->dropped + frame->inserted > 0;
+    int information = frame->control == C_N0 || frame->control == C_N1;
+
+    if (hit)
+    {
+        direction->hit++;
+        if (frame->status == FRAME_OK)
+        {
+            direction->undetected++;
+        }
+        else
+        {
+            direction->caught[frame->status]++;
+        }
+    }
+
+    if (listFrames)
+    {
+        print_time(frame->start);
+        printf("  %s  ", directionNames[frame->direction]);
+        if (frame->type != NO_TYPE && frame->status != FRAME_SHORT)
+        {
+            printf("%-6s", frameTypes[frame->type].name);
+        }
+        else
+        {
+            printf("A=%02X C=%02X", frame->address, frame->control);
+        }
+        if (frame->type != NO_TYPE && frameTypes[frame->type].data)
+        {
+            printf(" %5d bytes", frame->dataLength);
+        }
+    }
+
+    // Information frames are attributed to the last one sent in their
+    // direction, and so are the frames the receiver can't make out
+    int arrival = ARRIVAL_NONE;
+    if (information && frame->status == FRAME_OK)
+    {
+        arrival = ARRIVAL_OK;
+    }
+    else if (information && frame->status == FRAME_BCC2)
+    {
+        arrival = ARRIVAL_BCC2;
+    }
+    else if (frame->status != FRAME_OK && frame->status != FRAME_BCC2)
+    {
+        arrival = ARRIVAL_GARBLED;
+    }
+    if (arrival != ARRIVAL_NONE && t->active && !t->acked && arrival > t->arrival)
+    {
+        t->arrival = arrival;
+    }
+
+    if (information && frame->status != FRAME_SHORT && t->active && t->cause >= 0 && listFrames)
+    {
+        printf("  retransmission: %s", causeNames[t->cause]);
+    }
+    if (frame->status == FRAME_OK)
+    {
+        direction->frames[RECEIVED][frame->type]++;
+        if (information && (frame->control == C_N1) == direction->expected)
+        {
+            direction->delivered += frame->dataLength;
+            direction->expected = !direction->expected;
+        }
+        else if (information)
+        {
+            direction->duplicates++;
+            if (listFrames)
+            {
+                printf("  duplicate");
+            }
+        }
+        else if ((frame->control == C_RR0 || frame->control == C_RR1) && answered->active &&
+                 !answered->acked && !answered->rejected)
+        {
+            uint64_t latency = frame->end - answered->start;
+            int bucket = 0;
+            while (bucket < LATENCY_BUCKETS - 1 && (latency / 1000) >> (bucket + 1) != 0)
+            {
+                bucket++;
+            }
+            struct Direction *data = &directions[!frame->direction];
+            data->latencies[bucket]++;
+            data->latencySum += latency;
+            data->latencyMin = data->acks == 0 || latency < data->latencyMin ? latency : data->latencyMin;
+            data->latencyMax = latency > data->latencyMax ? latency : data->latencyMax;
+            data->acks++;
+            data->lastAcked = frame->end;
+            data->lastCapacity = capacity_at(data, frame->end);
+            answered->acked = TRUE;
+            if (listFrames)
+            {
+                printf("  acks I%d after %.3f ms", answered->sequence, latency / 1e6);
+            }
+        }
+        else if ((frame->control == C_REJ0 || frame->control == C_REJ1) && answered->active &&
+                 !answered->acked)
+        {
+            answered->rejected = TRUE;
+            if (listFrames)
+            {
+                printf("  rejects I%d", answered->sequence);
+            }
+        }
+        if (hit && listFrames)
+        {
+            printf("  UNDETECTED");
+        }
+    }
+    else if (listFrames)
+    {
+        static const char *statusNames[] = { "", "SHORT", "BCC1 ERROR", "BCC2 ERROR", "TOO LONG", "UNKNOWN",
+                                             "BAD LENGTH" };
+        printf("  %s", statusNames[frame->status]);
+    }
+    if (listFrames)
+    {
+        print_hits(frame);
+        printf("\n");
+    }
+
+    if (frame->type != NO_TYPE && frame->status != FRAME_SHORT)
+    {
+        snprintf(lastFrame, sizeof(lastFrame), "%s %s%s", directionNames[frame->direction],
+                 frameTypes[frame->type].name, frame->status == FRAME_OK ? "" : " (bad)");
+    }
+    else
+    {
+        snprintf(lastFrame, sizeof(lastFrame), "%s garbled frame", directionNames[frame->direction]);
+    }
+}
+
+
+// Check the frame a decoder put together and hand it over
+void frame_end(struct Decoder *decoder, int direction, int side, uint64_t time)
+{
+    struct Frame frame = { direction, decoder->start, time, FRAME_OK, NO_TYPE, 0, 0, 0,
+                           decoder->corrupted, decoder->dropped, decoder->inserted };
+    int length = decoder->length;
+    const unsigned char *data = decoder->data;
+
+    if (length >= 2)
+    {
+        frame.address = data[0];
+        frame.control = data[1];
+        frame.type = frame_type(frame.control);
+    }
+    if (length > MAX_FRAME)
+    {
+        frame.status = FRAME_LONG;
+    }
+    else if (length < 3)
+    {
+        frame.status = FRAME_SHORT;
+    }
+    else if ((data[0] ^ data[1]) != data[2])
+    {
+        frame.status = FRAME_BCC1;
+    }
+    else if (frame.type == NO_TYPE)
+    {
+        frame.status = FRAME_UNKNOWN;
+    }
+    else if (!frameTypes[frame.type].data && length != 3)
+    {
+        frame.status = FRAME_LENGTH;
+    }
+    else if (frameTypes[frame.type].data)
+    {
+        unsigned char bcc2 = 0;
+        for (int i = 3; i < length; i++)
+        {
+            bcc2 ^= data[i];
+        }
+        frame.dataLength = length - 4;
+        frame.status = length < 4 ? FRAME_SHORT : bcc2 != 0 ? FRAME_BCC2 : FRAME_OK;
+    }
+
+    if (side == SENT)
+    {
+        sent(&frame);
+    }
+    else
+    {
+        received(&frame);
+    }
+}
+
+
+// Feed a byte to a decoder
+void decode(struct Decoder *decoder, int direction, int side, const struct CaptureRecord *record)
+{
+    if (decoder->open)
+    {
+        decoder->corrupted += (record->flags & CAPTURE_CORRUPTED) != 0;
+        decoder->dropped += (record->flags & CAPTURE_DROPPED) != 0;
+        decoder->inserted += (record->flags & CAPTURE_INSERTED) != 0;
+    }
+    if (record->flags & CAPTURE_DROPPED)
+    {
+        return;
+    }
+
+    if (record->byte == FLAG)
+    {
+        if (decoder->open && decoder->length > 0)
+        {
+            frame_end(decoder, direction, side, record->time);
+        }
+        // Every flag may open a frame: the closing one if the next opening
+        // flag was lost
+        decoder->open = TRUE;
+        decoder->length = 0;
+        decoder->escaped = FALSE;
+        decoder->start = record->time;
+        decoder->corrupted = (record->flags & CAPTURE_CORRUPTED) != 0;
+        decoder->dropped = 0;
+        decoder->inserted = (record->flags & CAPTURE_INSERTED) != 0;
+    }
+    else if (!decoder->open)
+    {
+        decoder->stray++;
+    }
+    else if (record->byte == ESCAPE)
+    {
+        decoder->escaped = TRUE;
+    }
+    else
+    {
+        if (decoder->length < MAX_FRAME)
+        {
+            decoder->data[decoder->length] = decoder->escaped ? record->byte ^ STUFF : record->byte;
+        }
+        decoder->length += decoder->length <= MAX_FRAME;
+        decoder->escaped = FALSE;
+    }
+}
+
+
+// Account the silence before a slot with a byte
+void idle_until(uint64_t time)
+{
+    if (!busy)
+    {
+        busy = TRUE;
+        lastTime = time;
+        return;
+    }
+    if (time <= lastTime + slotNsec)
+    {
+        lastTime = time > lastTime ? time : lastTime;
+        return;
+    }
+
+    uint64_t length = time - lastTime - slotNsec;
+    idleTotal += length;
+    if (length >= IDLE_GAP_NSEC)
+    {
+        idleGaps++;
+        idleGapsTotal += length;
+        if (listFrames)
+        {
+            printf("              idle %.3f ms\n", length / 1e6);
+        }
+        int i = LONGEST_GAPS;
+        while (i > 0 && gaps[i - 1].length < length)
+        {
+            if (i < LONGEST_GAPS)
+            {
+                gaps[i] = gaps[i - 1];
+            }
+            i--;
+        }
+        if (i < LONGEST_GAPS)
+        {
+            gaps[i].start = lastTime + slotNsec;
+            gaps[i].length = length;
+            snprintf(gaps[i].after, sizeof(gaps[i].after), "%s", lastFrame);
+        }
+    }
+    lastTime = time;
+}
+
+
+void analyze_record(const struct CaptureRecord *record)
+{
+    switch (record->type)
+    {
+        case CAPTURE_TX2RX_IN:
+        case CAPTURE_TX2RX_OUT:
+        case CAPTURE_RX2TX_IN:
+        case CAPTURE_RX2TX_OUT:
+        {
+            int direction = record->type >> 1;
+            int side = record->type & 1;
+            idle_until(record->time);
+            decode(&directions[direction].decoders[side], direction, side, record);
+            break;
+        }
+        case CAPTURE_CABLE_OFF:
+        case CAPTURE_CABLE_ON:
+            cableOffs += record->type == CAPTURE_CABLE_OFF;
+            if (listFrames)
+            {
+                print_time(record->time);
+                printf("  CABLE %s\n", record->type == CAPTURE_CABLE_OFF ? "OFF" : "ON");
+            }
+            break;
+        case CAPTURE_BAUD:
+        {
+            struct Direction *direction = &directions[record->byte & 1];
+            direction->capacity = capacity_at(direction, record->time);
+            direction->baudSince = record->time;
+            direction->baud = record->baud;
+            direction->baudChanges++;
+            set_slot_time();
+            if (listFrames)
+            {
+                print_time(record->time);
+                printf("  %s BAUD RATE %u\n", directionNames[record->byte & 1], record->baud);
+            }
+            break;
+        }
+        case CAPTURE_END:
+            endTime = record->time;
+            break;
+    }
+}
+
+
+void print_report(const struct CaptureHeader *header)
+{
+    printf("\nCapture of %.6f s, at %u baud Tx->Rx and %u baud Rx->Tx", endTime / 1e9, header->lineBaud[0],
+           header->lineBaud[1]);
+    if (directions[0].baudChanges + directions[1].baudChanges > 0)
+    {
+        printf(" (then %d and %d changes)", directions[0].baudChanges, directions[1].baudChanges);
+    }
+    printf("\n");
+
+    printf("\nFrames      %s sent/received  %s sent/received\n", directionNames[0], directionNames[1]);
+    for (int type = 0; type < FRAME_TYPES; type++)
+    {
+        long long *tx = directions[0].frames[SENT], *rx = directions[0].frames[RECEIVED];
+        long long *ty = directions[1].frames[SENT], *ry = directions[1].frames[RECEIVED];
+        if (tx[type] + rx[type] + ty[type] + ry[type] > 0)
+        {
+            printf("  %-10s %10lld/%-10lld %10lld/%-10lld\n", frameTypes[type].name, tx[type], rx[type], ty[type], ry[type]);
+        }
+    }
+
+    for (int d = 0; d < 2; d++)
+    {
+        struct Direction *direction = &directions[d];
+        printf("\n%s\n", directionNames[d]);
+        printf("  Errors: %lld frames hit by the cable: %lld short, %lld BCC1, %lld BCC2, %lld too long, "
+               "%lld unknown, %lld bad length, %lld UNDETECTED\n",
+               direction->hit, direction->caught[FRAME_SHORT], direction->caught[FRAME_BCC1],
+               direction->caught[FRAME_BCC2], direction->caught[FRAME_LONG], direction->caught[FRAME_UNKNOWN],
+               direction->caught[FRAME_LENGTH], direction->undetected);
+        printf("  Stray bytes: %lld sent, %lld received outside frames\n",
+               direction->decoders[SENT].stray, direction->decoders[RECEIVED].stray);
+        if (direction->informationSent == 0)
+        {
+            continue;
+        }
+
+        long long retransmissions = 0;
+        for (int cause = 0; cause < CAUSES; cause++)
+        {
+            retransmissions += direction->retransmissions[cause];
+        }
+        printf("  Information frames: %lld sent, %lld retransmissions, %lld lost altogether, %lld duplicates\n",
+               direction->informationSent, retransmissions, direction->lost, direction->duplicates);
+        for (int cause = 0; cause < CAUSES; cause++)
+        {
+            if (direction->retransmissions[cause] > 0)
+            {
+                printf("    %-24s %lld\n", causeNames[cause], direction->retransmissions[cause]);
+            }
+        }
+
+        // Of what the direction could carry meanwhile, at its own baud rates
+        double seconds = direction->acks > 0 ? (direction->lastAcked - direction->firstSent) / 1e9 : 0;
+        double capacity = direction->acks > 0 ? direction->lastCapacity - direction->firstCapacity : 0;
+        printf("  Goodput: %lld bytes in %.3f s, %.1f bytes/s, %.1f%% of the line\n", direction->delivered,
+               seconds, seconds > 0 ? direction->delivered / seconds : 0.0,
+               capacity > 0 ? 100.0 * direction->delivered / capacity : 0.0);
+
+        if (direction->acks == 0)
+        {
+            continue;
+        }
+        printf("  Acknowledgement latency: %lld acks, min %.3f ms, mean %.3f ms, max %.3f ms\n", direction->acks,
+               direction->latencyMin / 1e6, direction->latencySum / 1e6 / direction->acks,
+               direction->latencyMax / 1e6);
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+        {
+            if (direction->latencies[bucket] > 0)
+            {
+                printf("    %9.3f ms - %-9.3f %8lld  %5.1f%%\n", bucket == 0 ? 0.0 : (1ULL << bucket) / 1e3,
+                       (1ULL << (bucket + 1)) / 1e3, direction->latencies[bucket],
+                       100.0 * direction->latencies[bucket] / direction->acks);
+            }
+        }
+    }
+
+    printf("\nIdle: %.3f s without a byte on the line, %lld gaps of %lld ms or more (%.3f s)",
+           idleTotal / 1e9, idleGaps, IDLE_GAP_NSEC / 1000000, idleGapsTotal / 1e9);
+    if (cableOffs > 0)
+    {
+        printf(", cable off %lld times", cableOffs);
+    }
+    printf("\n");
+    for (int i = 0; i < LONGEST_GAPS && gaps[i].length > 0; i++)
+    {
+        printf("  %10.3f ms at ", gaps[i].length / 1e6);
+        print_time(gaps[i].start);
+        printf(", after %s\n", gaps[i].after);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 || (strcmp(argv[1], "frames") != 0 && strcmp(argv[1], "report") != 0))
+    {
+        fprintf(stderr, "Usage: %s frames|report capture_file\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[2], "rb");
+    if (file == NULL)
+    {
+        perror(argv[2]);
+        return 1;
+    }
+    struct CaptureHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 || header.version != CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s is not a cable capture (version %d)\n", argv[2], CAPTURE_VERSION);
+        fclose(file);
+        return 1;
+    }
+    listFrames = strcmp(argv[1], "frames") == 0;
+    for (int d = 0; d < 2; d++)
+    {
+        directions[d].baud = header.lineBaud[d];
+    }
+    set_slot_time();
+
+    static struct CaptureRecord records[READ_RECORDS];
+    size_t count;
+    while ((count = fread(records, sizeof(records[0]), READ_RECORDS, file)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            analyze_record(&records[i]);
+        }
+    }
+    fclose(file);
+
+    print_report(&header);
+    return 0;
+}
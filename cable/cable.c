@@ -1,85 +1,425 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates a pair of virtual Tx / Rx serial ports using pseudo-terminals.
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
 
+#define _GNU_SOURCE  // For posix_openpt, ptsname_r and splice
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "capture.h"
+
 #define TXDEV "/dev/ttyS10"
 #define RXDEV "/dev/ttyS11"
 // Baudrate settings are defined in <asm/termbits.h>, which is
 // included by <termios.h>
 #define BAUDRATE B9600         // For struct termios
 #define DEFAULT_BAUDRATE 9600  // For the delaying transmissions
+#define MIN_BAUDRATE 50
+#define MAX_BAUDRATE 4000000
 #define _POSIX_SOURCE 1        // POSIX compliant source
 #define FALSE 0
 #define TRUE 1
 
 #define BUF_SIZE 2048
 
+// The byte slots are not served one per loop iteration: the cable wakes up at
+// most every BATCH_PERIOD_NSEC and moves the bytes of every slot that started
+// since the previous wakeup in one read and one write per direction
+#define BATCH_PERIOD_NSEC 500000
+#define BATCH_MAX_SLOTS 16384
+
+// Pacing statistics: a slot is late if its bytes move more than LATE_SLOT_NSEC
+// after it starts; the errors of the wakeups past their deadlines are counted
+// in buckets of powers of two of usec (the last one open)
+#define LATE_SLOT_NSEC 1000000
+#define WAKE_ERROR_BUCKETS 21
+#define MAX_SPIN_USEC 1000
+
+// Bit error models
+#define NOISE_NONE 0
+#define NOISE_IID 1     // Independent bit errors
+#define NOISE_BURST 2   // Gilbert-Elliott: good and bad states of geometric lengths
+#define NEVER (INT64_MAX / 2)  // Events skipped when their probability is 0
+
+// Binary capture: records go through a ring mapped in memory, written to the
+// file by a thread that wakes up every CAPTURE_FLUSH_USEC
+#define CAPTURE_RING_RECORDS (1 << 16)  // 1 MiB
+#define CAPTURE_FLUSH_USEC 10000
+
+// Commands come from stdin, from the clients of the control socket (at most
+// MAX_CLIENTS at once) and from the events of a scenario
+#define MAX_CLIENTS 8
+#define PORT_WAIT_MSEC 1000  // Longest wait for a full port to take more bytes
+#define MAX_EVENT_SIZE 256
+
+// Directions, each with its own baud rate, propagation delay and errors
+#define TX2RX 0
+#define RX2TX 1
+
 // Current running parameters
 struct Parameters {
     int cableOn;
-    double byteER;   // Byte error rate
-    struct timespec byteDelay;
-    unsigned long propDelay;   // Desired propagation delay in usec
-    int bufSize;  // Dimensioned to enforce the propagation delay
-    char *tx2rx;
-    char *tx2rxValid;  // TRUE if corresponding entry holds a byte
-    long tx2rxIdx;     // Input index for the tx2rx buffer
-    char *rx2tx;
-    char *rx2txValid;  // TRUE if corresponding entry holds a byte
-    long rx2txIdx;     // Input index for the tx2rx buffer
+    uint64_t seed;
+    unsigned long baud;   // Of the faster direction: a byte slot lasts 10 bit times, 1e10 / baud nsec
+    long long slotFraction;  // Part of a nsec carried between slots, times baud
     FILE *logfile;
+    long spinNsec;  // Busy wait before each deadline instead of sleeping
+    uint64_t slotNumber;  // Byte slots since the cable started
 };
 
 struct Parameters par = {
     .cableOn = TRUE,
-    .byteER = 0.0,
-    .propDelay = 0,
-    .tx2rx = NULL,
-    .tx2rxValid = NULL,
-    .rx2tx = NULL,
-    .rx2txValid = NULL,
-    .logfile = NULL};
+    .seed = 1,
+    .logfile = NULL,
+    .spinNsec = 0};
+
+// One direction of the cable. Its bytes take the byte slots of its own baud
+// rate: all the cable's slots for the faster direction, a share of them spread
+// evenly for the other (credit adds the direction's rate every slot, and the
+// slot is the direction's when it reaches the cable's). A byte waits in the
+// ring for bufSize - 1 of the direction's slots, the propagation delay.
+struct Line {
+    unsigned long baud;
+    long long credit;
+    unsigned long propDelay;   // Desired propagation delay in usec
+    int bufSize;  // Dimensioned to enforce the propagation delay
+    char *ring;
+    char *valid;  // TRUE if corresponding entry holds a byte
+    long idx;     // Input index
+};
+
+struct Line line[2];
+
+// How closely the cable keeps to the byte slots, so a benchmark result can be
+// told from an emulator that couldn't keep up
+struct Pacing {
+    long long wakeups;       // Sleeps that ended
+    long long wakeErrorSum;  // nsec past the deadline
+    long long wakeErrorMax;
+    long long wakeErrors[WAKE_ERROR_BUCKETS];  // Bucket i: under 2^i usec
+    long long slots;         // Byte slots served
+    long long lateSlots;     // of those, served over LATE_SLOT_NSEC after they started
+    long long slotLagMax;    // nsec
+    long long catchUps;      // Wakeups with more than BATCH_MAX_SLOTS slots due
+    long long droppedBytes;  // Bytes a port didn't take within PORT_WAIT_MSEC
+};
+
+struct Pacing pacing;
+
+// Errors of one direction: the model set by the commands, and its state. The
+// distance to the next event of each kind is drawn when the previous one
+// happens (geometric skip-ahead), so the clean bytes in between cost no random
+// numbers.
+struct Noise {
+    int model;               // NOISE_*
+    double ber;              // Bit error rate of NOISE_IID
+    double goodBer;          // Bit error rates of the states of NOISE_BURST
+    double badBer;
+    double goodLength;       // Mean bits in the good and bad states
+    double badLength;
+    double dropRate;         // Bytes lost and spurious bytes received, per byte
+    double insertRate;
+    uint64_t random;         // xorshift64* state
+    int bad;                 // Gilbert-Elliott state
+    long long bitsToSwitch;  // Bits left in the current state
+    long long bitsToError;   // Clean bits before the next bit error
+    long long bytesToDrop;   // Bytes before the next one lost
+    long long bytesToInsert; // Bytes before the next spurious one
+};
+
+struct Noise noise[2];
+
+// Binary capture in progress ("capture <file>", see capture.h)
+struct Capture {
+    int fd;                       // -1 if not capturing
+    struct CaptureRecord *ring;   // CAPTURE_RING_RECORDS records
+    uint64_t head;                // Records added, by the cable loop
+    uint64_t tail;                // Records written, by the flush thread
+    uint64_t lost;                // Records dropped because the ring was full
+    int running;
+    pthread_t flusher;
+    long long start;              // Monotonic time of the start, nsec
+};
+
+struct Capture capture = { .fd = -1 };
+
+// Pseudo-terminal standing for one serial port: the endpoint opens the link
+// to the terminal side, the cable reads and writes the master side
+struct Pty {
+    const char *link;       // Published path of the serial port
+    char name[PATH_MAX];    // Terminal side
+    int master;
+    int terminal;           // Held open, so the port lives between endpoints
+};
+
+struct Pty txPty = { .link = TXDEV, .master = -1, .terminal = -1 };
+struct Pty rxPty = { .link = RXDEV, .master = -1, .terminal = -1 };
+
+volatile sig_atomic_t interrupted = FALSE;
+
+// While the line has no impairment (no errors, drops or insertions, no
+// propagation delay, cable on, not logging) the bytes bypass the engine: they
+// go from one master to the other through a pipe with splice, without being
+// copied to the cable, still at most one per byte slot.
+struct Bypass {
+    int pipe[2];
+    long pending;  // Bytes paced into the pipe, not yet written out
+};
+
+struct Bypass bypass[2] = { { .pipe = { -1, -1 } }, { .pipe = { -1, -1 } } };
+int spliceWorks = TRUE;  // Cleared if the kernel can't splice pseudo-terminals
+
+// Command of a scenario, run at a time after the scenario started
+struct Event {
+    long long time;  // nsec
+    char command[MAX_EVENT_SIZE];
+};
+
+// Client of the control socket, with the part of a line read so far
+struct Client {
+    int fd;  // -1 if the slot is free
+    char line[BUF_SIZE];
+    int length;
+};
+
+// The control thread reads the commands from stdin, the control socket and
+// the scenario, and hands them to the cable loop one at a time: the loop only
+// checks pending when it wakes up, and runs the command between two batches.
+struct Control {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    char command[BUF_SIZE];
+    int pending;              // The command awaits the loop
+    FILE *reply;              // Copy of the messages of the command, for a client
+    int stdinOpen;
+    char stdinLine[BUF_SIZE];
+    int stdinLength;
+    const char *socketPath;   // NULL without a control socket
+    int listener;
+    ino_t socketInode;
+    struct Client clients[MAX_CLIENTS];
+    struct Event *events;     // Scenario, in order of time
+    int eventCount;
+    int nextEvent;
+    long long scenarioStart;  // Monotonic, nsec
+};
+
+struct Control control = { .lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER,
+                           .stdinOpen = TRUE, .listener = -1 };
+
+
+// Print a message of a command, also to the client of the control socket
+// that sent it
+void say(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    if (control.reply != NULL)
+    {
+        va_start(args, format);
+        vfprintf(control.reply, format, args);
+        va_end(args);
+    }
+}
+
 
-// Returns: serial port file descriptor (fd).
-int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
+// Create a pseudo-terminal pair, raw like a serial port, and point pty->link
+// at its terminal side (replacing what was there, like socat's link option).
+// Returns the master side, read and written without blocking, or -1.
+int open_pty(struct Pty *pty)
 {
-    int fd = open(serialPort, O_RDWR | O_NONBLOCK | O_NOCTTY);
+    pty->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (pty->master < 0 || grantpt(pty->master) < 0 || unlockpt(pty->master) < 0 ||
+        ptsname_r(pty->master, pty->name, sizeof(pty->name)) != 0)
+    {
+        return -1;
+    }
+    pty->terminal = open(pty->name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (pty->terminal < 0)
+    {
+        return -1;
+    }
 
-    if (fd < 0)
+    struct termios tio;
+    memset(&tio, 0, sizeof(tio));
+    tio.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
+    tio.c_iflag = IGNPAR;
+    tio.c_cc[VTIME] = 0;
+    tio.c_cc[VMIN] = 0;
+    if (tcsetattr(pty->terminal, TCSANOW, &tio) < 0 || chmod(pty->name, 0666) < 0)
+    {
         return -1;
+    }
 
-    // Save current port settings
-    if (tcgetattr(fd, oldtio) == -1)
+    // Replace the link atomically, so an endpoint never finds it missing
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.%d", pty->link, (int) getpid());
+    unlink(temporary);
+    if (symlink(pty->name, temporary) < 0)
+    {
+        return -1;
+    }
+    if (rename(temporary, pty->link) < 0)
+    {
+        unlink(temporary);
         return -1;
+    }
+    printf("%s -> %s\n", pty->link, pty->name);
+    return pty->master;
+}
+
+
+// Remove the link if it still points at this cable's pseudo-terminal (another
+// cable may have taken the name over) and close both sides
+void close_pty(struct Pty *pty)
+{
+    char target[PATH_MAX];
+    ssize_t length = readlink(pty->link, target, sizeof(target) - 1);
+    if (length >= 0)
+    {
+        target[length] = '\0';
+        if (strcmp(target, pty->name) == 0)
+        {
+            unlink(pty->link);
+        }
+    }
+    if (pty->terminal >= 0)
+    {
+        close(pty->terminal);
+    }
+    if (pty->master >= 0)
+    {
+        close(pty->master);
+    }
+}
+
+
+int bypass_enabled(void)
+{
+    for (int direction = TX2RX; direction <= RX2TX; direction++)
+    {
+        const struct Noise *n = &noise[direction];
+        if (n->model != NOISE_NONE || n->dropRate > 0.0 || n->insertRate > 0.0 || line[direction].bufSize != 1)
+        {
+            return FALSE;
+        }
+    }
+    return spliceWorks && par.cableOn && par.logfile == NULL && capture.fd < 0;
+}
 
-    memset(newtio, 0, sizeof(*newtio));
-    newtio->c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio->c_iflag = IGNPAR;
-    newtio->c_oflag = 0;
-    newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 0; // Inter-character timer unused (polling mode)
-    newtio->c_cc[VMIN] = 0;  // Read without blocking
-    tcflush(fd, TCIOFLUSH);
 
-    if (tcsetattr(fd, TCSANOW, newtio) == -1)
+// Move the bytes of up to slots slots from in to out through the pipe.
+// Returns -1 if splice is not supported.
+int bypass_move(struct Bypass *b, int in, int out, long slots)
+{
+    ssize_t moved = splice(in, NULL, b->pipe[1], NULL, slots, SPLICE_F_NONBLOCK);
+    if (moved < 0 && errno == EINVAL)
+    {
         return -1;
+    }
+    if (moved > 0)
+    {
+        b->pending += moved;
+    }
+    if (b->pending > 0)
+    {
+        moved = splice(b->pipe[0], NULL, out, NULL, b->pending, SPLICE_F_NONBLOCK);
+        if (moved < 0 && errno == EINVAL)
+        {
+            return -1;
+        }
+        if (moved > 0)
+        {
+            b->pending -= moved;
+        }
+    }
+    return 0;
+}
+
+
+// Write count bytes to a port, waiting for it to take them while it is full.
+// Bytes it doesn't take within PORT_WAIT_MSEC (nobody reads the other end) are
+// dropped and counted in the pacing statistics.
+// Returns the number of bytes written.
+long write_port(int out, const unsigned char *buf, long count)
+{
+    long written = 0;
+    while (written < count)
+    {
+        ssize_t result = write(out, buf + written, count - written);
+        if (result > 0)
+        {
+            written += result;
+        }
+        else if (result < 0 && errno != EINTR)
+        {
+            struct pollfd pfd = { .fd = out, .events = POLLOUT };
+            if (errno != EAGAIN || poll(&pfd, 1, PORT_WAIT_MSEC) <= 0)
+            {
+                break;
+            }
+        }
+    }
+    pacing.droppedBytes += count - written;
+    return written;
+}
+
 
-    return fd;
+// Write out what is left in the pipe before the engine takes over again. If a
+// port stops taking it, the rest of the pipe is dropped as well.
+void bypass_flush(struct Bypass *b, int out)
+{
+    unsigned char buf[BUF_SIZE];
+    while (b->pending > 0)
+    {
+        ssize_t count = read(b->pipe[0], buf, b->pending < BUF_SIZE ? b->pending : BUF_SIZE);
+        if (count <= 0)
+        {
+            break;
+        }
+        b->pending -= count;
+        if (write_port(out, buf, count) < count)
+        {
+            ssize_t discarded;
+            while ((discarded = read(b->pipe[0], buf, sizeof(buf))) > 0)
+            {
+                pacing.droppedBytes += discarded;
+            }
+            break;
+        }
+    }
+    b->pending = 0;
+}
+
+
+void on_signal(int signum)
+{
+    interrupted = TRUE;
 }
 
 
@@ -90,45 +430,104 @@ void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
 }
 
 
-// Initialize the ring buffers that implement the propagation delay
+// Name of the directions from first to last in the messages of the commands
+const char *scope(int first, int last)
+{
+    return first != last ? "" : first == TX2RX ? "TX->RX " : "RX->TX ";
+}
+
+
+// Initialize the ring buffer that implements the propagation delay of a
+// direction
 // Returns 0 on success, -1 on failure
-int init_ring_buffers(void)
+int init_ring_buffer(int direction)
 {
-    long nsecPropDelay = 1000 * par.propDelay;
-    long bytesInFlight = nsecPropDelay / par.byteDelay.tv_nsec;
-    // Round instead of truncating
-    if (nsecPropDelay % par.byteDelay.tv_nsec > par.byteDelay.tv_nsec / 2)
-    {
-        ++bytesInFlight;
-    }
-    long actualPropDelay = bytesInFlight * par.byteDelay.tv_nsec / 1000; // usec
-    par.bufSize = bytesInFlight + 1;
-    par.tx2rx = realloc(par.tx2rx, par.bufSize);
-    par.tx2rxValid = realloc(par.tx2rxValid, par.bufSize);
-    par.rx2tx = realloc(par.rx2tx, par.bufSize);
-    par.rx2txValid = realloc(par.rx2txValid, par.bufSize);
-    if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
+    struct Line *l = &line[direction];
+    // Byte slots in flight, rounded instead of truncated
+    long bytesInFlight = (l->propDelay * l->baud + 5000000) / 10000000;
+    l->bufSize = bytesInFlight + 1;
+    l->ring = realloc(l->ring, l->bufSize);
+    l->valid = realloc(l->valid, l->bufSize);
+    if (l->ring == NULL || l->valid == NULL)
     {
         return -1;
     }
-    bzero(par.tx2rxValid, par.bufSize);
-    bzero(par.rx2txValid, par.bufSize);
-    par.tx2rxIdx = 0;
-    par.rx2txIdx = 0;
-    printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
+    bzero(l->valid, l->bufSize);
+    l->idx = 0;
     return 0;
 }
 
 
-// Set the byte delay corresponding to the selected baud rate
-void set_baud_rate(unsigned long baud)
+// Show the propagation delay of the directions from first to last, once if
+// they have the same
+void say_prop_delay(int first, int last)
+{
+    for (int direction = first; direction <= last; direction++)
+    {
+        const struct Line *l = &line[direction];
+        long actualPropDelay = (l->bufSize - 1) * 10000000L / l->baud; // usec
+        int same = first != last && line[last].bufSize == l->bufSize && line[last].baud == l->baud &&
+                   line[last].propDelay == l->propDelay;
+        say("%sPROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n",
+            same ? "" : scope(direction, direction), actualPropDelay, l->propDelay);
+        if (same)
+        {
+            break;
+        }
+    }
+}
+
+
+// Add a record to the capture ring; if the flush thread is behind, the
+// record is counted as lost rather than delaying the byte slots
+void capture_record(int type, int flags, unsigned char byte, uint64_t slot, long long time)
+{
+    uint64_t head = capture.head;
+    if (head - __atomic_load_n(&capture.tail, __ATOMIC_ACQUIRE) == CAPTURE_RING_RECORDS)
+    {
+        ++capture.lost;
+        return;
+    }
+    struct CaptureRecord *record = &capture.ring[head % CAPTURE_RING_RECORDS];
+    record->time = time - capture.start;
+    record->slot = (uint32_t) slot;
+    record->type = type;
+    record->flags = flags;
+    record->byte = byte;
+    record->reserved = 0;
+    __atomic_store_n(&capture.head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+// Set the byte delay corresponding to the selected baud rate for the
+// directions from first to last
+void set_baud_rate(int first, int last, unsigned long baud)
 {
-    // 10 bit times per byte; delay in nanoseconds
-    double delay = 1.0e10 / baud;
-    par.byteDelay.tv_sec = 0;
-    par.byteDelay.tv_nsec = (long) delay;
-    printf("BAUD RATE: %lu\n", baud);
-    init_ring_buffers();
+    for (int direction = first; direction <= last; direction++)
+    {
+        line[direction].baud = baud;
+        init_ring_buffer(direction);
+    }
+
+    // The cable's slots are those of the faster direction: 10 bit times per
+    // byte, kept as the rate so that slots of a fractional number of
+    // nanoseconds don't drift
+    par.baud = line[TX2RX].baud > line[RX2TX].baud ? line[TX2RX].baud : line[RX2TX].baud;
+    par.slotFraction = 0;
+    line[TX2RX].credit = 0;
+    line[RX2TX].credit = 0;
+    if (capture.fd >= 0)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int direction = first; direction <= last; direction++)
+        {
+            // The record's slot field carries the baud rate
+            capture_record(CAPTURE_BAUD, 0, direction, baud, now.tv_sec * 1000000000LL + now.tv_nsec);
+        }
+    }
+    say("%sBAUD RATE: %lu\n", scope(first, last), baud);
+    say_prop_delay(first, last);
 }
 
 
@@ -167,6 +566,29 @@ struct timespec timespec_sum(const struct timespec *t1, const struct timespec *t
 }
 
 
+// Add nsec nanoseconds to a timespec
+struct timespec timespec_add_nsec(const struct timespec *t, long long nsec)
+{
+    struct timespec sum = { .tv_sec = t->tv_sec + nsec / 1000000000,
+                            .tv_nsec = t->tv_nsec + nsec % 1000000000 };
+    if (sum.tv_nsec >= 1000000000) {
+        sum.tv_nsec -= 1000000000;
+        ++sum.tv_sec;
+    }
+    return sum;
+}
+
+
+// Start of the slot that comes the given number of byte slots after the one
+// starting at t, carrying the fraction of nanosecond in par.slotFraction
+struct timespec timespec_add_slots(const struct timespec *t, long slots)
+{
+    long long scaled = slots * 10000000000LL + par.slotFraction;  // nsec * baud
+    par.slotFraction = scaled % par.baud;
+    return timespec_add_nsec(t, scaled / par.baud);
+}
+
+
 // Compare two timespecs returning -1, 0 or 1 if t1 is less than, equal or
 // greater than t2, respectively
 int timespec_comp(const struct timespec *t1, const struct timespec *t2)
@@ -197,362 +619,1384 @@ int timespec_is_negative(const struct timespec *t)
 }
 
 
-void endlog(void)
+// Sleep until the absolute deadline, on the monotonic clock, so that the time
+// spent between deadlines doesn't accumulate. The last par.spinNsec are
+// busy-waited, trading CPU for a wakeup closer to the deadline.
+void sleep_until(const struct timespec *deadline)
 {
-    if (par.logfile != NULL)
+    if (par.spinNsec <= 0)
     {
-        fclose(par.logfile);
-        par.logfile = NULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+        return;
     }
+
+    struct timespec spin = { .tv_sec = 0, .tv_nsec = par.spinNsec };
+    struct timespec early = timespec_diff(deadline, &spin);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &early, NULL);
+    struct timespec now;
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (timespec_comp(&now, deadline) < 0);
 }
 
 
-void startlog(const char *filename)
+// Next number of the direction's generator, so a seed gives the same errors
+// on every run (same generator as the simulated link)
+uint64_t next_random(struct Noise *n)
 {
-    endlog();
-    par.logfile = fopen(filename, "w");
-    if (par.logfile != NULL)
+    uint64_t x = n->random;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    n->random = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+// Natural logarithm of x > 0 without libm: x = m 2^e with m in [1, 2), and
+// ln m = 2 atanh((m - 1) / (m + 1)) by its series
+double natural_log(double x)
+{
+    int e = 0;
+    while (x >= 2.0)
     {
-        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
-        printf("LOGGING TO FILE %s\n", filename);
+        x /= 2.0;
+        ++e;
     }
-    else
+    while (x < 1.0)
     {
-        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
+        x *= 2.0;
+        --e;
     }
+    double y = (x - 1.0) / (x + 1.0);
+    double y2 = y * y;
+    double term = y;
+    double sum = 0.0;
+    for (int k = 1; k < 40; k += 2)
+    {
+        sum += term / k;
+        term *= y2;
+    }
+    return 2.0 * sum + e * 0.69314718055994530942;
 }
 
 
-// Show help
-void help()
+// Failures before the first success of trials that succeed with probability p
+long long geometric(struct Noise *n, double p)
 {
-    printf("\n\n"
-           "Transmitter must open " TXDEV "\n"
-           "Receiver must open " RXDEV "\n"
-           "\n"
-           "The cable program is sensible to the following interactive commands:\n"
-           "--- help         : show this help\n"
-           "--- on           : connect the cable and data is exchanged (default state)\n"
-           "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
-           "--- baud <rate>  : set baud rate, between 1200 and 115200 (default=9600)\n"
-           "                   note that 10 bits are sent per byte (8-N-1)\n"
-           "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
-           "                   will be approximated to an integer multiple of the byte\n"
-           "                   delay (10 / baud_rate)\n"
-           "--- log <file>   : log transmitted data to file\n"
-           "--- endlog       : stop logging transmitted data\n"
-           "--- quit         : terminate the program\n"
-           "\n"
-           "IMPORTANT: Changing the baud rate or propagation delay while a transmission is\n"
-           "           ongoing will result in losses.\n"
-           "\n");
+    if (p <= 0.0)
+    {
+        return NEVER;
+    }
+    if (p >= 1.0)
+    {
+        return 0;
+    }
+    double u = ((next_random(n) >> 11) + 1) * 0x1.0p-53;  // In (0, 1]
+    double k = natural_log(u) / natural_log(1.0 - p);
+    return k < NEVER ? (long long) k : NEVER;
 }
 
-int main(int argc, char *argv[])
+
+// Bit error rate of the current state of the direction
+double noise_ber(const struct Noise *n)
 {
-    printf("\n");
+    if (n->model == NOISE_BURST)
+    {
+        return n->bad ? n->badBer : n->goodBer;
+    }
+    return n->ber;
+}
 
-    system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorTx,mode=777,raw,echo=0 &");
-    sleep(1);
-    printf("\n");
 
-    system("socat -dd PTY,link=" RXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorRx,mode=777,raw,echo=0 &");
-    sleep(1);
+// Draw the distances to the next events of a direction after its error
+// parameters change; a new seed also restarts its generator
+void noise_reset(int direction, int reseed)
+{
+    struct Noise *n = &noise[direction];
+    if (reseed)
+    {
+        // Spread the seed over the state (splitmix64), so nearby seeds and
+        // the two directions give unrelated errors
+        uint64_t z = par.seed * 2 + direction + 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        n->random = z ? z : 1;
+    }
+    n->bad = FALSE;
+    n->bitsToSwitch = n->model == NOISE_BURST ? geometric(n, 1.0 / n->goodLength) + 1 : NEVER;
+    n->bitsToError = n->model != NOISE_NONE ? geometric(n, noise_ber(n)) : NEVER;
+    n->bytesToDrop = geometric(n, n->dropRate);
+    n->bytesToInsert = geometric(n, n->insertRate);
+}
 
-    help();
 
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
+// Flip the bits of a byte hit by the bit error model (any number of them)
+unsigned char noise_bits(struct Noise *n, unsigned char byte)
+{
+    int bit = 0;
+    while (bit < 8)
+    {
+        // Bits of the byte left in the current state
+        long long span = 8 - bit < n->bitsToSwitch ? 8 - bit : n->bitsToSwitch;
+        if (n->bitsToError < span)
+        {
+            bit += n->bitsToError;
+            byte ^= 1 << bit;
+            ++bit;
+            n->bitsToSwitch -= n->bitsToError + 1;
+            n->bitsToError = geometric(n, noise_ber(n));
+        }
+        else
+        {
+            bit += span;
+            n->bitsToError -= span;
+            n->bitsToSwitch -= span;
+        }
+
+        if (n->bitsToSwitch == 0)
+        {
+            // Errors are memoryless, so the distance to the next one is drawn
+            // again at the rate of the new state
+            n->bad = !n->bad;
+            n->bitsToSwitch = geometric(n, 1.0 / (n->bad ? n->badLength : n->goodLength)) + 1;
+            n->bitsToError = geometric(n, noise_ber(n));
+        }
+    }
+    return byte;
+}
 
-    int fdTx = openSerialPort("/dev/emulatorTx", &oldtioTx, &newtioTx);
 
-    if (fdTx < 0)
+// Put a byte on the line of a direction, with its errors, into out, and set
+// *errors to what happened to it (CAPTURE_CORRUPTED, CAPTURE_DROPPED and
+// CAPTURE_INSERTED if a spurious byte follows it).
+// Returns the number of bytes received.
+int noise_byte(struct Noise *n, unsigned char *byte, unsigned char *out, int *errors)
+{
+    *errors = 0;
+    if (n->bitsToError < 8 || n->bitsToSwitch <= 8)
     {
-        perror("Opening Tx emulator serial port");
-        exit(-1);
+        unsigned char sent = *byte;
+        *byte = noise_bits(n, sent);
+        if (*byte != sent)
+        {
+            *errors |= CAPTURE_CORRUPTED;
+        }
+    }
+    else
+    {
+        n->bitsToError -= 8;
+        n->bitsToSwitch -= 8;
+    }
+
+    int received = 1;
+    if (n->bytesToDrop-- == 0)
+    {
+        n->bytesToDrop = geometric(n, n->dropRate);
+        *errors |= CAPTURE_DROPPED;
+        received = 0;
+    }
+    else
+    {
+        out[0] = *byte;
+    }
+    if (n->bytesToInsert-- == 0)
+    {
+        n->bytesToInsert = geometric(n, n->insertRate);
+        *errors |= CAPTURE_INSERTED;
+        out[received++] = (unsigned char) next_random(n);
     }
+    return received;
+}
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
 
-    int fdRx = openSerialPort("/dev/emulatorRx", &oldtioRx, &newtioRx);
+// Read a rate in [0, 1) for a command
+int parse_rate(const char *text, double *rate)
+{
+    return sscanf(text, "%lf", rate) == 1 && *rate >= 0.0 && *rate < 1.0 ? 0 : -1;
+}
 
-    if (fdRx < 0)
+
+// Account a wakeup for the given deadline
+void pacing_wakeup(const struct timespec *deadline, const struct timespec *now)
+{
+    struct timespec diff = timespec_diff(now, deadline);
+    long long error = timespec_is_negative(&diff) ? 0 : diff.tv_sec * 1000000000LL + diff.tv_nsec;
+    int bucket = 0;
+    while (bucket < WAKE_ERROR_BUCKETS - 1 && error >= 1000LL << bucket)
     {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
+        ++bucket;
     }
+    ++pacing.wakeups;
+    pacing.wakeErrorSum += error;
+    if (error > pacing.wakeErrorMax)
+    {
+        pacing.wakeErrorMax = error;
+    }
+    ++pacing.wakeErrors[bucket];
+}
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
-
-    char rxStdin[BUF_SIZE] = {0};
 
-    int STOP = FALSE;
+// Account the slots served in a wakeup, the first of which started lag ago
+void pacing_slots(long slots, const struct timespec *lag)
+{
+    long long lagNsec = lag->tv_sec * 1000000000LL + lag->tv_nsec;
+    pacing.slots += slots;
+    if (lagNsec > pacing.slotLagMax)
+    {
+        pacing.slotLagMax = lagNsec;
+    }
+    if (lagNsec > LATE_SLOT_NSEC)
+    {
+        // Slots start one slot time apart after the first
+        long long late = (lagNsec - LATE_SLOT_NSEC) / (10000000000LL / par.baud) + 1;
+        pacing.lateSlots += late < slots ? late : slots;
+    }
+}
 
-    set_baud_rate(DEFAULT_BAUDRATE);
 
-    set_rt_priority();
+void pacing_print(void)
+{
+    long long p99 = 0;
+    long long count = 0;
+    for (int bucket = 0; bucket < WAKE_ERROR_BUCKETS; bucket++)
+    {
+        count += pacing.wakeErrors[bucket];
+        if (count * 100 >= pacing.wakeups * 99)
+        {
+            p99 = bucket < WAKE_ERROR_BUCKETS - 1 ? 1LL << bucket : pacing.wakeErrorMax / 1000 + 1;
+            break;
+        }
+    }
+    say("PACING: %lld wakeups, past the deadline by %.1f usec on average, under %lld usec for 99%%, at most %.1f usec\n",
+        pacing.wakeups, pacing.wakeups > 0 ? pacing.wakeErrorSum / 1000.0 / pacing.wakeups : 0.0,
+        p99, pacing.wakeErrorMax / 1000.0);
+    say("PACING: %lld byte slots, %lld late by over %d usec (%.4f%%), at most %.1f usec late, %lld catch-ups\n",
+        pacing.slots, pacing.lateSlots, LATE_SLOT_NSEC / 1000,
+        pacing.slots > 0 ? 100.0 * pacing.lateSlots / pacing.slots : 0.0,
+        pacing.slotLagMax / 1000.0, pacing.catchUps);
+    if (pacing.droppedBytes > 0)
+    {
+        say("PACING: %lld bytes dropped by ports that didn't take them\n", pacing.droppedBytes);
+    }
+}
 
-    // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
-    int cableIdle = FALSE;
 
-    printf("\nCable ready\n\n");
+// Record a byte leaving the cable in a direction (CAPTURE_*_OUT), with the
+// errors noise_byte reported and the bytes it put in out
+void capture_out(int type, int errors, unsigned char byte, const unsigned char *out, uint64_t slot, long long time)
+{
+    capture_record(type, errors & ~CAPTURE_INSERTED, byte, slot, time);
+    if (errors & CAPTURE_INSERTED)
+    {
+        capture_record(type, CAPTURE_INSERTED, out[errors & CAPTURE_DROPPED ? 0 : 1], slot, time);
+    }
+}
 
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
-    int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
 
-    while (STOP == FALSE)
+// Flush thread: write the records of the ring to the file until the capture
+// ends and the ring is empty
+void *capture_flush(void *unused)
+{
+    for (;;)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
-        if (timeDiff.tv_sec >= 1)
+        uint64_t head = __atomic_load_n(&capture.head, __ATOMIC_ACQUIRE);
+        uint64_t tail = capture.tail;
+        if (head == tail)
         {
-            if (unreliableRate == FALSE)
+            // The last records are added before running is cleared
+            if (!__atomic_load_n(&capture.running, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&capture.head, __ATOMIC_ACQUIRE) == tail)
             {
-                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
-                       "No further warnings will be issued\n");
-                unreliableRate = TRUE;
+                break;
             }
+            usleep(CAPTURE_FLUSH_USEC);
+            continue;
         }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
+
+        // Up to the end of the ring at a time
+        uint64_t count = head - tail;
+        uint64_t untilEnd = CAPTURE_RING_RECORDS - tail % CAPTURE_RING_RECORDS;
+        if (count > untilEnd)
         {
-            skipWait = TRUE;
+            count = untilEnd;
         }
-        else
+        const char *bytes = (const char *) &capture.ring[tail % CAPTURE_RING_RECORDS];
+        size_t size = count * sizeof(struct CaptureRecord);
+        while (size > 0)
         {
-            skipWait = FALSE;
+            ssize_t written = write(capture.fd, bytes, size);
+            if (written < 0)
+            {
+                perror("Writing the capture");
+                break;
+            }
+            bytes += written;
+            size -= written;
         }
+        __atomic_store_n(&capture.tail, tail + count, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+
+void endcapture(void)
+{
+    if (capture.fd < 0)
+    {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    capture_record(CAPTURE_END, 0, 0, par.slotNumber, now.tv_sec * 1000000000LL + now.tv_nsec);
+    __atomic_store_n(&capture.running, FALSE, __ATOMIC_RELEASE);
+    pthread_join(capture.flusher, NULL);
+    close(capture.fd);
+    munmap(capture.ring, CAPTURE_RING_RECORDS * sizeof(struct CaptureRecord));
+    say("CAPTURED %llu RECORDS, %llu LOST\n", (unsigned long long) capture.tail,
+        (unsigned long long) capture.lost);
+    capture.fd = -1;
+    capture.ring = NULL;
+}
+
+
+void startcapture(const char *filename)
+{
+    endcapture();
+    capture.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture.fd < 0)
+    {
+        say("ERROR OPENING FILE %s, NOT CAPTURING\n", filename);
+        return;
+    }
+    capture.ring = mmap(NULL, CAPTURE_RING_RECORDS * sizeof(struct CaptureRecord), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (capture.ring == MAP_FAILED)
+    {
+        perror("Mapping the capture ring");
+        close(capture.fd);
+        capture.fd = -1;
+        capture.ring = NULL;
+        return;
+    }
 
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
+    struct timespec now, wall;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    struct CaptureHeader header = { .version = CAPTURE_VERSION, .baud = par.baud,
+                                    .startTime = wall.tv_sec * 1000000000ULL + wall.tv_nsec,
+                                    .firstSlot = par.slotNumber,
+                                    .lineBaud = { line[TX2RX].baud, line[RX2TX].baud } };
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    if (write(capture.fd, &header, sizeof(header)) != sizeof(header))
+    {
+        perror("Writing the capture");
+    }
+    capture.start = now.tv_sec * 1000000000LL + now.tv_nsec;
+    capture.head = 0;
+    capture.tail = 0;
+    capture.lost = 0;
+    capture.running = TRUE;
+    if (pthread_create(&capture.flusher, NULL, capture_flush, NULL) != 0)
+    {
+        say("ERROR STARTING THE CAPTURE THREAD, NOT CAPTURING\n");
+        munmap(capture.ring, CAPTURE_RING_RECORDS * sizeof(struct CaptureRecord));
+        close(capture.fd);
+        capture.fd = -1;
+        capture.ring = NULL;
+        return;
+    }
+    say("CAPTURING TO FILE %s\n", filename);
+}
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
 
-        if (!par.cableOn)
+void endlog(void)
+{
+    if (par.logfile != NULL)
+    {
+        fclose(par.logfile);
+        par.logfile = NULL;
+    }
+}
+
+
+void startlog(const char *filename)
+{
+    endlog();
+    par.logfile = fopen(filename, "w");
+    if (par.logfile != NULL)
+    {
+        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
+        say("LOGGING TO FILE %s\n", filename);
+    }
+    else
+    {
+        say("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
+    }
+}
+
+
+// Show help
+void help()
+{
+    say("\n\n"
+        "Transmitter must open %s\n"
+        "Receiver must open %s\n"
+        "\n"
+        "The cable program is sensible to the following commands, typed or sent to\n"
+        "the control socket (-c <path>, one per line, each answered with its\n"
+        "messages and a line with a single dot):\n"
+        "--- help         : show this help\n"
+        "--- on           : connect the cable and data is exchanged (default state)\n"
+        "--- off          : disconnect the cable disabling data to be exchanged\n"
+        "--- ber <ber>    : add independent bit errors at a specified BER (default=0)\n"
+        "--- burst <good> <bad> <bad_ber> [<good_ber>]\n"
+        "                 : Gilbert-Elliott burst errors: the line alternates between\n"
+        "                   a good and a bad state lasting <good> and <bad> bits on\n"
+        "                   average, with their own BER (good_ber defaults to 0)\n"
+        "--- burst off    : back to the independent errors of \"ber\"\n"
+        "--- drop <rate>  : lose bytes at a specified rate per byte (default=0)\n"
+        "--- insert <rate>: receive spurious bytes at a specified rate per byte\n"
+        "                   (default=0)\n"
+        "--- seed <n>     : restart the error generators from seed n (default=1), so\n"
+        "                   the same traffic gets the same errors\n"
+        "--- baud <rate>  : set baud rate, between 50 and 4000000 (default=9600)\n"
+        "                   note that 10 bits are sent per byte (8-N-1); any rate\n"
+        "                   is paced, the endpoints need a termios one\n"
+        "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
+        "                   will be approximated to an integer multiple of the byte\n"
+        "                   delay (10 / baud_rate)\n"
+        "--- tx2rx <command>, rx2tx <command>\n"
+        "                 : apply ber, burst, drop, insert, baud or prop to one\n"
+        "                   direction only (without it, they apply to both), e.g.\n"
+        "                   \"rx2tx ber 1e-4\" for a noisy return path; the cable\n"
+        "                   runs at the faster baud rate, the slower direction gets\n"
+        "                   its share of the byte slots\n"
+        "--- spin <usec>  : busy-wait the last usec before each deadline instead of\n"
+        "                   sleeping (0-1000, default=0)\n"
+        "--- stats        : show the pacing statistics (wakeups past their deadline,\n"
+        "                   late byte slots)\n"
+        "--- stats reset  : clear the pacing statistics\n"
+        "--- log <file>   : log transmitted data to file\n"
+        "--- endlog       : stop logging transmitted data\n"
+        "--- capture <file>: capture the bytes in and out of the cable to file in a\n"
+        "                   compact binary format, timestamped; convert it with\n"
+        "                   bin/capture (text as \"log\", or pcap)\n"
+        "--- endcapture   : stop capturing\n"
+        "--- scenario <file>: run the commands of file at their times, counted from\n"
+        "                   now: one per line as \"<time> <command>\", the time in s\n"
+        "                   (or with the unit s, ms or us), \"+\" for one relative to\n"
+        "                   the previous line, e.g. \"10 off\" then \"+300ms on\"\n"
+        "--- scenario off : stop the scenario\n"
+        "--- quit         : terminate the program\n"
+        "\n"
+        "IMPORTANT: Changing the baud rate or propagation delay while a transmission is\n"
+        "           ongoing will result in losses.\n"
+        "\n", txPty.link, rxPty.link);
+}
+
+// Run a command that sets the line of the directions from first to last
+// (baud rate, propagation delay and errors).
+// Returns FALSE if it is not one of them.
+int run_line_command(const char *command, int first, int last)
+{
+    if (strncmp(command, "ber ", 4) == 0)
+    {
+        double ber;
+        if (parse_rate(command + 4, &ber) < 0)
         {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
+            say("BAD BER VALUE (MUST BE 0 <= BER < 1.0)\n");
         }
-
-        if (par.logfile != NULL)  // Currently logging
+        else
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
+            for (int direction = first; direction <= last; direction++)
             {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
+                noise[direction].model = ber > 0.0 ? NOISE_IID : NOISE_NONE;
+                noise[direction].ber = ber;
+                noise_reset(direction, FALSE);
             }
-            else
+            say("%sBER SET TO %lf\n", scope(first, last), ber);
+        }
+    }
+    else if (strcmp(command, "burst off") == 0)
+    {
+        for (int direction = first; direction <= last; direction++)
+        {
+            struct Noise *n = &noise[direction];
+            n->model = n->ber > 0.0 ? NOISE_IID : NOISE_NONE;
+            noise_reset(direction, FALSE);
+            say("%sBURST NOISE OFF, BER %lf\n", first == last || noise[TX2RX].ber != noise[RX2TX].ber ?
+                scope(direction, direction) : "", n->ber);
+            if (first != last && noise[TX2RX].ber == noise[RX2TX].ber)
             {
-                memcpy(tx2rxTx, "  ", 3);
+                break;
             }
-            if (par.rx2txValid[par.rx2txIdx])
+        }
+    }
+    else if (strncmp(command, "burst ", 6) == 0)
+    {
+        double goodLength, badLength, badBer, goodBer = 0.0;
+        int fields = sscanf(command + 6, "%lf %lf %lf %lf", &goodLength, &badLength, &badBer, &goodBer);
+        if (fields < 3 || goodLength < 1.0 || badLength < 1.0 ||
+            badBer < 0.0 || badBer >= 1.0 || goodBer < 0.0 || goodBer >= 1.0)
+        {
+            say("BAD BURST PARAMETERS (burst <good bits> <bad bits> <bad ber> [<good ber>])\n");
+        }
+        else
+        {
+            for (int direction = first; direction <= last; direction++)
             {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                struct Noise *n = &noise[direction];
+                n->model = NOISE_BURST;
+                n->goodLength = goodLength;
+                n->badLength = badLength;
+                n->badBer = badBer;
+                n->goodBer = goodBer;
+                noise_reset(direction, FALSE);
             }
-            else
+            say("%sBURST NOISE: GOOD STATE %g BITS AT BER %g, BAD STATE %g BITS AT BER %g (MEAN BER %g)\n",
+                scope(first, last), goodLength, goodBer, badLength, badBer,
+                (goodLength * goodBer + badLength * badBer) / (goodLength + badLength));
+        }
+    }
+    else if (strncmp(command, "drop ", 5) == 0)
+    {
+        double rate;
+        if (parse_rate(command + 5, &rate) < 0)
+        {
+            rate = 0.0;
+            say("BAD DROP RATE (MUST BE 0 <= RATE < 1.0), NOT DROPPING\n");
+        }
+        else
+        {
+            say("%sDROP RATE SET TO %lf\n", scope(first, last), rate);
+        }
+        for (int direction = first; direction <= last; direction++)
+        {
+            noise[direction].dropRate = rate;
+            noise_reset(direction, FALSE);
+        }
+    }
+    else if (strncmp(command, "insert ", 7) == 0)
+    {
+        double rate;
+        if (parse_rate(command + 7, &rate) < 0)
+        {
+            rate = 0.0;
+            say("BAD INSERT RATE (MUST BE 0 <= RATE < 1.0), NOT INSERTING\n");
+        }
+        else
+        {
+            say("%sINSERT RATE SET TO %lf\n", scope(first, last), rate);
+        }
+        for (int direction = first; direction <= last; direction++)
+        {
+            noise[direction].insertRate = rate;
+            noise_reset(direction, FALSE);
+        }
+    }
+    else if (strncmp(command, "baud ", 5) == 0)
+    {
+        unsigned long baud = 0;
+        sscanf(command + 5, "%lu", &baud);
+        if (baud >= MIN_BAUDRATE && baud <= MAX_BAUDRATE)
+        {
+            set_baud_rate(first, last, baud);
+        }
+        else
+        {
+            say("UNSUPPORTED BAUD RATE: must be between 50 and 4000000\n");
+        }
+    }
+    else if (strncmp(command, "prop ", 5) == 0)
+    {
+        unsigned long propDelay;
+        if (sscanf(command + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
+        {
+            say("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
+        }
+        else
+        {
+            for (int direction = first; direction <= last; direction++)
             {
-                memcpy(rx2txTx, "  ", 3);
+                line[direction].propDelay = propDelay;
+                init_ring_buffer(direction);
             }
+            say_prop_delay(first, last);
         }
+    }
+    else
+    {
+        return FALSE;
+    }
+    return TRUE;
+}
 
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
 
-        if (par.cableOn)
+// Run a command at the time now, between two batches.
+// Returns TRUE if it is the end of the program.
+int run_command(const char *command, const struct timespec *now)
+{
+    // The settings of the line apply to both directions, or to the one named
+    // first
+    if (strncmp(command, "tx2rx ", 6) == 0 || strncmp(command, "rx2tx ", 6) == 0)
+    {
+        int direction = command[0] == 't' ? TX2RX : RX2TX;
+        if (!run_line_command(command + 6, direction, direction))
+        {
+            say("BAD COMMAND OR MISSING PARAMETERS\n");
+        }
+        return FALSE;
+    }
+    if (run_line_command(command, TX2RX, RX2TX))
+    {
+        return FALSE;
+    }
+
+    if (strcmp(command, "off") == 0)
+    {
+        say("CONNECTION OFF\n");
+        if (par.cableOn && par.logfile != NULL)
+        {
+            fputs("CABLE OFF\n", par.logfile);
+        }
+        if (par.cableOn && capture.fd >= 0)
+        {
+            capture_record(CAPTURE_CABLE_OFF, 0, 0, par.slotNumber, now->tv_sec * 1000000000LL + now->tv_nsec);
+        }
+        par.cableOn = FALSE;
+    }
+    else if (strcmp(command, "on") == 0)
+    {
+        say("CONNECTION ON\n");
+        if (!par.cableOn && capture.fd >= 0)
+        {
+            capture_record(CAPTURE_CABLE_ON, 0, 0, par.slotNumber, now->tv_sec * 1000000000LL + now->tv_nsec);
+        }
+        par.cableOn = TRUE;
+    }
+    else if (strncmp(command, "seed ", 5) == 0)
+    {
+        unsigned long long seed;
+        if (sscanf(command + 5, "%llu", &seed) < 1)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
+            say("BAD SEED\n");
+        }
+        else
+        {
+            par.seed = seed;
+            noise_reset(TX2RX, TRUE);
+            noise_reset(RX2TX, TRUE);
+            say("SEED SET TO %llu\n", seed);
+        }
+    }
+    else if (strncmp(command, "spin ", 5) == 0)
+    {
+        long spin;
+        if (sscanf(command + 5, "%ld", &spin) < 1 || spin < 0 || spin > MAX_SPIN_USEC)
+        {
+            say("BAD OR OUT OF RANGE SPIN TIME\n");
+        }
+        else
+        {
+            par.spinNsec = spin * 1000;
+            say("SPIN SET TO %ld usec\n", spin);
+        }
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        pacing_print();
+    }
+    else if (strcmp(command, "stats reset") == 0)
+    {
+        memset(&pacing, 0, sizeof(pacing));
+        say("PACING STATISTICS RESET\n");
+    }
+    else if (strncmp(command, "log ", 4) == 0)
+    {
+        startlog(command + 4);
+    }
+    else if (strncmp(command, "capture ", 8) == 0)
+    {
+        startcapture(command + 8);
+    }
+    else if (strcmp(command, "endcapture") == 0)
+    {
+        endcapture();
+    }
+    else if (strcmp(command, "endlog") == 0)
+    {
+        endlog();
+        say("NOT LOGGING\n");
+    }
+    else if (strcmp(command, "quit") == 0)
+    {
+        say("END OF THE PROGRAM\n");
+        return TRUE;
+    }
+    else if (strcmp(command, "help") == 0) {
+        help();
+    }
+    else {
+        say("BAD COMMAND OR MISSING PARAMETERS\n");
+    }
+    return FALSE;
+}
+
+
+long long monotonic_nsec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+// Parse a time of a scenario: seconds, or a number followed by s, ms or us.
+// Returns 0 on success, -1 on error.
+int parse_time(const char *text, long long *nsec)
+{
+    double value;
+    char unit[4] = "s";
+    if (sscanf(text, "%lf%3s", &value, unit) < 1 || value < 0.0)
+    {
+        return -1;
+    }
+    double scale = strcmp(unit, "s") == 0 ? 1e9 : strcmp(unit, "ms") == 0 ? 1e6 : strcmp(unit, "us") == 0 ? 1e3 : 0.0;
+    *nsec = (long long) (value * scale + 0.5);
+    return scale > 0.0 ? 0 : -1;
+}
+
+
+// Load a scenario and start its clock. One event per line:
+//   <time> <command>
+// with the time since the start of the scenario, or since the previous event
+// if it starts with '+' (e.g. "10 off" then "+300ms on"); '#' starts a comment.
+// Returns 0 on success, -1 on error (and the running scenario goes on).
+int load_scenario(const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        say("ERROR OPENING SCENARIO %s\n", filename);
+        return -1;
+    }
+
+    struct Event *events = NULL;
+    int count = 0;
+    long long last = 0;
+    char line[BUF_SIZE];
+    int lineNumber = 0;
+    int error = FALSE;
+    while (!error && fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        char time[32];
+        int offset = 0;
+        if (sscanf(line, " %31s %n", time, &offset) < 1)
+        {
+            continue;  // Blank
+        }
+        char *command = line + offset;
+        size_t length = strlen(command);
+        while (length > 0 && (command[length - 1] == ' ' || command[length - 1] == '\t'))
+        {
+            command[--length] = '\0';
+        }
+
+        long long nsec;
+        int relative = time[0] == '+';
+        if (parse_time(time + relative, &nsec) < 0 || length == 0 || length >= MAX_EVENT_SIZE)
+        {
+            say("BAD SCENARIO LINE %d (<time>[s|ms|us] <command>)\n", lineNumber);
+            error = TRUE;
+        }
+        else if ((nsec += relative ? last : 0) < last)
+        {
+            say("SCENARIO TIMES MUST NOT DECREASE (LINE %d)\n", lineNumber);
+            error = TRUE;
+        }
+        else
+        {
+            struct Event *grown = realloc(events, (count + 1) * sizeof(struct Event));
+            if (grown == NULL)
             {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
+                say("OUT OF MEMORY LOADING THE SCENARIO\n");
+                error = TRUE;
+                continue;
             }
+            events = grown;
+            events[count].time = nsec;
+            strcpy(events[count].command, command);
+            count++;
+            last = nsec;
+        }
+    }
+    fclose(file);
+    if (error)
+    {
+        free(events);
+        return -1;
+    }
 
-            if (par.rx2txValid[par.rx2txIdx])
+    free(control.events);
+    control.events = events;
+    control.eventCount = count;
+    control.nextEvent = 0;
+    control.scenarioStart = monotonic_nsec();
+    say("SCENARIO %s STARTED: %d EVENTS OVER %.3f s\n", filename, count, last / 1e9);
+    return 0;
+}
+
+
+// Run a command read by the control thread and send its messages back to the
+// client that sent it (-1 for none), followed by a line with a single dot.
+// The scenario is handled here; the rest is handed to the cable loop, and
+// waited for.
+void control_command(const char *command, int client)
+{
+    char *reply = NULL;
+    size_t size = 0;
+    FILE *stream = client >= 0 ? open_memstream(&reply, &size) : NULL;
+
+    if (strcmp(command, "scenario off") == 0)
+    {
+        control.reply = stream;
+        say(control.nextEvent < control.eventCount ? "SCENARIO STOPPED\n" : "NO SCENARIO RUNNING\n");
+        control.nextEvent = control.eventCount;
+        control.reply = NULL;
+    }
+    else if (strncmp(command, "scenario ", 9) == 0)
+    {
+        control.reply = stream;
+        load_scenario(command + 9);
+        control.reply = NULL;
+    }
+    else
+    {
+        pthread_mutex_lock(&control.lock);
+        snprintf(control.command, sizeof(control.command), "%s", command);
+        control.reply = stream;
+        __atomic_store_n(&control.pending, TRUE, __ATOMIC_RELEASE);
+        while (control.pending)
+        {
+            pthread_cond_wait(&control.done, &control.lock);
+        }
+        control.reply = NULL;
+        pthread_mutex_unlock(&control.lock);
+    }
+
+    if (stream != NULL)
+    {
+        fputs(".\n", stream);
+        fclose(stream);
+        for (size_t sent = 0; sent < size;)
+        {
+            ssize_t count = send(client, reply + sent, size - sent, MSG_NOSIGNAL);
+            if (count <= 0)
             {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
+                break;
             }
+            sent += count;
         }
+        free(reply);
+    }
+}
+
 
-        if (par.logfile != NULL)  // Currently logging
+// Add the bytes read from a source to its partial line and run the lines they
+// complete; longer lines than the buffer are cut
+void control_input(char *line, int *length, const char *bytes, int count, int client)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (bytes[i] == '\n')
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
+            line[*length] = '\0';
+            if (*length > 0 && line[*length - 1] == '\r')
             {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
+                line[*length - 1] = '\0';
             }
-            else
+            if (line[0] != '\0')
+            {
+                control_command(line, client);
+            }
+            *length = 0;
+        }
+        else if (*length < BUF_SIZE - 1)
+        {
+            line[(*length)++] = bytes[i];
+        }
+    }
+}
+
+
+// Control thread: wait for commands on stdin and the control socket, and for
+// the next event of the scenario
+void *control_loop(void *unused)
+{
+    char bytes[BUF_SIZE];
+    for (;;)
+    {
+        struct pollfd fds[2 + MAX_CLIENTS];
+        fds[0] = (struct pollfd) { control.stdinOpen ? STDIN_FILENO : -1, POLLIN, 0 };
+        fds[1] = (struct pollfd) { control.listener, POLLIN, 0 };
+        for (int i = 0; i < MAX_CLIENTS; i++)
+        {
+            fds[2 + i] = (struct pollfd) { control.clients[i].fd, POLLIN, 0 };
+        }
+        struct timespec timeout;
+        struct timespec *wait = NULL;
+        if (control.nextEvent < control.eventCount)
+        {
+            long long left = control.scenarioStart + control.events[control.nextEvent].time - monotonic_nsec();
+            left = left > 0 ? left : 0;
+            timeout.tv_sec = left / 1000000000LL;
+            timeout.tv_nsec = left % 1000000000LL;
+            wait = &timeout;
+        }
+        if (ppoll(fds, 2 + MAX_CLIENTS, wait, NULL) < 0 && errno != EINTR)
+        {
+            perror("Waiting for commands");
+            return NULL;
+        }
+
+        while (control.nextEvent < control.eventCount &&
+               control.scenarioStart + control.events[control.nextEvent].time <= monotonic_nsec())
+        {
+            // Copied, since the command may load another scenario
+            struct Event event = control.events[control.nextEvent++];
+            printf("SCENARIO AT %.3f s: %s\n", event.time / 1e9, event.command);
+            control_command(event.command, -1);
+            if (control.nextEvent == control.eventCount)
+            {
+                printf("SCENARIO DONE\n");
+            }
+        }
+
+        if (fds[0].revents != 0)
+        {
+            int count = read(STDIN_FILENO, bytes, sizeof(bytes));
+            if (count > 0)
+            {
+                control_input(control.stdinLine, &control.stdinLength, bytes, count, -1);
+            }
+            else if (count == 0 || errno != EINTR)
+            {
+                control.stdinOpen = FALSE;
+            }
+        }
+        if (fds[1].revents != 0)
+        {
+            int fd = accept4(control.listener, NULL, NULL, SOCK_CLOEXEC);
+            int i = 0;
+            while (i < MAX_CLIENTS && control.clients[i].fd >= 0)
+            {
+                i++;
+            }
+            if (fd >= 0 && i == MAX_CLIENTS)
+            {
+                close(fd);  // Too many clients
+            }
+            else if (fd >= 0)
+            {
+                control.clients[i].fd = fd;
+                control.clients[i].length = 0;
+            }
+        }
+        for (int i = 0; i < MAX_CLIENTS; i++)
+        {
+            struct Client *client = &control.clients[i];
+            if (client->fd < 0 || fds[2 + i].revents == 0)
             {
-                memcpy(tx2rxRx, "  ", 3);
+                continue;
             }
-            if (par.rx2txValid[par.rx2txIdx])
+            int count = read(client->fd, bytes, sizeof(bytes));
+            if (count > 0)
             {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                control_input(client->line, &client->length, bytes, count, client->fd);
             }
             else
             {
-                memcpy(rx2txRx, "  ", 3);
+                close(client->fd);
+                client->fd = -1;
             }
+        }
+    }
+    return NULL;
+}
+
+
+// Create the control socket, if any, and start the control thread.
+// Returns 0 on success, -1 on error.
+int control_start(void)
+{
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        control.clients[i].fd = -1;
+    }
+
+    if (control.socketPath != NULL)
+    {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        struct stat status;
+        if (strlen(control.socketPath) >= sizeof(address.sun_path))
+        {
+            printf("CONTROL SOCKET PATH TOO LONG\n");
+            return -1;
+        }
+        strcpy(address.sun_path, control.socketPath);
+        unlink(control.socketPath);  // Left by a cable that didn't quit
+        control.listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (control.listener < 0 || bind(control.listener, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+            listen(control.listener, MAX_CLIENTS) < 0 || stat(control.socketPath, &status) < 0)
+        {
+            perror("Creating the control socket");
+            return -1;
+        }
+        control.socketInode = status.st_ino;
+        printf("CONTROL SOCKET %s\n", control.socketPath);
+    }
+
+    // The signals are left to the cable loop
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, control_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (error != 0)
+    {
+        printf("ERROR STARTING THE CONTROL THREAD\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+
+// Remove the control socket if it is still this cable's
+void control_stop(void)
+{
+    struct stat status;
+    if (control.listener < 0)
+    {
+        return;
+    }
+    close(control.listener);
+    if (stat(control.socketPath, &status) == 0 && status.st_ino == control.socketInode)
+    {
+        unlink(control.socketPath);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *scenario = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "c:s:")) != -1)
+    {
+        if (option == 'c')
+        {
+            control.socketPath = optarg;
+        }
+        else if (option == 's')
+        {
+            scenario = optarg;
+        }
+        else
+        {
+            argc = -1;
+        }
+    }
+
+    // The serial ports can be named, to run several cables side by side
+    if (argc - optind == 2)
+    {
+        txPty.link = argv[optind];
+        rxPty.link = argv[optind + 1];
+    }
+    else if (argc != optind)
+    {
+        printf("Usage: %s [-c control_socket] [-s scenario] [tx_port rx_port] (default " TXDEV " " RXDEV ")\n",
+               argv[0]);
+        exit(1);
+    }
+
+    printf("\n");
+    int fdTx = open_pty(&txPty);
+    if (fdTx < 0)
+    {
+        perror("Creating Tx serial port");
+        close_pty(&txPty);
+        exit(-1);
+    }
+    int fdRx = open_pty(&rxPty);
+    if (fdRx < 0)
+    {
+        perror("Creating Rx serial port");
+        close_pty(&txPty);
+        close_pty(&rxPty);
+        exit(-1);
+    }
+
+    for (int direction = TX2RX; direction <= RX2TX; direction++)
+    {
+        if (pipe2(bypass[direction].pipe, O_NONBLOCK) < 0)
+        {
+            spliceWorks = FALSE;
+        }
+    }
+
+    // Take the links down on the way out
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGHUP, on_signal);
+
+    help();
+
+    int STOP = FALSE;
+
+    set_baud_rate(TX2RX, RX2TX, DEFAULT_BAUDRATE);
 
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
+    set_rt_priority();
+
+    // For logging: the byte in and out of each direction in a slot
+    char logIn[2][3], logOut[2][3];
+    int cableIdle = FALSE;
+
+    // Ports each direction reads from and writes to
+    int fdIn[2] = { fdTx, fdRx };
+    int fdOut[2] = { fdRx, fdTx };
+
+    // Bytes moved in one wakeup, per direction
+    static unsigned char from[2][BATCH_MAX_SLOTS];
+    // (each can be followed by a spurious one)
+    static unsigned char to[2][2 * BATCH_MAX_SLOTS];
+
+    noise_reset(TX2RX, TRUE);
+    noise_reset(RX2TX, TRUE);
+
+    // Commands are read from now on, off the cable loop
+    if ((scenario != NULL && load_scenario(scenario) < 0) || control_start() < 0)
+    {
+        control_stop();
+        close_pty(&txPty);
+        close_pty(&rxPty);
+        exit(-1);
+    }
+
+    printf("\nCable ready\n\n");
+
+    // Start of the next byte slot: every wakeup moves the bytes of all the
+    // slots that have started since the previous one
+    struct timespec currentTime, nextTxTime, lag, wakeupTime;
+    int unreliableRate = FALSE;
+    int slept = FALSE;
+    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
+
+    while (STOP == FALSE && !interrupted)
+    {
+        // Count the byte slots due (at most BATCH_MAX_SLOTS, the rest are
+        // caught up on the next wakeups)
+        clock_gettime(CLOCK_MONOTONIC, &currentTime);
+        if (slept)
+        {
+            pacing_wakeup(&wakeupTime, &currentTime);
+        }
+        lag = timespec_diff(&currentTime, &nextTxTime);
+        long slots = 0;
+        long long batchStart = 0;  // Start of the first slot, nsec
+        if (!timespec_is_negative(&lag))
+        {
+            if (lag.tv_sec >= 1 && unreliableRate == FALSE)
             {
-                if (cableIdle == FALSE)
-                {
-                    fputs("---------------\n", par.logfile);
-                    cableIdle = TRUE;
-                }
+                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
+                       "No further warnings will be issued\n");
+                unreliableRate = TRUE;
             }
-            else
+            slots = lag.tv_sec >= 1 ? BATCH_MAX_SLOTS : lag.tv_nsec * (long long) par.baud / 10000000000LL + 1;
+            if (slots > BATCH_MAX_SLOTS)
             {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
-                cableIdle = FALSE;
+                slots = BATCH_MAX_SLOTS;
+                ++pacing.catchUps;
             }
+            pacing_slots(slots, &lag);
+            batchStart = nextTxTime.tv_sec * 1000000000LL + nextTxTime.tv_nsec;
+            nextTxTime = timespec_add_slots(&nextTxTime, slots);
         }
 
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
+        // Slots of each direction among them
+        long due[2];
+        long long credit[2];
+        for (int direction = TX2RX; direction <= RX2TX; direction++)
         {
-            rxStdin[fromStdin - 1] = '\0';
+            struct Line *l = &line[direction];
+            credit[direction] = l->credit;
+            due[direction] = (l->credit + slots * (long long) l->baud) / par.baud;
+            l->credit = (l->credit + slots * (long long) l->baud) % par.baud;
+        }
 
-            if (strcmp(rxStdin, "off") == 0)
+        // Slots left to the engine
+        long engineSlots = slots;
+        if (slots > 0 && bypass_enabled())
+        {
+            if (bypass_move(&bypass[TX2RX], fdTx, fdRx, due[TX2RX]) == 0 &&
+                bypass_move(&bypass[RX2TX], fdRx, fdTx, due[RX2TX]) == 0)
             {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
-                {
-                    fputs("CABLE OFF\n", par.logfile);
-                }
-                par.cableOn = FALSE;
+                engineSlots = 0;
             }
-            else if (strcmp(rxStdin, "on") == 0)
+            else
             {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
+                printf("SPLICE NOT SUPPORTED, BYTES ALWAYS GO THROUGH THE ENGINE\n");
+                spliceWorks = FALSE;
             }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
+        }
+        if (engineSlots > 0)
+        {
+            bypass_flush(&bypass[TX2RX], fdRx);
+            bypass_flush(&bypass[RX2TX], fdTx);
+        }
+
+        // Read at most one byte per slot of the direction from each side; what
+        // is left waits in the port for the next slots
+        int bytesFrom[2] = { 0, 0 };
+        int bytesTo[2] = { 0, 0 };
+        int taken[2] = { 0, 0 };
+        for (int direction = TX2RX; direction <= RX2TX && engineSlots > 0; direction++)
+        {
+            bytesFrom[direction] = due[direction] > 0 ? read(fdIn[direction], from[direction], due[direction]) : 0;
+        }
+
+        for (long slot = 0; slot < engineSlots; slot++)
+        {
+            uint64_t slotNumber = par.slotNumber + slot;
+            long long slotTime = batchStart + slot * 10000000000LL / par.baud;
+
+            for (int direction = TX2RX; direction <= RX2TX; direction++)
             {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eightth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
+                struct Line *l = &line[direction];
+                memcpy(logIn[direction], "  ", 3);
+                memcpy(logOut[direction], "  ", 3);
+
+                // A slot of the cable that isn't one of the direction's
+                credit[direction] += l->baud;
+                if (credit[direction] < par.baud)
+                {
+                    continue;
+                }
+                credit[direction] -= par.baud;
+
+                // What is read while the cable is off is ignored
+                l->ring[l->idx] = from[direction][taken[direction]];
+                l->valid[l->idx] = taken[direction] < bytesFrom[direction] && par.cableOn;
+                taken[direction]++;
+                if (l->valid[l->idx])
                 {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
+                    if (capture.fd >= 0)
+                    {
+                        capture_record(direction == TX2RX ? CAPTURE_TX2RX_IN : CAPTURE_RX2TX_IN, 0,
+                                       l->ring[l->idx], slotNumber, slotTime);
+                    }
+                    if (par.logfile != NULL)
                     {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
+                        sprintf(logIn[direction], "%02hhX", l->ring[l->idx]);
                     }
                 }
-                else
+
+                // Advance index to the byte leaving in this slot
+                l->idx = (l->idx + 1) % l->bufSize;
+
+                if (par.cableOn && l->valid[l->idx])
                 {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
-                }
-            }
-            else if (strncmp(rxStdin, "baud ", 5) == 0)
-            {
-                unsigned long baud = 0;
-                sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
+                    // Add errors, if applicable
+                    int errors;
+                    unsigned char *out = to[direction] + bytesTo[direction];
+                    int received = noise_byte(&noise[direction], (unsigned char *) l->ring + l->idx, out, &errors);
+                    if (capture.fd >= 0)
+                    {
+                        capture_out(direction == TX2RX ? CAPTURE_TX2RX_OUT : CAPTURE_RX2TX_OUT, errors,
+                                    l->ring[l->idx], out, slotNumber, slotTime);
+                    }
+                    if (par.logfile != NULL)
+                    {
+                        sprintf(logOut[direction], errors & CAPTURE_DROPPED ? "--" : "%02hhX", l->ring[l->idx]);
+                    }
+                    bytesTo[direction] += received;
                 }
             }
-            else if (strncmp(rxStdin, "prop ", 5) == 0)
+
+            if (par.logfile != NULL)  // Currently logging
             {
-                unsigned long propDelay;
-                if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
+                if (*logIn[TX2RX] == ' ' && *logOut[TX2RX] == ' ' && *logIn[RX2TX] == ' ' && *logOut[RX2TX] == ' ')
                 {
-                    printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
+                    if (cableIdle == FALSE)
+                    {
+                        fputs("---------------\n", par.logfile);
+                        cableIdle = TRUE;
+                    }
                 }
                 else
                 {
-                    par.propDelay = propDelay;
-                    init_ring_buffers();
+                    fprintf(par.logfile, "%s  %s | %s  %s\n", logIn[TX2RX], logOut[TX2RX], logIn[RX2TX], logOut[RX2TX]);
+                    cableIdle = FALSE;
                 }
             }
-            else if (strncmp(rxStdin, "log ", 4) == 0)
-            {
-                startlog(rxStdin + 4);
-            }
-            else if (strcmp(rxStdin, "endlog") == 0)
-            {
-                endlog();
-                printf("NOT LOGGING\n");
-            }
-            else if (strcmp(rxStdin, "quit") == 0)
+        }
+
+        par.slotNumber += slots;
+
+        // The bytes of the batch leave together
+        for (int direction = TX2RX; direction <= RX2TX; direction++)
+        {
+            if (bytesTo[direction] > 0)
             {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
-            }
-            else if (strcmp(rxStdin, "help") == 0) {
-                help();
-            }
-            else {
-                printf("BAD COMMAND OR MISSING PARAMETERS\n");
+                write_port(fdOut[direction], to[direction], bytesTo[direction]);
             }
         }
 
-        if (skipWait == FALSE) {
-            nanosleep(&nextWait, NULL);
+        // Run the command the control thread handed over, if any
+        if (__atomic_load_n(&control.pending, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_lock(&control.lock);
+            STOP = run_command(control.command, &currentTime);
+            control.pending = FALSE;
+            pthread_cond_signal(&control.done);
+            pthread_mutex_unlock(&control.lock);
         }
-    }
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
-    {
-        perror("tcsetattr");
-        exit(-1);
+        // Sleep until the next slot starts, but at least BATCH_PERIOD_NSEC
+        // after this wakeup, unless catching up
+        slept = slots < BATCH_MAX_SLOTS;
+        if (slept)
+        {
+            wakeupTime = timespec_add_nsec(&currentTime, BATCH_PERIOD_NSEC);
+            if (timespec_comp(&wakeupTime, &nextTxTime) < 0)
+            {
+                wakeupTime = nextTxTime;
+            }
+            sleep_until(&wakeupTime);
+        }
     }
 
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
+    endcapture();
+    endlog();
+    for (int direction = TX2RX; direction <= RX2TX; direction++)
     {
-        perror("tcsetattr");
-        exit(-1);
+        if (bypass[direction].pipe[0] >= 0)
+        {
+            close(bypass[direction].pipe[0]);
+            close(bypass[direction].pipe[1]);
+        }
     }
-
-    close(fdTx);
-    close(fdRx);
-
-    system("killall socat");
+    control_stop();
+    close_pty(&txPty);
+    close_pty(&rxPty);
 
     return 0;
 }
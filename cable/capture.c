@@ -0,0 +1,206 @@
+// Converter of the cable's binary captures (see capture.h).
+//
+//   capture text FILE    the layout of the cable's "log <file>": one line per
+//                        busy byte slot with the bytes in and out of each
+//                        direction, "--" for a dropped byte, a dashed line
+//                        per idle stretch
+//   capture pcap FILE    pcap (nanosecond timestamps, link type USER0) with one
+//                        packet per run of bytes delivered back to back in a
+//                        direction; the first byte of each packet is the
+//                        direction (0 Tx->Rx, 1 Rx->Tx)
+//
+// Both write to the standard output.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "capture.h"
+
+#define FALSE 0
+#define TRUE 1
+
+#define PCAP_MAGIC_NSEC 0xA1B23C4D
+#define PCAP_LINKTYPE_USER0 147
+#define PCAP_SNAPLEN 65535
+
+// Bytes of the current line of the text layout
+struct Line {
+    uint32_t slot;
+    char columns[4][3];   // Tx->Rx in and out, Rx->Tx in and out
+    int busy;
+};
+
+// Bytes delivered back to back in one direction
+struct Packet {
+    unsigned char data[PCAP_SNAPLEN];
+    uint32_t length;
+    uint64_t time;        // Of the first byte, nsec since the epoch
+    uint32_t lastSlot;
+};
+
+
+void clear_line(struct Line *line, uint32_t slot)
+{
+    line->slot = slot;
+    for (int column = 0; column < 4; column++)
+    {
+        memcpy(line->columns[column], "  ", 3);
+    }
+    line->busy = FALSE;
+}
+
+
+void print_line(struct Line *line)
+{
+    if (line->busy)
+    {
+        printf("%s  %s | %s  %s\n", line->columns[0], line->columns[1], line->columns[2], line->columns[3]);
+    }
+}
+
+
+int to_text(FILE *file, const struct CaptureHeader *header)
+{
+    struct CaptureRecord record;
+    struct Line line;
+    uint32_t lastSlot = (uint32_t) header->firstSlot - 1;
+    int idle = FALSE;
+    clear_line(&line, lastSlot);
+
+    printf("Tx->Rx | Rx->Tx\n");
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if (record.type == CAPTURE_CABLE_OFF)
+        {
+            print_line(&line);
+            clear_line(&line, line.slot);
+            printf("CABLE OFF\n");
+            continue;
+        }
+        if ((record.type > CAPTURE_RX2TX_OUT && record.type != CAPTURE_END) ||
+            (record.flags & CAPTURE_INSERTED))
+        {
+            continue;
+        }
+
+        if (record.slot != line.slot)
+        {
+            if (line.busy)
+            {
+                print_line(&line);
+                lastSlot = line.slot;
+                idle = FALSE;
+            }
+            // Slots without a byte in between
+            if (record.slot - lastSlot > 1 && !idle)
+            {
+                printf("---------------\n");
+                idle = TRUE;
+            }
+            clear_line(&line, record.slot);
+        }
+        if (record.type == CAPTURE_END)
+        {
+            break;
+        }
+        if ((record.flags & CAPTURE_DROPPED) && (record.type & 1))
+        {
+            memcpy(line.columns[record.type], "--", 3);
+        }
+        else
+        {
+            sprintf(line.columns[record.type], "%02hhX", record.byte);
+        }
+        line.busy = TRUE;
+    }
+    print_line(&line);
+    return 0;
+}
+
+
+void write_packet(struct Packet *packet)
+{
+    uint32_t header[4] = { (uint32_t) (packet->time / 1000000000ULL), (uint32_t) (packet->time % 1000000000ULL),
+                           packet->length, packet->length };
+    fwrite(header, sizeof(header), 1, stdout);
+    fwrite(packet->data, 1, packet->length, stdout);
+    packet->length = 0;
+}
+
+
+int to_pcap(FILE *file, const struct CaptureHeader *header)
+{
+    struct {
+        uint32_t magic;
+        uint16_t versionMajor;
+        uint16_t versionMinor;
+        int32_t thisZone;
+        uint32_t sigFigs;
+        uint32_t snapLength;
+        uint32_t linkType;
+    } pcapHeader = { PCAP_MAGIC_NSEC, 2, 4, 0, 0, PCAP_SNAPLEN, PCAP_LINKTYPE_USER0 };
+    fwrite(&pcapHeader, sizeof(pcapHeader), 1, stdout);
+
+    static struct Packet packets[2];
+    struct CaptureRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if ((record.type != CAPTURE_TX2RX_OUT && record.type != CAPTURE_RX2TX_OUT) ||
+            (record.flags & CAPTURE_DROPPED))
+        {
+            continue;
+        }
+
+        // A packet ends at an idle slot of its direction
+        struct Packet *packet = &packets[record.type >> 1];
+        if (packet->length > 0 && (record.slot - packet->lastSlot > 1 || packet->length == PCAP_SNAPLEN))
+        {
+            write_packet(packet);
+        }
+        if (packet->length == 0)
+        {
+            packet->data[packet->length++] = record.type >> 1;
+            packet->time = header->startTime + record.time;
+        }
+        packet->data[packet->length++] = record.byte;
+        packet->lastSlot = record.slot;
+    }
+    for (int direction = 0; direction < 2; direction++)
+    {
+        if (packets[direction].length > 0)
+        {
+            write_packet(&packets[direction]);
+        }
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 || (strcmp(argv[1], "text") != 0 && strcmp(argv[1], "pcap") != 0))
+    {
+        fprintf(stderr, "Usage: %s text|pcap capture_file\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[2], "rb");
+    if (file == NULL)
+    {
+        perror(argv[2]);
+        return 1;
+    }
+    struct CaptureHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 || header.version != CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s is not a cable capture (version %d)\n", argv[2], CAPTURE_VERSION);
+        fclose(file);
+        return 1;
+    }
+
+    int result = strcmp(argv[1], "text") == 0 ? to_text(file, &header) : to_pcap(file, &header);
+    fclose(file);
+    return result;
+}
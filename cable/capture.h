@@ -0,0 +1,57 @@
+// Binary capture format of the virtual cable.
+//
+// "capture <file>" writes a CaptureHeader followed by one CaptureRecord per
+// byte that enters the cable (read from the port that sent it) and per byte
+// that leaves it (written to the other port, after the propagation delay and
+// the errors), in the order of their byte slots, and a record per change of
+// the cable's state (on, off, baud rate). The capture tool converts
+// captures to the text layout of "log <file>" or to pcap.
+//
+// Fields are in the byte order of the machine that ran the cable.
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "CBLCAP\r\n"  // 8 bytes, no terminator
+#define CAPTURE_VERSION 2
+
+struct CaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t baud;        // Baud rate of the byte slots (the faster direction's) when the capture started
+    uint64_t startTime;   // Wall clock at the start, nsec since the epoch
+    uint64_t firstSlot;   // Number of the first byte slot captured
+    uint32_t lineBaud[2]; // Baud rate of each direction (Tx->Rx, Rx->Tx) when the capture started
+    uint32_t reserved;
+};
+
+// Record types
+#define CAPTURE_TX2RX_IN 0    // Byte read from the Tx port
+#define CAPTURE_TX2RX_OUT 1   // Byte written to the Rx port
+#define CAPTURE_RX2TX_IN 2    // Byte read from the Rx port
+#define CAPTURE_RX2TX_OUT 3   // Byte written to the Tx port
+#define CAPTURE_CABLE_OFF 4   // The cable was disconnected (no byte)
+#define CAPTURE_CABLE_ON 5    // and connected again
+#define CAPTURE_END 6         // Last record, in the first slot not captured
+#define CAPTURE_BAUD 7        // The baud rate of the direction in byte changed (no byte)
+
+// Flags of the *_OUT records (also the errors reported by the cable's noise)
+#define CAPTURE_CORRUPTED 0x01  // Bits were flipped on the way
+#define CAPTURE_DROPPED 0x02    // Lost: never written to the port
+#define CAPTURE_INSERTED 0x04   // Spurious: written but never sent
+
+struct CaptureRecord {
+    uint64_t time;        // Start of the byte slot, nsec since the capture started
+    union {
+        uint32_t slot;    // Number of the byte slot (low 32 bits)
+        uint32_t baud;    // CAPTURE_BAUD: the new baud rate
+    };
+    uint8_t type;         // CAPTURE_*
+    uint8_t flags;
+    uint8_t byte;         // CAPTURE_BAUD: the direction (0 Tx->Rx, 1 Rx->Tx)
+    uint8_t reserved;
+};
+
+#endif // _CAPTURE_H_
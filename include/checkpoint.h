@@ -0,0 +1,35 @@
+// Receiver-side checkpoints header.
+
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include "hash.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Number of committed bytes between two checkpoints
+#define CHECKPOINT_INTERVAL (16 * 1024)
+
+// Progress of a file being received, persisted next to the output file so an
+// aborted transfer can be resumed instead of restarted from byte 0
+typedef struct
+{
+    char name[256];         // File name announced by the transmitter
+    uint64_t fileSize;      // File size announced by the transmitter
+    uint64_t offset;        // Number of bytes committed to the output file
+    Sha256 hash;            // Running hash of the committed bytes
+} Checkpoint;
+
+// Load the checkpoint of the output file "filename".
+// Returns 1 if a valid checkpoint was found, 0 if there is none, -1 on error.
+int loadCheckpoint(const char *filename, Checkpoint *checkpoint);
+
+// Commit the output file to disk and then atomically replace its checkpoint.
+// Returns 1 on success or -1 on error.
+int saveCheckpoint(const char *filename, FILE *output, const Checkpoint *checkpoint);
+
+// Remove the checkpoint of the output file "filename" (transfer completed).
+void removeCheckpoint(const char *filename);
+
+#endif // _CHECKPOINT_H_
@@ -0,0 +1,106 @@
+// Content-defined chunking and persistent chunk store header.
+
+#ifndef _CHUNK_STORE_H_
+#define _CHUNK_STORE_H_
+
+#include "hash.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Bounds of the chunk size (boundaries fall on average every 8 KiB)
+#define MIN_CHUNK_SIZE (2 * 1024)
+#define MAX_CHUNK_SIZE (64 * 1024)
+
+// Splits a byte stream into chunks whose boundaries depend only on the
+// content around them (gear rolling hash), so unchanged regions of a stream
+// produce the same chunks wherever they appear
+typedef struct
+{
+    uint64_t hash;      // Rolling hash of the bytes since the last boundary
+    uint32_t size;      // Number of bytes since the last boundary
+} Chunker;
+
+// Set of chunks, indexed by their SHA-256
+typedef struct
+{
+    unsigned char (*hashes)[SHA256_SIZE];
+    uint64_t *offsets;  // Position of the chunk in the pack
+    uint32_t *sizes;    // 0 marks an empty slot
+    uint32_t count;
+    uint32_t capacity;  // Power of 2
+} ChunkIndex;
+
+// Chunks kept on disk across transfers: "chunks.pack" holds the chunks, "id"
+// identifies the store, and "peer-<id>.known" lists the chunks a peer store holds
+typedef struct
+{
+    char directory[4096];
+    uint64_t id;
+    FILE *pack;
+    ChunkIndex index;   // Chunks of this store
+    ChunkIndex known;   // Chunks held by the peer store (transmitter only)
+    uint64_t peer;      // Identifier of the peer store
+    unsigned char (*pending)[SHA256_SIZE];  // Chunks sent to the peer in this transfer
+    uint32_t pendingCount;
+    uint32_t pendingCapacity;
+} ChunkStore;
+
+// Chunk being reassembled from a received stream
+typedef struct
+{
+    Chunker chunker;
+    unsigned char data[MAX_CHUNK_SIZE];
+    int size;
+} ChunkBuffer;
+
+// Reset the chunker to the start of a chunk.
+void initChunker(Chunker *chunker);
+
+// Look for the end of the current chunk in data.
+// Returns the number of bytes of data that complete the chunk (the chunker
+// then restarts) or -1 if the chunk goes on after data.
+int findChunkBoundary(Chunker *chunker, const unsigned char *data, int size);
+
+// Open (creating if needed) the store in the given directory.
+// Returns 1 on success or -1 on error.
+int openChunkStore(ChunkStore *store, const char *directory);
+
+// Close the store.
+void closeChunkStore(ChunkStore *store);
+
+// Read a chunk of the store into data (at least MAX_CHUNK_SIZE bytes).
+// Returns the size of the chunk or -1 if the store doesn't have it.
+int readChunk(ChunkStore *store, const unsigned char hash[SHA256_SIZE], unsigned char *data);
+
+// Add a chunk to the store (nothing is done if it's already there).
+// Returns 1 on success or -1 on error.
+int addChunk(ChunkStore *store, const unsigned char *data, int size, const unsigned char hash[SHA256_SIZE]);
+
+// Load the list of chunks held by the peer store. Returns 1 on success or -1 on error.
+int openPeerChunks(ChunkStore *store, uint64_t peer);
+
+// Check whether the peer store holds a chunk.
+int peerHasChunk(const ChunkStore *store, const unsigned char hash[SHA256_SIZE]);
+
+// Record that the peer store now holds a chunk. Returns 1 on success or -1 on error.
+int addPeerChunk(ChunkStore *store, const unsigned char hash[SHA256_SIZE]);
+
+// Forget the chunks the peer store was recorded to hold (it lost some), except
+// those sent in this transfer. Returns 1 on success or -1 on error.
+int forgetPeerChunks(ChunkStore *store);
+
+// Make the records of the peer's chunks persistent (the transfer succeeded).
+// Returns 1 on success or -1 on error.
+int commitPeerChunks(ChunkStore *store);
+
+// Split received stream bytes into chunks, adding every completed chunk to the store.
+// The buffer must start with initChunker(&buffer->chunker) and size 0.
+// Returns 1 on success or -1 on error.
+int storeStreamBytes(ChunkStore *store, ChunkBuffer *buffer, const unsigned char *data, int size);
+
+// Add the last (incomplete) chunk of the stream to the store.
+// Returns 1 on success or -1 on error.
+int flushChunkBuffer(ChunkStore *store, ChunkBuffer *buffer);
+
+#endif // _CHUNK_STORE_H_
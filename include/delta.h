@@ -0,0 +1,66 @@
+// Delta transfer (rsync algorithm) header.
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include "hash.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Number of bytes of the block SHA-256 kept in a signature
+#define DELTA_STRONG_SIZE 8
+
+// Size of a signature on the wire: weak checksum followed by the strong hash
+#define DELTA_SIGNATURE_SIZE (4 + DELTA_STRONG_SIZE)
+
+// Signature of a block of the file the receiver already has
+typedef struct
+{
+    uint32_t weak;                              // Rolling checksum
+    unsigned char strong[DELTA_STRONG_SIZE];    // Truncated SHA-256
+} BlockSignature;
+
+// Lookup table from weak checksums to the blocks of the receiver's file
+typedef struct
+{
+    const BlockSignature *signatures;
+    int count;
+    int blockSize;
+    int *heads;         // First block of each bucket (-1 if empty)
+    int *next;          // Next block in the same bucket
+    uint32_t mask;      // Number of buckets - 1
+} DeltaIndex;
+
+// Receives the operations produced by deltaEncode, in order
+typedef struct
+{
+    // Bytes the receiver doesn't have. Returns -1 to abort.
+    int (*literal)(void *context, const unsigned char *data, int size);
+    // A whole block of the receiver's file. Returns -1 to abort.
+    int (*copy)(void *context, uint32_t block);
+    void *context;
+} DeltaSink;
+
+// Block size used to sign a file of the given size.
+int deltaBlockSize(uint64_t fileSize);
+
+// Rolling checksum of a block.
+uint32_t weakChecksum(const unsigned char *data, int size);
+
+// Compute the signatures of every complete block of the file.
+// Returns the number of signatures (stored in *signatures) or -1 on error.
+int computeSignatures(FILE *file, int blockSize, BlockSignature **signatures);
+
+// Build the lookup table of the signatures. Returns 1 on success or -1 on error.
+int buildDeltaIndex(DeltaIndex *index, const BlockSignature *signatures, int count, int blockSize);
+
+// Release the memory of the lookup table.
+void freeDeltaIndex(DeltaIndex *index);
+
+// Describe the content of source as literal bytes and references to the
+// blocks of the receiver's file. Every byte read from source is added to hash.
+// Returns 1 on success or -1 on error.
+int deltaEncode(FILE *source, const DeltaIndex *index, Sha256 *hash, DeltaSink *sink);
+
+#endif // _DELTA_H_
@@ -0,0 +1,40 @@
+// Frame format header: the fields shared by the link layer and the tools that
+// decode its frames off the wire (cable/analyze.c).
+//
+// | FLAG | A | C | BCC1 | data | BCC2 | FLAG |
+// with BCC1 = A ^ C, BCC2 the XOR of the data, and every FLAG or ESCAPE between
+// the flags (data and BCC2) sent as | ESCAPE | byte ^ STUFF |.
+
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+// Frame delimiters: Page 10 of the protocol
+#define FLAG 0x7E
+
+// Address field: Pages 10 and 11 of the protocol
+#define A_TX 0x03
+#define A_RX 0x01
+
+// Control field for Supervision and Unnumbered frames: Page 10 of the protocol
+#define C_SET 0x03      // Set up connection: Tx
+#define C_UA 0x07       // Unnumbered acknowledgment: Rx
+#define C_RR0 0xAA      // Receiver ready 0: Rx
+#define C_RR1 0xAB      // Receiver ready 1: Rx
+#define C_REJ0 0x54     // Reject 0: Rx
+#define C_REJ1 0x55     // Reject 1: Rx
+#define C_DISC 0x0B     // Disconnect: Tx | Rx
+#define C_CAPS 0x0F     // Capabilities, sent just before SET and UA: Tx | Rx
+#define C_BAUD 0x13     // Switch to a baud rate: Tx, echoed by Rx before it switches
+#define C_PROBE 0x17    // Probe frame at a new baud rate: Tx
+#define C_REPORT 0x1B   // Probe frames received: Rx
+#define C_BAUD_DONE 0x1F // Baud rate settled: Tx, echoed by Rx
+
+// Control field for Information frames: Page 11 of the protocol
+#define C_N0 0x00       // Information frame control field (frame 0)
+#define C_N1 0x80       // Information frame control field (frame 1)
+
+// Byte stuffing: Page 17 of the protocol
+#define ESCAPE 0x7D     // Escape character
+#define STUFF 0x20      // XOR value for byte stuffing
+
+#endif // _FRAME_H_
@@ -0,0 +1,66 @@
+// Frame-size controller header.
+
+#ifndef _FRAME_SIZER_H_
+#define _FRAME_SIZER_H_
+
+#include <stdint.h>
+
+// Frame bytes besides the payload: | FLAG | A | C | BCC1 | ... | BCC2 | FLAG |
+#define SIZER_OVERHEAD 6
+
+// Weight of the past frames in the error estimate, per frame sent
+#define SIZER_DECAY 0.99
+
+// Error-free frames of the starting size assumed before the first one is sent:
+// a single early error doesn't shrink the frames to the minimum, and a clean
+// line keeps growing them from the starting size
+#define SIZER_PRIOR 8
+
+// Most the size grows per frame: a packet is cut before it is sent, and keeps
+// its size through the retransmissions if the line can't carry it
+#define SIZER_GROWTH 1.25
+
+// Candidate sizes evaluated between the bounds
+#define SIZER_STEPS 64
+
+// Outcomes of the transmission of an information frame
+#define SIZER_ACKED 0
+#define SIZER_REJECTED 1
+#define SIZER_TIMED_OUT 2
+
+// Picks the payload size of the information frames that maximizes the
+// Stop-and-Wait goodput
+//   L (1 - e)^(L + H) / ((L + H) t + T + r W)
+// for a payload of L bytes and H bytes of overhead, where e is the byte error
+// rate derived from a running estimate of the frame error rate, t the time of
+// a byte on the wire, T the turnaround (from the frame leaving to its
+// acknowledgement arriving) and r the rate of the frames lost altogether,
+// which cost the retransmission timeout W whatever their size.
+typedef struct
+{
+    int minSize;                // Payload bounds
+    int maxSize;
+    int size;                   // Payload size of the next information frame
+    double attempts;            // Decayed count of the frames sent (with the prior),
+    double sent;                // of those actually sent,
+    double errors;              // of those rejected or timed out,
+    double timeouts;            // of those timed out,
+    double bytes;               // and of the bytes they carried
+    double byteNs;              // Time of a byte on the wire (0 if unknown)
+    double turnaroundNs;        // Smoothed turnaround
+    double timeoutNs;           // Retransmission timeout
+} FrameSizer;
+
+// Start at startSize, with byteNs the time of a byte on the wire (0 if the line
+// has no baud rate).
+void frameSizerInit(FrameSizer *sizer, int minSize, int maxSize, int startSize, double byteNs, double timeoutNs);
+
+// Account one transmission of an information frame with the given payload and
+// outcome (SIZER_*), acknowledged cycleNs after it started being written, and
+// pick the size of the next one.
+void frameSizerRecord(FrameSizer *sizer, int payloadSize, int outcome, uint64_t cycleNs);
+
+// Decayed rate of the frames actually sent that were rejected or timed out.
+double frameSizerErrorRate(const FrameSizer *sizer);
+
+#endif // _FRAME_SIZER_H_
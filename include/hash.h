@@ -0,0 +1,33 @@
+// Hash functions header.
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+// Running SHA-256 computation. The structure holds no pointers, so it can be
+// copied (e.g. to peek at the digest of a prefix) or saved to disk as is.
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length;            // Number of bytes hashed so far
+    unsigned char block[64];    // Bytes waiting for a full block
+} Sha256;
+
+// Start a new SHA-256 computation.
+void sha256Init(Sha256 *ctx);
+
+// Add size bytes of data to the computation.
+void sha256Update(Sha256 *ctx, const void *data, size_t size);
+
+// Write the digest of everything hashed so far. The context is left untouched,
+// so hashing can go on afterwards.
+void sha256Digest(const Sha256 *ctx, unsigned char digest[SHA256_SIZE]);
+
+// Digest of a single buffer.
+void sha256(const void *data, size_t size, unsigned char digest[SHA256_SIZE]);
+
+#endif // _HASH_H_
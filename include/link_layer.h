@@ -12,7 +12,7 @@ typedef enum
 
 typedef struct
 {
-    char serialPort[50];
+    char serialPort[256];   // Device, or a simulated link (sim:...)
     LinkLayerRole role;         // LlTx (Transmitter) or LlRx (Receiver)
     int baudRate;               // Speed of the transmission
     int nRetransmissions;       // Number of retries in case of failure
@@ -21,7 +21,39 @@ typedef struct
 
 // SIZE of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer
-#define MAX_PAYLOAD_SIZE 1000
+// (peers without capabilities accept 1000)
+#define MAX_PAYLOAD_SIZE 4000
+
+// Smallest payload the frame-size controller shrinks the information frames to
+#define MIN_PAYLOAD_SIZE 64
+
+// Capabilities advertised in the handshake: each side sends them in a frame
+// just before its SET or UA, and the link uses the intersection of both.
+typedef struct
+{
+    int maxPayloadSize;         // Largest information field accepted, before stuffing
+    int minPayloadSize;         // Smallest information field worth sending
+    int windowSize;             // Information frames in flight
+    int sequenceModulus;        // Sequence numbers used by the information frames
+    unsigned int fcsTypes;      // LL_FCS_* bits
+    unsigned int features;      // LL_FEATURE_* bits
+    int maxBaudRate;            // Fastest speed to switch to after llopen (0 if none)
+} LinkCapabilities;
+
+// Frame check sequences
+#define LL_FCS_XOR 0x01         // 8-bit XOR of the data (BCC2)
+
+// Optional features
+#define LL_FEATURE_BAUD_RATE 0x01 // Switches to a faster baud rate after llopen (LL_MAX_BAUD)
+
+// Capabilities in use on the open link (those of today's protocol if the peer
+// advertised none)
+extern LinkCapabilities linkCapabilities;
+
+// Payload size for the next information frame, picked by the frame-size
+// controller between the negotiated minimum and maximum from the frame error
+// rate seen so far
+extern int linkPayloadSize;
 
 // MISC
 #define FALSE 0
@@ -0,0 +1,73 @@
+// Link layer statistics header.
+
+#ifndef _LINK_STATS_H_
+#define _LINK_STATS_H_
+
+#include "serial_port.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Latency buckets: bucket i counts samples in [2^i, 2^(i+1)) microseconds
+// (bucket 0 holds everything under 2 us, the last one everything above)
+#define STATS_BUCKETS 24
+
+// Environment variables selecting the machine-readable output ("json" or
+// "csv") and the file it is appended to (standard output if unset)
+#define STATS_FORMAT_VARIABLE "LL_STATS_FORMAT"
+#define STATS_FILE_VARIABLE "LL_STATS_FILE"
+
+// Log-bucketed distribution of a latency, in nanoseconds
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+} LatencyHistogram;
+
+// Everything the link layer measures during a connection
+typedef struct
+{
+    uint64_t start;                 // llopen called (monotonic clock, ns)
+    uint64_t connected;             // Connection established
+    uint64_t end;                   // Connection closed
+    uint64_t payloadBytes;          // Application bytes delivered (accepted by / handed to the peer)
+    uint64_t bytesWritten;          // Bytes written to the serial port
+    uint64_t bytesRead;             // Bytes read from the serial port
+    uint64_t retransmissionsRej;    // Frames resent after a REJ (receiver: REJ sent)
+    uint64_t retransmissionsTimeout;// Frames resent after a timeout (receiver: duplicates received)
+    LatencyHistogram encode;        // Building (and stuffing) an information frame
+    LatencyHistogram wire;          // Writing a frame until it left the port (receiver: frame reception)
+    LatencyHistogram ackRtt;        // End of the frame until its acknowledgement
+    uint64_t phaseFrames[SERIAL_PHASES]; // Frames sent and received in each protocol phase
+} LinkStats;
+
+// Current time of the monotonic clock, in nanoseconds
+uint64_t monotonicNs();
+
+// Seconds elapsed between two instants of the monotonic clock
+double elapsedSeconds(uint64_t from, uint64_t to);
+
+// Application bits delivered per second of data transfer
+double goodput(const LinkStats *stats);
+
+// Share of the bytes crossing the port (both directions) that is application data
+double wireEfficiency(const LinkStats *stats);
+
+// Add a sample (in nanoseconds) to the histogram
+void recordLatency(LatencyHistogram *histogram, uint64_t ns);
+
+// Print the non-empty buckets of every histogram after the statistics table
+void printHistograms(const LinkStats *stats);
+
+// Print the serial port system calls of every protocol phase
+void printIoStats(const LinkStats *stats);
+
+// Append the statistics in the format selected by STATS_FORMAT_VARIABLE, if any.
+// framesSent, framesReceived and bytesAvoided are kept by their own layers.
+void exportStats(const LinkStats *stats, const char *role, int framesSent, int framesReceived,
+                 unsigned long long bytesAvoided);
+
+#endif // _LINK_STATS_H_
@@ -0,0 +1,52 @@
+// Live transfer metrics header.
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+// Environment variable naming the Unix socket serving the metrics (disabled if unset)
+#define METRICS_SOCKET_VARIABLE "LL_METRICS_SOCKET"
+
+// Minimum interval between two throughput samples, in nanoseconds
+#define METRICS_RATE_INTERVAL 250000000ULL
+
+// Counters describing the transfer in progress. They are updated by the
+// transfer and read concurrently by the metrics server, always through the
+// functions below.
+typedef struct
+{
+    uint64_t contentBytes;          // Content bytes acknowledged by (or written by) the receiver
+    uint64_t totalBytes;            // Content bytes expected (0 if unknown)
+    uint64_t bytesAcked;            // Link payload bytes acknowledged (receiver: delivered)
+    uint64_t throughput;            // Smoothed content throughput, bytes per second
+    uint64_t rtt;                   // Smoothed acknowledgement round-trip time, ns
+    uint64_t inFlight;              // Frames sent and not yet acknowledged
+    uint64_t window;                // Frames that may be in flight
+    uint64_t retransmissionsRej;
+    uint64_t retransmissionsTimeout;
+    uint64_t rateTime;              // Last throughput sample (monotonic clock, ns)
+    uint64_t rateBytes;             // Content bytes at the last throughput sample
+} LiveMetrics;
+
+// Reset the counters and, if METRICS_SOCKET_VARIABLE is set, start serving them.
+void metricsStart(const char *role);
+
+// Stop serving the metrics.
+void metricsStop();
+
+// Update the counters (called by the transfer)
+void metricsContent(uint64_t contentBytes);
+void metricsTotal(uint64_t totalBytes);
+void metricsAcked(uint64_t bytes);
+void metricsRtt(uint64_t sample);
+void metricsInFlight(uint64_t frames);
+void metricsRetransmission(int rejected);
+
+// Consistent-enough copy of the counters, for readers
+void metricsSnapshot(LiveMetrics *snapshot);
+
+// Estimated seconds left, or -1 if unknown
+double metricsEta(const LiveMetrics *snapshot);
+
+#endif // _METRICS_H_
@@ -4,6 +4,34 @@
 #ifndef _SERIAL_PORT_H_
 #define _SERIAL_PORT_H_
 
+#include <stdint.h>
+
+// Protocol phases the I/O accounting is broken down by
+typedef enum
+{
+    SERIAL_PHASE_OPEN,          // Connection establishment (SET / UA)
+    SERIAL_PHASE_DATA,          // Information frames and their acknowledgements
+    SERIAL_PHASE_CLOSE,         // Disconnection (DISC / UA)
+    SERIAL_PHASES
+} SerialPhase;
+
+// System calls made on the serial port during one phase
+typedef struct
+{
+    uint64_t readCalls;
+    uint64_t readBytes;
+    uint64_t emptyReads;        // Reads that returned no byte (VTIME expired or EAGAIN)
+    uint64_t readNs;            // Time spent inside read(2)
+    uint64_t writeCalls;
+    uint64_t writeBytes;
+    uint64_t partialWrites;     // Writes that accepted only part of the bytes
+    uint64_t writeAgain;        // Writes that failed with EAGAIN / EINTR and were retried
+    uint64_t writeNs;           // Time spent inside write(2)
+} SerialIoStats;
+
+// Baud rates of the serial port, in increasing order (0 terminated)
+extern const int serialBaudRates[];
+
 // Open and configure the serial port.
 // Returns -1 on error.
 int openSerialPort(const char *serialPort, int baudRate);
@@ -17,9 +45,31 @@ int closeSerialPort();
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
 int readByteSerialPort(unsigned char *byte);
 
-// Write up to numBytes to the serial port (must check how many were actually
-// written in the return value).
+// Write numBytes to the serial port, retrying after short writes.
 // Returns -1 on error, otherwise the number of bytes written.
 int writeBytesSerialPort(const unsigned char *bytes, int numBytes);
 
+// Wait until all the bytes written have been transmitted.
+// Returns -1 on error.
+int drainSerialPort();
+
+// Deliver SIGALRM after the given seconds of the port's clock (0 cancels).
+// Returns the seconds left of the previous alarm.
+unsigned int alarmSerialPort(unsigned int seconds);
+
+// Change the baud rate of the open port (the bytes already written leave at
+// the old one).
+// Returns -1 on error or if the transport has no baud rate.
+int setBaudRateSerialPort(int baudRate);
+
+// Highest baud rate the open port can be set to, or 0 if the transport has
+// no baud rate.
+int maxBaudRateSerialPort();
+
+// Account the following system calls to the given phase.
+void setSerialPhase(SerialPhase phase);
+
+// I/O accounting of a phase.
+const SerialIoStats *getSerialIoStats(SerialPhase phase);
+
 #endif // _SERIAL_PORT_H_
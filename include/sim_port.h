@@ -0,0 +1,62 @@
+// Simulated serial port header.
+
+#ifndef _SIM_PORT_H_
+#define _SIM_PORT_H_
+
+#include <stdint.h>
+
+// Serial port names starting with this prefix open a simulated link:
+//   sim:PATH[,prop=USEC][,ber=RATE][,seed=N][,maxbaud=RATE]
+// Both ends open the same PATH (a file shared between the two processes); the
+// parameters and the baud rate of the end that creates the link are used.
+// Bytes sent faster than maxbaud get SIM_FAST_ERROR_RATE, and bytes received
+// at another speed than they were sent at are garbled.
+#define SIM_PREFIX "sim:"
+
+// Virtual time of the first event, in nanoseconds
+#define SIM_EPOCH 1000000000ULL
+
+// Bytes that may be in flight in each direction (further bytes are lost,
+// like in an overrun UART)
+#define SIM_QUEUE_SIZE (1 << 16)
+
+// How long a read waits for a byte before giving up (VTIME of the real port)
+#define SIM_READ_TIMEOUT 100000000ULL
+
+// Byte error rate above the maximum baud rate of the line
+#define SIM_FAST_ERROR_RATE 0.01
+
+// Open (or join) the simulated link described by name, without the prefix.
+// Returns a file descriptor, or -1 on error.
+int openSimulatedPort(const char *name, int baudRate);
+
+// Leave the simulated link.
+// Returns -1 on error.
+int closeSimulatedPort();
+
+// Wait up to SIM_READ_TIMEOUT of virtual time for a byte.
+// Returns 0 if no byte was received, 1 if a byte was received.
+int readByteSimulatedPort(unsigned char *byte);
+
+// Queue numBytes on the wire, after the bytes still being transmitted.
+// Returns the number of bytes written.
+int writeBytesSimulatedPort(const unsigned char *bytes, int numBytes);
+
+// Wait until every byte written has left the line.
+int drainSimulatedPort();
+
+// Raise SIGALRM once seconds of virtual time elapse (0 cancels).
+// Returns the seconds left of the previous alarm.
+unsigned int alarmSimulatedPort(unsigned int seconds);
+
+// Change the speed of our end.
+// Returns -1 on error.
+int setBaudRateSimulatedPort(int baudRate);
+
+// Whether a simulated link is open
+int simulationActive();
+
+// Current virtual time, in nanoseconds
+uint64_t simulationClock();
+
+#endif // _SIM_PORT_H_
@@ -0,0 +1,51 @@
+// Event tracer header.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "link_stats.h"
+
+#include <stdint.h>
+
+// Environment variable naming the trace file (tracing disabled if unset)
+#define TRACE_VARIABLE "LL_TRACE"
+
+// Number of events kept: once full, the oldest events are overwritten
+#define TRACE_CAPACITY (1 << 16)
+
+typedef enum
+{
+    TRACE_FRAME_ENCODED,    // Information frame built and stuffed (value: frame size)
+    TRACE_FRAME_WRITTEN,    // Frame written and drained (value: frame size)
+    TRACE_ACK_RECEIVED,     // RR (or implicit acknowledgement) received (value: sequence number)
+    TRACE_REJ,              // REJ received (transmitter) or sent (receiver) (value: sequence number)
+    TRACE_ALARM,            // Retransmission alarm fired (value: alarm count)
+    TRACE_LLREAD,           // llread returned (value: packet size)
+    TRACE_FWRITE,           // Received content written to the output file (value: bytes)
+} TraceEventType;
+
+// TRUE while tracing, checked before recording anything
+extern int traceEnabled;
+
+// Timestamp for the start of a traced span (0 when disabled, to skip the clock)
+#define TRACE_NOW() (traceEnabled ? monotonicNs() : 0)
+
+// Record an instant event
+#define TRACE_INSTANT(type, value) \
+    do { if (traceEnabled) traceEvent(type, monotonicNs(), 0, value); } while (0)
+
+// Record a span that started at start (a TRACE_NOW() or monotonicNs() timestamp)
+#define TRACE_SPAN(type, start, value) \
+    do { if (traceEnabled) { uint64_t _now = monotonicNs(); traceEvent(type, start, _now - (start), value); } } while (0)
+
+// Start tracing if TRACE_VARIABLE is set; role names the thread in the trace.
+void traceInit(const char *role);
+
+// Append an event to the ring buffer (safe to call from a signal handler).
+void traceEvent(TraceEventType type, uint64_t timestamp, uint64_t duration, uint64_t value);
+
+// Write the events in the ring to the trace file (Chrome trace event format)
+// and stop tracing.
+void traceDump();
+
+#endif // _TRACE_H_
@@ -0,0 +1,51 @@
+// Transport backends header.
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+// What carries the frames between the two sides, chosen by openSerialPort from
+// the prefix of the port name:
+//   /dev/ttySxx          a serial port (default)
+//   sim:PATH[,...]       simulated link on a virtual clock (see sim_port.h)
+//   unix:PATH            Unix stream socket, a socketpair between two processes
+//   shm:PATH             lock-free shared-memory rings
+// All but the serial port ignore the baud rate (except the simulation) and
+// move bytes as fast as the processes do, which measures the CPU ceiling of
+// the protocol.
+typedef struct
+{
+    const char *prefix;         // Prefix of the port names of the backend ("" for the tty)
+    const char *name;
+
+    // Open the link named by the rest of the port name.
+    // Returns a file descriptor, or -1 on error.
+    int (*open)(const char *name, int baudRate);
+
+    // Returns -1 on error.
+    int (*close)();
+
+    // Wait up to 0.1 second for a byte.
+    // Returns -1 on error (errno EINTR / EAGAIN if none arrived), 0 if no byte
+    // was received, 1 if a byte was received.
+    int (*readByte)(unsigned char *byte);
+
+    // Returns -1 on error, otherwise the number of bytes written (maybe short).
+    int (*write)(const unsigned char *bytes, int numBytes);
+
+    // Wait until every byte written has left.
+    int (*drain)();
+
+    // Raise SIGALRM once seconds elapse on the backend's clock (0 cancels).
+    unsigned int (*alarm)(unsigned int seconds);
+
+    // Change the baud rate once the bytes written have left (NULL if the
+    // backend has none). Returns -1 on error.
+    int (*setBaudRate)(int baudRate);
+} Transport;
+
+extern const Transport ttyTransport;
+extern const Transport simTransport;
+extern const Transport socketTransport;
+extern const Transport shmTransport;
+
+#endif // _TRANSPORT_H_
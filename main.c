@@ -15,7 +15,7 @@
 //   $1: /dev/ttySxx
 //   $2: baud rate
 //   $3: tx | rx
-//   $4: filename
+//   $4: filename ("-" for stdin / stdout)
 int main(int argc, char *argv[])
 {
     if (argc < 5) {
@@ -39,9 +39,24 @@ int main(int argc, char *argv[])
         case 38400:
         case 57600:
         case 115200:
+        case 230400:
+        case 460800:
+        case 500000:
+        case 576000:
+        case 921600:
+        case 1000000:
+        case 1152000:
+        case 1500000:
+        case 2000000:
+        case 2500000:
+        case 3000000:
+        case 3500000:
+        case 4000000:
             break;
         default:
-            printf("Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200)\n");
+            printf("Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200,\n"
+                   "230400, 460800, 500000, 576000, 921600, 1000000, 1152000, 1500000, 2000000, 2500000,\n"
+                   "3000000, 3500000, 4000000)\n");
             exit(2);
     }
 
@@ -51,7 +66,10 @@ int main(int argc, char *argv[])
         exit(3);
     }
 
-    printf("Starting link-layer protocol application\n"
+    // Content received on the standard output ("-") must not be mixed with the log
+    FILE *log = (strcmp("rx", role) == 0 && strcmp("-", filename) == 0) ? stderr : stdout;
+
+    fprintf(log, "Starting link-layer protocol application\n"
            "  - Serial port: %s\n"
            "  - Role: %s\n"
            "  - Baudrate: %d\n"
@@ -1,59 +1,582 @@
 // Application layer protocol implementation
 
 #include "application_layer.h"
+#include "checkpoint.h"
+#include "chunk_store.h"
+#include "metrics.h"
+#include "trace.h"
+#include "delta.h"
+#include "hash.h"
 #include "link_layer.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 // Control field indicating type of packet
 #define startPacket 0x01
 #define dataPacket 0x02
 #define endPacket 0x03
+#define manifestPacket 0x04
+#define resumePacket 0x05
+#define deltaPacket 0x06
+#define signaturePacket 0x07
+#define chunkRefPacket 0x08
+#define chunkAckPacket 0x09
+#define resultPacket 0x0A
+
+// Type field of the control packet parameters (TLV)
+#define T_FILE_SIZE 0x00
+#define T_FILE_NAME 0x01
+#define T_FILE_COUNT 0x02
+#define T_RESUME 0x03
+#define T_HASH 0x04
+#define T_BLOCK_SIZE 0x05
+#define T_BLOCK_COUNT 0x06
+#define T_DELTA 0x07
+#define T_CHUNK_STORE 0x08
+
+// Operations of a delta packet
+#define DELTA_LITERAL 0x00
+#define DELTA_COPY 0x01
+
+// Maximum number of content bytes carried by a single data packet
+#define MAX_CONTENT_SIZE (MAX_PAYLOAD_SIZE - 3)
+
+// Environment variable fixing the content of a data packet (e.g. to benchmark
+// frame sizes) instead of letting the link's frame-size controller pick it
+#define FRAME_SIZE_VARIABLE "LL_FRAME_SIZE"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// Environment variable naming the directory of the chunk store (cache disabled if unset)
+#define CHUNK_STORE_VARIABLE "LL_CHUNK_STORE"
+
+// Chunk references per packet: their chunks are kept by the transmitter until
+// the receiver confirms it could expand them
+#define CHUNK_REFS_PER_PACKET 32
+
+// Environment variable letting the receiver use an existing output file as the
+// base of a delta (the whole file is sent if unset)
+#define DELTA_VARIABLE "LL_DELTA"
+
+// File name standing for the standard input (transmitter) or output (receiver)
+#define STDIO_NAME "-"
+
+// Size of a stream whose end is only known when the END packet arrives
+#define UNKNOWN_SIZE UINT64_MAX
+
+// Minimum interval between two redraws of the progress bar, in nanoseconds
+#define PROGRESS_INTERVAL 100000000ULL
+
+// Maximum length of a file name (including the relative path inside a batch)
+#define MAX_NAME_SIZE 255
 
 extern int rejected;
-int zeroResponse = FALSE;
+extern unsigned long long bytesAvoided;
+
+// Descriptor of the original standard output when it receives the content
+int stdoutSink = -1;
+
+// Last time the progress bar was drawn (monotonic clock, ns)
+uint64_t lastProgressDraw = 0;
+
+// Content bytes sent per data packet (at most)
+int packetContentSize = MAX_CONTENT_SIZE;
+int fixedContentSize = FALSE;
+
+// Entry of the manifest: one file of the transfer
+typedef struct {
+    char name[MAX_NAME_SIZE + 1];   // Path relative to the batch root (or file name)
+    uint64_t size;                  // Size of the file content (UNKNOWN_SIZE while streaming)
+    mode_t mode;                    // Permission bits
+} FileEntry;
 
-// Update progress bar
-void updateProgressBar(int bytesWritten, int fileSize) {
-    int progressBarWidth = 50;
-    float progress = (float) bytesWritten / fileSize;
-    int pos = progress * progressBarWidth;
+// Sequence of files transferred back to back as one contiguous byte stream
+typedef struct {
+    const char *root;       // Directory holding the files (NULL for a single file)
+    FileEntry *entries;
+    int count;
+    int capacity;
+    int current;            // Entry being read / written
+    uint64_t remaining;     // Content bytes left in the current entry
+    FILE *file;             // Open handle of the current entry
+} FileStream;
 
-    printf("\r[");
-    for (int i = 0; i < progressBarWidth; i++) {
-        if (i < pos) printf("=");
-        else if (i == pos) printf(">");
-        else printf(" ");
+// Parameters carried by a control packet
+typedef struct {
+    int type;
+    uint64_t fileSize;
+    int sizeUnknown;                    // Content is streamed, its size comes with the END packet
+    char filename[MAX_NAME_SIZE + 1];
+    int fileCount;                      // Number of files of a batch (0 for a single file)
+    int resumeQuery;                    // Transmitter asks where to resume from
+    int hasOffset;
+    uint64_t offset;                    // Offset to resume from
+    int hasHash;
+    unsigned char hash[SHA256_SIZE];    // Hash of the content (or of the part already delivered)
+    int blockSize;                      // Block size of the signatures of the receiver's copy
+    int blockCount;                     // Number of signatures following the packet
+    int delta;                          // Transmitter sends a delta against the receiver's copy
+    int chunkQuery;                     // Transmitter asks for the receiver's chunk store
+    int hasStoreId;
+    uint64_t storeId;                   // Chunk store used for the transfer
+} ControlPacket;
+
+// Outcome of the negotiation that follows the START packet
+typedef struct {
+    uint64_t offset;                    // Bytes the receiver already holds (resume)
+    int delta;                          // TRUE if a delta against the receiver's copy is sent
+    int chunking;                       // TRUE if chunks held by the receiver's store are sent as references
+    int blockSize;
+    int blockCount;
+    BlockSignature *signatures;         // Signatures of the receiver's copy (transmitter only)
+} Negotiation;
+
+// Delta packet under construction
+typedef struct {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int pos;
+    int blockSize;
+    uint32_t copyBlock;                 // Pending run of copied blocks
+    int copyCount;
+    uint64_t literalBytes;
+    uint64_t copiedBytes;
+} DeltaWriter;
+
+// Content split into chunks, being sent as data and chunk references
+typedef struct {
+    ChunkStore *store;
+    unsigned char data[MAX_CONTENT_SIZE];   // Content of the next data packet
+    int dataSize;
+    unsigned char refs[MAX_PAYLOAD_SIZE];   // Next chunk reference packet
+    int refCount;
+    unsigned char *held;                    // Content of the referenced chunks, back to back
+    int heldSizes[CHUNK_REFS_PER_PACKET];
+    int heldSize;
+} ChunkSender;
+
+// Redraw the progress bar from the live metrics, at most every
+// PROGRESS_INTERVAL unless forced (e.g. at the end of the transfer)
+void updateProgressBar(int force) {
+    uint64_t now = monotonicNs();
+    if (!force && now - lastProgressDraw < PROGRESS_INTERVAL) {
+        return;
+    }
+    lastProgressDraw = now;
+
+    LiveMetrics metrics;
+    metricsSnapshot(&metrics);
+    char line[160];
+    int pos = 0;
+
+    // Without a known size only the number of bytes sent can be shown
+    if (metrics.totalBytes == 0) {
+        pos = snprintf(line, sizeof(line), "\r%llu bytes sent", (unsigned long long) metrics.contentBytes);
     }
-    printf("] %d%%", (int)(progress * 100));
+    else {
+        int progressBarWidth = 50;
+        double progress = (double) metrics.contentBytes / metrics.totalBytes;
+        if (progress > 1) progress = 1;
+        int filled = progress * progressBarWidth;
 
+        line[pos++] = '\r';
+        line[pos++] = '[';
+        for (int i = 0; i < progressBarWidth; i++) {
+            if (i < filled) line[pos++] = '=';
+            else if (i == filled) line[pos++] = '>';
+            else line[pos++] = ' ';
+        }
+        pos += snprintf(line + pos, sizeof(line) - pos, "] %d%%", (int) (progress * 100));
+    }
+
+    if (metrics.throughput > 0) {
+        pos += snprintf(line + pos, sizeof(line) - pos, "  %.1f KiB/s", metrics.throughput / 1024.0);
+    }
+    double eta = metricsEta(&metrics);
+    if (eta >= 0) {
+        pos += snprintf(line + pos, sizeof(line) - pos, "  ETA %ds", (int) (eta + 0.5));
+    }
+    snprintf(line + pos, sizeof(line) - pos, "    ");
+
+    fputs(line, stdout);
     fflush(stdout);
 }
 
+// Append a new entry to the stream
+FileEntry *addFileEntry(FileStream *stream) {
+    if (stream->count == stream->capacity) {
+        stream->capacity = stream->capacity ? stream->capacity * 2 : 16;
+        stream->entries = realloc(stream->entries, stream->capacity * sizeof(FileEntry));
+        if (stream->entries == NULL) {
+            perror("ERROR: Couldn't allocate the manifest.\n");
+            exit(-1);
+        }
+    }
+    FileEntry *entry = &stream->entries[stream->count++];
+    memset(entry, 0, sizeof(FileEntry));
+    return entry;
+}
+
+// Check whether a file name stands for the standard input / output
+int isStdioName(const char *name) {
+    return strcmp(name, STDIO_NAME) == 0;
+}
+
+// Build the full path of an entry of the stream
+void entryPath(const FileStream *stream, const FileEntry *entry, char *path, size_t pathSize) {
+    if (stream->root != NULL) {
+        snprintf(path, pathSize, "%s/%s", stream->root, entry->name);
+    }
+    else {
+        snprintf(path, pathSize, "%s", entry->name);
+    }
+}
+
+// Recursively add every regular file below root/relative to the manifest
+int scanDirectory(FileStream *stream, const char *relative) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s%s", stream->root, *relative ? "/" : "", relative);
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    struct dirent *dirEntry;
+    while ((dirEntry = readdir(dir)) != NULL) {
+        if (strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char name[2048];
+        snprintf(name, sizeof(name), "%s%s%s", relative, *relative ? "/" : "", dirEntry->d_name);
+        snprintf(path, sizeof(path), "%s/%s", stream->root, name);
+
+        struct stat st;
+        if (lstat(path, &st) < 0) {
+            perror(path);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (scanDirectory(stream, name) < 0) {
+                closedir(dir);
+                return -1;
+            }
+        }
+        else if (S_ISREG(st.st_mode)) {
+            if (strlen(name) > MAX_NAME_SIZE) {
+                printf("Skipping %s: name longer than %d characters.\n", name, MAX_NAME_SIZE);
+                continue;
+            }
+            FileEntry *entry = addFileEntry(stream);
+            strcpy(entry->name, name);
+            entry->size = st.st_size;
+            entry->mode = st.st_mode & 0777;
+        }
+    }
+
+    closedir(dir);
+    return 1;
+}
+
+// Total number of content bytes in the stream
+uint64_t streamSize(const FileStream *stream) {
+    uint64_t total = 0;
+    for (int i = 0; i < stream->count; i++) {
+        if (stream->entries[i].size == UNKNOWN_SIZE) {
+            return UNKNOWN_SIZE;
+        }
+        total += stream->entries[i].size;
+    }
+    return total;
+}
+
+// Read up to size bytes of the stream, crossing file boundaries as needed.
+// Returns the number of bytes read (0 at the end of the stream) or -1 on error.
+int readStream(FileStream *stream, unsigned char *buf, int size) {
+    int total = 0;
+    while (total < size && stream->current < stream->count) {
+        FileEntry *entry = &stream->entries[stream->current];
+        if (stream->file == NULL) {
+            char path[4096];
+            entryPath(stream, entry, path, sizeof(path));
+            stream->file = isStdioName(path) ? stdin : fopen(path, "rb");
+            if (stream->file == NULL) {
+                perror(path);
+                return -1;
+            }
+            stream->remaining = entry->size;
+        }
+
+        size_t wanted = size - total;
+        if (wanted > stream->remaining) wanted = stream->remaining;
+        size_t got = wanted ? fread(buf + total, 1, wanted, stream->file) : 0;
+        if (got < wanted && entry->size == UNKNOWN_SIZE && !ferror(stream->file)) {
+            // A stream of unknown size ends with its source
+            stream->remaining = got;
+        }
+        else if (got < wanted) {
+            printf("ERROR: File %s changed size during the transfer.\n", entry->name);
+            return -1;
+        }
+        total += got;
+        stream->remaining -= got;
+
+        if (stream->remaining == 0) {
+            fclose(stream->file);
+            stream->file = NULL;
+            stream->current++;
+        }
+    }
+    return total;
+}
+
+// Skip the first offset bytes of a single file stream (already delivered).
+// Returns 1 on success or -1 on error.
+int seekStream(FileStream *stream, uint64_t offset) {
+    FileEntry *entry = &stream->entries[0];
+    char path[4096];
+    entryPath(stream, entry, path, sizeof(path));
+    stream->file = fopen(path, "rb");
+    if (stream->file == NULL || fseeko(stream->file, offset, SEEK_SET) < 0) {
+        perror(path);
+        return -1;
+    }
+    stream->remaining = entry->size - offset;
+    return 1;
+}
+
+// Create every missing directory leading to path
+void makeParentDirectories(const char *path) {
+    char partial[4096];
+    snprintf(partial, sizeof(partial), "%s", path);
+    for (char *slash = strchr(partial + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(partial, 0755);
+        *slash = '/';
+    }
+}
+
+// Open the next entry of the stream for writing.
+// Returns 1 on success or -1 on error.
+int openStreamEntry(FileStream *stream) {
+    FileEntry *entry = &stream->entries[stream->current];
+    char path[4096];
+    entryPath(stream, entry, path, sizeof(path));
+    if (stream->root != NULL) {
+        makeParentDirectories(path);
+    }
+
+    stream->file = isStdioName(path) ? fdopen(stdoutSink, "wb") : fopen(path, "wb+");
+    if (stream->file == NULL) {
+        perror(path);
+        return -1;
+    }
+    stream->remaining = entry->size;
+    return 1;
+}
+
+// Reopen a partially received single file, keeping its first offset bytes.
+// Returns 1 on success or -1 on error.
+int resumeStreamEntry(FileStream *stream, uint64_t offset) {
+    FileEntry *entry = &stream->entries[0];
+    stream->file = fopen(entry->name, "rb+");
+    if (stream->file == NULL || ftruncate(fileno(stream->file), offset) < 0 ||
+        fseeko(stream->file, offset, SEEK_SET) < 0) {
+        perror(entry->name);
+        return -1;
+    }
+    stream->remaining = entry->size - offset;
+    return 1;
+}
+
+// Close the current entry of the stream and move on to the next one
+void closeStreamEntry(FileStream *stream) {
+    FileEntry *entry = &stream->entries[stream->current];
+    if (stream->root != NULL && entry->mode != 0) {
+        fchmod(fileno(stream->file), entry->mode);
+    }
+    fclose(stream->file);
+    stream->file = NULL;
+    stream->current++;
+}
+
+// Write size bytes of the stream, splitting them across the files of the manifest.
+// Returns 1 on success or -1 on error.
+int writeStream(FileStream *stream, const unsigned char *buf, int size) {
+    int total = 0;
+    while (stream->current < stream->count) {
+        if (stream->file == NULL && openStreamEntry(stream) < 0) {
+            return -1;
+        }
+
+        size_t chunk = size - total;
+        if (chunk > stream->remaining) chunk = stream->remaining;
+        uint64_t writeStart = TRACE_NOW();
+        if (fwrite(buf + total, 1, chunk, stream->file) != chunk) {
+            perror("ERROR: Couldn't write to File.\n");
+            return -1;
+        }
+        TRACE_SPAN(TRACE_FWRITE, writeStart, chunk);
+        total += chunk;
+        stream->remaining -= chunk;
+
+        // Empty files are created as soon as the stream reaches them
+        if (stream->remaining == 0) {
+            closeStreamEntry(stream);
+        }
+        else {
+            break;
+        }
+    }
+
+    if (total < size) {
+        printf("ERROR: Received more content than announced in the manifest.\n");
+        return -1;
+    }
+    return 1;
+}
+
+// Release every resource held by the stream
+void freeStream(FileStream *stream) {
+    if (stream->file != NULL) {
+        fclose(stream->file);
+        stream->file = NULL;
+    }
+    free(stream->entries);
+    stream->entries = NULL;
+    stream->count = stream->capacity = 0;
+}
+
+// Check that a name received in the manifest stays inside the batch directory
+int isSafeName(const char *name) {
+    if (*name == '\0' || *name == '/') {
+        return FALSE;
+    }
+    for (const char *part = name; part != NULL; part = strchr(part, '/')) {
+        if (*part == '/') part++;
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0')) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Send a packet, resending it when the receiver rejects it.
+// Returns 1 on success or -1 when the number of retransmissions is exceeded.
+int writePacket(const unsigned char *packet, int packetSize) {
+    while (llwrite(packet, packetSize) < 0) {
+        if (!rejected) {
+            return -1;
+        }
+        printf("\nReceived REJ, resending packet...\n");
+        rejected = FALSE;
+    }
+    return 1;
+}
+
+// Read the next packet, skipping duplicated frames.
+// Returns the packet size or -1 on error.
+int readPacket(unsigned char *packet) {
+    int packetSize;
+    while ((packetSize = llread(packet)) == 0);
+    return packetSize;
+}
+
+// Append a TLV parameter holding an unsigned number (big endian, as few bytes as needed)
+int putNumber(unsigned char *packet, int pos, unsigned char type, uint64_t value) {
+    int length = 1;
+    for (uint64_t v = value >> 8; v != 0; v >>= 8) length++;
+    packet[pos++] = type;
+    packet[pos++] = length;
+    for (int b = length - 1; b >= 0; b--) {
+        packet[pos++] = (value >> (8 * b)) & 0xFF;
+    }
+    return pos;
+}
+
+// Value of a number parameter of the given length
+uint64_t getNumber(const unsigned char *value, int length) {
+    uint64_t number = 0;
+    for (int b = 0; b < length; b++) {
+        number = (number << 8) | value[b];
+    }
+    return number;
+}
+
 // Send Control Packet
-int sendControlPacket(int type, const char *filename, int fileSize) {
+int sendControlPacket(const ControlPacket *control) {
     // Initialize Packet
-    int numBits = sizeof(int) * 8 - __builtin_clz(fileSize);        // Number of bits needed to represent fileSize
-    size_t fileLength = (numBits+7)/8;                              // Number of bytes needed to represent fileSize
-    size_t filenameSize = strlen(filename);                         // Size of filename
-    int packetSize = 3 + fileLength + 2 + filenameSize;             // Size of packet
-    unsigned char *packet = (unsigned char*) malloc(packetSize);    // Allocate memory for packet
+    size_t filenameSize = strlen(control->filename);                // Size of filename
+    unsigned char packet[MAX_PAYLOAD_SIZE];
 
     // Construct packet: See protocol page 27
     int pos = 0;
-    packet[pos++] = type; // 0x01 if Start, 0x03 if End
-    packet[pos++] = 0; // T1 -> File Size
-    packet[pos++] = sizeof(size_t); // L1
-    memcpy(packet + pos, &fileSize, sizeof(size_t)); // V1 File Size Value
-    pos += sizeof(size_t); // Move position to the end of the File Size Value
-    packet[pos++] = 1; // T2 -> File Name
-    packet[pos++] = filenameSize; // L2
-    memcpy(packet + pos, filename, filenameSize); // V2 File Name Value
+    packet[pos++] = control->type; // 0x01 if Start, 0x03 if End
+    if (control->type == startPacket || control->type == endPacket) {
+        // T1 -> File Size (big endian, empty if the size is unknown)
+        if (control->sizeUnknown) {
+            packet[pos++] = T_FILE_SIZE;
+            packet[pos++] = 0;
+        }
+        else {
+            pos = putNumber(packet, pos, T_FILE_SIZE, control->fileSize);
+        }
+        packet[pos++] = T_FILE_NAME; // T2 -> File Name
+        packet[pos++] = filenameSize; // L2
+        memcpy(packet + pos, control->filename, filenameSize); // V2 File Name Value
+        pos += filenameSize;
+    }
+
+    // Batch transfers also announce how many files the manifest describes
+    if (control->fileCount > 0) {
+        pos = putNumber(packet, pos, T_FILE_COUNT, control->fileCount);
+    }
+
+    // Resume: an empty value asks the receiver where to resume from
+    if (control->resumeQuery) {
+        packet[pos++] = T_RESUME;
+        packet[pos++] = 0;
+    }
+    else if (control->hasOffset) {
+        pos = putNumber(packet, pos, T_RESUME, control->offset);
+    }
+
+    if (control->blockCount > 0) {
+        pos = putNumber(packet, pos, T_BLOCK_SIZE, control->blockSize);
+        pos = putNumber(packet, pos, T_BLOCK_COUNT, control->blockCount);
+    }
+    if (control->delta) {
+        pos = putNumber(packet, pos, T_DELTA, 1);
+    }
+
+    // Chunk store: an empty value asks for the receiver's store
+    if (control->chunkQuery) {
+        packet[pos++] = T_CHUNK_STORE;
+        packet[pos++] = 0;
+    }
+    else if (control->hasStoreId) {
+        pos = putNumber(packet, pos, T_CHUNK_STORE, control->storeId);
+    }
+
+    if (control->hasHash) {
+        packet[pos++] = T_HASH;
+        packet[pos++] = SHA256_SIZE;
+        memcpy(packet + pos, control->hash, SHA256_SIZE);
+        pos += SHA256_SIZE;
+    }
 
     // Send packet
-    if (llwrite(packet, packetSize) < 0) {
+    if (writePacket(packet, pos) < 0) {
         perror("ERROR: Failed to send Control Packet.\n");
         return -1;
     }
@@ -63,37 +586,83 @@ int sendControlPacket(int type, const char *filename, int fileSize) {
     return 1;
 }
 
-// Read Control Packet
-int readControlPacket(int type, unsigned char *buffer, size_t *fileSize, char *filename) {
-    // Read Control Packet
-    size_t packetSize;
-    if ((packetSize = llread(buffer)) < 0) {
-        perror("ERROR: Failed to read Control Packet.\n");
-        return -1;
-    }
-
-    // Check if the type is correct
-    if (buffer[0] != type) {
-        perror("ERROR: Invalid Control Packet.\n");
-        return -1;
-    }
-
+// Parse the parameters of a Control Packet
+int readControlPacketFields(const unsigned char *buffer, int packetSize, ControlPacket *control) {
     // Parse Control Packet: See protocol page 27
+    memset(control, 0, sizeof(ControlPacket));
+    control->type = buffer[0];
     int i = 1;
-    unsigned char info;
-    while (i < packetSize) {
+    unsigned char info, length;
+    while (i + 1 < packetSize) {
         info = buffer[i++];
+        length = buffer[i++];
+        if (i + length > packetSize) {
+            perror("ERROR: Invalid Control Packet.\n");
+            return -1;
+        }
+
         switch (info) {
             // File Size
-            case 0:
-                memcpy(fileSize, buffer + i, sizeof(size_t));
-                i += sizeof(size_t);
+            case T_FILE_SIZE:
+                if (length > sizeof(uint64_t)) {
+                    perror("ERROR: Invalid Control Packet.\n");
+                    return -1;
+                }
+                control->sizeUnknown = (length == 0);
+                control->fileSize = getNumber(buffer + i, length);
                 break;
 
             // File Name
-            case 1:
-                memcpy(filename, buffer + i + 1, buffer[i]);
-                i += buffer[i] + 1;
+            case T_FILE_NAME:
+                memcpy(control->filename, buffer + i, length);
+                control->filename[length] = '\0';
+                break;
+
+            // File Count
+            case T_FILE_COUNT:
+                if (length > sizeof(uint64_t)) {
+                    perror("ERROR: Invalid Control Packet.\n");
+                    return -1;
+                }
+                control->fileCount = getNumber(buffer + i, length);
+                break;
+
+            // Resume query (empty) or resume offset
+            case T_RESUME:
+                control->resumeQuery = (length == 0);
+                control->hasOffset = (length > 0);
+                control->offset = getNumber(buffer + i, length);
+                break;
+
+            // Content hash
+            case T_HASH:
+                if (length != SHA256_SIZE) {
+                    perror("ERROR: Invalid Control Packet.\n");
+                    return -1;
+                }
+                control->hasHash = TRUE;
+                memcpy(control->hash, buffer + i, SHA256_SIZE);
+                break;
+
+            // Signatures of the receiver's copy
+            case T_BLOCK_SIZE:
+                control->blockSize = getNumber(buffer + i, length);
+                break;
+
+            case T_BLOCK_COUNT:
+                control->blockCount = getNumber(buffer + i, length);
+                break;
+
+            // Delta transfer
+            case T_DELTA:
+                control->delta = getNumber(buffer + i, length) != 0;
+                break;
+
+            // Chunk store query (empty) or identifier
+            case T_CHUNK_STORE:
+                control->chunkQuery = (length == 0);
+                control->hasStoreId = (length > 0);
+                control->storeId = getNumber(buffer + i, length);
                 break;
 
             // Invalid Control
@@ -101,12 +670,38 @@ int readControlPacket(int type, unsigned char *buffer, size_t *fileSize, char *f
                 perror("ERROR: Invalid Control Packet.\n");
                 return -1;
         }
+        i += length;
     }
 
     return 1;
 }
 
-// Send Data Packet
+// Read Control Packet
+int readControlPacket(int type, unsigned char *buffer, ControlPacket *control) {
+    // Read Control Packet (duplicated frames are reported with size 0)
+    int packetSize;
+    if ((packetSize = readPacket(buffer)) < 0) {
+        perror("ERROR: Failed to read Control Packet.\n");
+        return -1;
+    }
+
+    // Check if the type is correct
+    if (buffer[0] != type) {
+        perror("ERROR: Invalid Control Packet.\n");
+        return -1;
+    }
+
+    return readControlPacketFields(buffer, packetSize, control);
+}
+
+// Content bytes of the next data packet: what suits the link's frame-size
+// controller, unless LL_FRAME_SIZE fixed it
+int nextContentSize() {
+    return fixedContentSize ? packetContentSize : MIN(packetContentSize, linkPayloadSize - 3);
+}
+
+// Send Data Packet, resending it until it is acknowledged.
+// Returns 0 on success; aborts when the number of retransmissions is exceeded.
 int sendDataPacket(unsigned char *buffer, int contentSize) {
     // Initialize Packet
     int packetSize = contentSize + 3;
@@ -114,50 +709,663 @@ int sendDataPacket(unsigned char *buffer, int contentSize) {
 
     // Construct packet: See protocol page 27
     int pos = 0;
-    packet[pos++] = 0x02; // Control field: data packet -> 2
+    packet[pos++] = dataPacket; // Control field: data packet -> 2
     packet[pos++] = (unsigned char) (contentSize / 256); // L2
     packet[pos++] = (unsigned char) (contentSize % 256); // L1
     memcpy(packet + pos, buffer, contentSize); // Data field
-    pos += contentSize;
-    packet[pos++] = 0;
 
     // Send packet and wait for RR or REJ
-    int result;
-    while (1) {
-        if ((result = llwrite(packet, packetSize)) > 0) {
+    if (writePacket(packet, packetSize) < 0) {
+        printf("\nExceeded number of retransmissions, aborting...\n");
+        exit(-1);
+    }
+
+    free(packet);
+
+    return 0;
+}
+
+// Send the manifest of a batch: name, size and mode of every file, packed
+// into as few manifest packets as possible
+int sendManifest(const FileStream *stream) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int pos = 1;
+    packet[0] = manifestPacket;
+
+    for (int i = 0; i < stream->count; i++) {
+        const FileEntry *entry = &stream->entries[i];
+        size_t nameSize = strlen(entry->name);
+
+        // Entry: | nameSize | name | sizeLength | size (big endian) | mode (2 bytes) |
+        int sizeLength = 0;
+        for (uint64_t v = entry->size; v != 0; v >>= 8) sizeLength++;
+        int entrySize = 1 + nameSize + 1 + sizeLength + 2;
+
+        if (pos + entrySize > linkCapabilities.maxPayloadSize) {
+            if (writePacket(packet, pos) < 0) {
+                printf("Exceeded number of retransmissions, aborting...\n");
+                return -1;
+            }
+            pos = 1;
+        }
+
+        packet[pos++] = nameSize;
+        memcpy(packet + pos, entry->name, nameSize);
+        pos += nameSize;
+        packet[pos++] = sizeLength;
+        for (int b = sizeLength - 1; b >= 0; b--) {
+            packet[pos++] = (entry->size >> (8 * b)) & 0xFF;
+        }
+        packet[pos++] = (entry->mode >> 8) & 0xFF;
+        packet[pos++] = entry->mode & 0xFF;
+    }
+
+    if (pos > 1 && writePacket(packet, pos) < 0) {
+        printf("Exceeded number of retransmissions, aborting...\n");
+        return -1;
+    }
+
+    printf("Manifest of %d files Successfully sent!\n", stream->count);
+    return 1;
+}
+
+// Parse a manifest packet, appending its entries to the stream
+int parseManifest(FileStream *stream, const unsigned char *packet, int packetSize) {
+    int i = 1;
+    while (i < packetSize) {
+        FileEntry *entry = addFileEntry(stream);
+        int nameSize = packet[i++];
+        if (i + nameSize + 1 > packetSize) {
+            return -1;
+        }
+        memcpy(entry->name, packet + i, nameSize);
+        entry->name[nameSize] = '\0';
+        i += nameSize;
+
+        int sizeLength = packet[i++];
+        if (sizeLength > (int) sizeof(uint64_t) || i + sizeLength + 2 > packetSize) {
+            return -1;
+        }
+        for (int b = 0; b < sizeLength; b++) {
+            entry->size = (entry->size << 8) | packet[i++];
+        }
+        entry->mode = ((packet[i] << 8) | packet[i + 1]) & 0777; // Never setuid, setgid or sticky
+        i += 2;
+
+        if (!isSafeName(entry->name)) {
+            printf("ERROR: Refusing unsafe file name %s in manifest.\n", entry->name);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// Send the signatures of the receiver's copy of the file, packed into as few
+// signature packets as possible
+int sendSignatures(const BlockSignature *signatures, int count) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int pos = 1;
+    packet[0] = signaturePacket;
+
+    for (int i = 0; i < count; i++) {
+        if (pos + DELTA_SIGNATURE_SIZE > linkCapabilities.maxPayloadSize) {
+            if (writePacket(packet, pos) < 0) {
+                return -1;
+            }
+            pos = 1;
+        }
+        // Signature: | weak checksum (big endian) | strong hash |
+        for (int b = 3; b >= 0; b--) {
+            packet[pos++] = (signatures[i].weak >> (8 * b)) & 0xFF;
+        }
+        memcpy(packet + pos, signatures[i].strong, DELTA_STRONG_SIZE);
+        pos += DELTA_STRONG_SIZE;
+    }
+
+    if (pos > 1 && writePacket(packet, pos) < 0) {
+        return -1;
+    }
+    return 1;
+}
+
+// Read count signatures sent by the receiver.
+// Returns 1 on success or -1 on error.
+int readSignatures(unsigned char *buffer, BlockSignature *signatures, int count) {
+    int received = 0;
+    while (received < count) {
+        int packetSize = readPacket(buffer);
+        if (packetSize < 0 || buffer[0] != signaturePacket) {
+            printf("ERROR: Invalid Signature Packet.\n");
+            return -1;
+        }
+        for (int i = 1; i + DELTA_SIGNATURE_SIZE <= packetSize && received < count; i += DELTA_SIGNATURE_SIZE) {
+            signatures[received].weak = getNumber(buffer + i, 4);
+            memcpy(signatures[received].strong, buffer + i + 4, DELTA_STRONG_SIZE);
+            received++;
+        }
+    }
+    return 1;
+}
+
+// Ask the receiver what it already holds of the file: either the beginning of
+// an aborted transfer (skipped if it matches our file), an older version of
+// the file (only the differences to it are sent) or a chunk store (chunks it
+// holds are sent as references). On return, hash holds the hash of the
+// skipped part.
+// Returns 1 on success or -1 on error.
+int negotiateTransmitter(FileStream *stream, unsigned char *buffer, Sha256 *hash, ChunkStore *store,
+                         Negotiation *negotiation) {
+    ControlPacket offer;
+    if (readControlPacket(resumePacket, buffer, &offer) < 0) {
+        return -1;
+    }
+
+    FileEntry *entry = &stream->entries[0];
+    memset(negotiation, 0, sizeof(Negotiation));
+    sha256Init(hash);
+    if (stream->root == NULL && offer.hasOffset && offer.hasHash && offer.offset > 0 && offer.offset <= entry->size) {
+        FILE *file = fopen(entry->name, "rb");
+        uint64_t hashed = 0;
+        size_t got;
+        while (file != NULL && hashed < offer.offset &&
+               (got = fread(buffer, 1, MIN(MAX_PAYLOAD_SIZE, offer.offset - hashed), file)) > 0) {
+            sha256Update(hash, buffer, got);
+            hashed += got;
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+
+        unsigned char digest[SHA256_SIZE];
+        sha256Digest(hash, digest);
+        if (hashed == offer.offset && memcmp(digest, offer.hash, SHA256_SIZE) == 0) {
+            negotiation->offset = offer.offset;
+            printf("Receiver already holds %llu bytes, resuming from there.\n", (unsigned long long) offer.offset);
+        }
+        else {
+            printf("Receiver holds a different file, sending from the beginning.\n");
+            sha256Init(hash);
+        }
+    }
+
+    // The receiver has an older version of the file: read its signatures
+    if (stream->root == NULL && offer.blockCount > 0) {
+        negotiation->blockSize = offer.blockSize;
+        negotiation->blockCount = offer.blockCount;
+        negotiation->signatures = malloc(offer.blockCount * sizeof(BlockSignature));
+        if (negotiation->signatures == NULL ||
+            readSignatures(buffer, negotiation->signatures, offer.blockCount) < 0) {
+            return -1;
+        }
+        negotiation->delta = TRUE;
+        printf("Receiver holds an older version (%d blocks of %d bytes), sending a delta.\n",
+               offer.blockCount, offer.blockSize);
+    }
+
+    // Chunks only pay off when the whole content is sent
+    if (store != NULL && offer.hasStoreId && !negotiation->delta && negotiation->offset == 0) {
+        if (openPeerChunks(store, offer.storeId) < 0) {
+            return -1;
+        }
+        negotiation->chunking = TRUE;
+        printf("Receiver chunk store %016llx holds %u of our chunks.\n",
+               (unsigned long long) offer.storeId, store->known.count);
+    }
+
+    ControlPacket decision = {.type = resumePacket, .hasOffset = TRUE, .offset = negotiation->offset,
+                              .delta = negotiation->delta, .hasStoreId = negotiation->chunking,
+                              .storeId = offer.storeId};
+    if (sendControlPacket(&decision) < 0) {
+        return -1;
+    }
+    if (negotiation->offset > 0 && seekStream(stream, negotiation->offset) < 0) {
+        return -1;
+    }
+    return 1;
+}
+
+// Answer the transmitter's query with the checkpoint of the output file or,
+// without one, the signatures of the existing output file, plus our chunk
+// store, and follow the transmitter's decision. On return, checkpoint
+// describes the bytes kept.
+// Returns 1 on success or -1 on error.
+int negotiateReceiver(FileStream *stream, const ControlPacket *start, unsigned char *buffer, Checkpoint *checkpoint,
+                      ChunkStore *store, Negotiation *negotiation) {
+    FileEntry *entry = &stream->entries[0];
+    Checkpoint saved;
+    ControlPacket offer = {.type = resumePacket, .hasOffset = TRUE, .offset = 0,
+                           .hasStoreId = store != NULL, .storeId = store ? store->id : 0};
+    BlockSignature *signatures = NULL;
+    struct stat st;
+    memset(negotiation, 0, sizeof(Negotiation));
+
+    // A batch or the standard output only negotiates the chunk store
+    int resumable = start->resumeQuery && !isStdioName(entry->name);
+    if (resumable && loadCheckpoint(entry->name, &saved) == 1 && saved.fileSize == checkpoint->fileSize &&
+        strcmp(saved.name, checkpoint->name) == 0) {
+        offer.offset = saved.offset;
+        offer.hasHash = TRUE;
+        sha256Digest(&saved.hash, offer.hash);
+    }
+    else if (resumable && getenv(DELTA_VARIABLE) != NULL && stat(entry->name, &st) == 0 && S_ISREG(st.st_mode) &&
+             st.st_size > 0) {
+        FILE *basis = fopen(entry->name, "rb");
+        offer.blockSize = deltaBlockSize(checkpoint->fileSize);
+        offer.blockCount = basis ? computeSignatures(basis, offer.blockSize, &signatures) : -1;
+        if (basis != NULL) {
+            fclose(basis);
+        }
+        if (offer.blockCount < 0) {
+            offer.blockCount = 0;
+        }
+    }
+
+    ControlPacket decision;
+    int result = sendControlPacket(&offer);
+    if (result > 0 && offer.blockCount > 0) {
+        result = sendSignatures(signatures, offer.blockCount);
+    }
+    free(signatures);
+    if (result < 0 || readControlPacket(resumePacket, buffer, &decision) < 0) {
+        return -1;
+    }
+    negotiation->chunking = store != NULL && decision.hasStoreId && decision.storeId == store->id;
+    if (stream->root != NULL) {
+        return 1;
+    }
+
+    // Rebuild the new version next to the old one, which is read while doing it
+    if (decision.delta && offer.blockCount > 0) {
+        negotiation->delta = TRUE;
+        negotiation->blockSize = offer.blockSize;
+        negotiation->blockCount = offer.blockCount;
+        char target[sizeof(entry->name)];
+        strcpy(target, entry->name);
+        snprintf(entry->name, sizeof(entry->name), "%.*s.delta", MAX_NAME_SIZE - 6, target);
+        return openStreamEntry(stream);
+    }
+
+    if (decision.offset > 0 && decision.offset == offer.offset) {
+        *checkpoint = saved;
+        negotiation->offset = decision.offset;
+        printf("Resuming from byte %llu.\n", (unsigned long long) decision.offset);
+        return resumeStreamEntry(stream, decision.offset);
+    }
+    return openStreamEntry(stream);
+}
+
+// Flush the pending run of copied blocks into the packet
+int flushDeltaCopy(DeltaWriter *writer) {
+    if (writer->copyCount == 0) {
+        return 1;
+    }
+    if (writer->pos + 7 > linkCapabilities.maxPayloadSize) {
+        if (writePacket(writer->packet, writer->pos) < 0) {
+            return -1;
+        }
+        writer->pos = 1;
+    }
+    // Copy: | 0x01 | first block (4 bytes) | number of blocks (2 bytes) |
+    writer->packet[writer->pos++] = DELTA_COPY;
+    for (int b = 3; b >= 0; b--) {
+        writer->packet[writer->pos++] = (writer->copyBlock >> (8 * b)) & 0xFF;
+    }
+    writer->packet[writer->pos++] = writer->copyCount >> 8;
+    writer->packet[writer->pos++] = writer->copyCount & 0xFF;
+    writer->copyCount = 0;
+    return 1;
+}
+
+int deltaLiteral(void *context, const unsigned char *data, int size) {
+    DeltaWriter *writer = context;
+    if (flushDeltaCopy(writer) < 0) {
+        return -1;
+    }
+    writer->literalBytes += size;
+    metricsContent(writer->literalBytes + writer->copiedBytes);
+    updateProgressBar(FALSE);
+
+    while (size > 0) {
+        if (writer->pos + 4 > linkCapabilities.maxPayloadSize) {
+            if (writePacket(writer->packet, writer->pos) < 0) {
+                return -1;
+            }
+            writer->pos = 1;
+        }
+        // Literal: | 0x00 | size (2 bytes) | bytes |
+        int chunk = MIN(size, linkCapabilities.maxPayloadSize - writer->pos - 3);
+        writer->packet[writer->pos++] = DELTA_LITERAL;
+        writer->packet[writer->pos++] = chunk >> 8;
+        writer->packet[writer->pos++] = chunk & 0xFF;
+        memcpy(writer->packet + writer->pos, data, chunk);
+        writer->pos += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    return 1;
+}
+
+int deltaCopy(void *context, uint32_t block) {
+    DeltaWriter *writer = context;
+    writer->copiedBytes += writer->blockSize;
+    bytesAvoided += writer->blockSize;
+    metricsContent(writer->literalBytes + writer->copiedBytes);
+    updateProgressBar(FALSE);
+
+    // Consecutive blocks are sent as a single run
+    if (writer->copyCount > 0 && block == writer->copyBlock + writer->copyCount && writer->copyCount < 0xFFFF) {
+        writer->copyCount++;
+        return 1;
+    }
+    if (flushDeltaCopy(writer) < 0) {
+        return -1;
+    }
+    writer->copyBlock = block;
+    writer->copyCount = 1;
+    return 1;
+}
+
+// Send the file as a delta against the receiver's older version.
+// Returns 1 on success or -1 on error.
+int sendDelta(const FileStream *stream, const Negotiation *negotiation, Sha256 *hash) {
+    DeltaIndex index;
+    FILE *file = fopen(stream->entries[0].name, "rb");
+    if (file == NULL ||
+        buildDeltaIndex(&index, negotiation->signatures, negotiation->blockCount, negotiation->blockSize) < 0) {
+        perror("ERROR: Couldn't prepare the delta.\n");
+        return -1;
+    }
+
+    DeltaWriter writer = {.pos = 1, .blockSize = negotiation->blockSize};
+    writer.packet[0] = deltaPacket;
+    DeltaSink sink = {.literal = deltaLiteral, .copy = deltaCopy, .context = &writer};
+
+    int result = deltaEncode(file, &index, hash, &sink);
+    if (result > 0) {
+        result = flushDeltaCopy(&writer);
+    }
+    if (result > 0 && writer.pos > 1) {
+        result = writePacket(writer.packet, writer.pos);
+    }
+    fclose(file);
+    freeDeltaIndex(&index);
+
+    if (result > 0) {
+        printf("Delta sent: %llu literal bytes, %llu bytes reused from the receiver's copy.\n",
+               (unsigned long long) writer.literalBytes, (unsigned long long) writer.copiedBytes);
+    }
+    return result;
+}
+
+// Apply a delta packet: literal bytes and blocks of the old version are
+// written to the new version of the file.
+// Returns 1 on success or -1 on error.
+int applyDeltaPacket(FileStream *stream, FILE *basis, int blockSize, const unsigned char *packet, int packetSize,
+                     Sha256 *hash) {
+    unsigned char *block = NULL;
+    int i = 1;
+    while (i < packetSize) {
+        if (packet[i] == DELTA_LITERAL && i + 3 <= packetSize) {
+            int size = packet[i + 1] * 256 + packet[i + 2];
+            if (i + 3 + size > packetSize || writeStream(stream, packet + i + 3, size) < 0) {
+                break;
+            }
+            sha256Update(hash, packet + i + 3, size);
+            i += 3 + size;
+        }
+        else if (packet[i] == DELTA_COPY && i + 7 <= packetSize) {
+            uint64_t first = getNumber(packet + i + 1, 4);
+            int count = getNumber(packet + i + 5, 2);
+            if (block == NULL && (block = malloc(blockSize)) == NULL) {
+                break;
+            }
+            if (fseeko(basis, first * blockSize, SEEK_SET) < 0) {
+                break;
+            }
+            int n;
+            for (n = 0; n < count; n++) {
+                if (fread(block, 1, blockSize, basis) != (size_t) blockSize ||
+                    writeStream(stream, block, blockSize) < 0) {
+                    break;
+                }
+                sha256Update(hash, block, blockSize);
+                bytesAvoided += blockSize;
+            }
+            if (n < count) {
+                break;
+            }
+            i += 7;
+        }
+        else {
             break;
         }
-        else if (result <= 0) {
-            if (rejected) {
-                printf("\nReceived REJ, resending packet...\n");
+    }
+    free(block);
+
+    if (i < packetSize) {
+        printf("ERROR: Invalid Delta Packet.\n");
+        return -1;
+    }
+    return 1;
+}
+
+// Queue content for the data packets, sending those that fill up
+void queueChunkContent(ChunkSender *sender, const unsigned char *content, int size) {
+    for (int i = 0; i < size;) {
+        int limit = nextContentSize();
+        int part = MIN(size - i, limit > sender->dataSize ? limit - sender->dataSize : 0);
+        memcpy(sender->data + sender->dataSize, content + i, part);
+        sender->dataSize += part;
+        i += part;
+        if (sender->dataSize >= limit) {
+            sendDataPacket(sender->data, sender->dataSize);
+            sender->dataSize = 0;
+        }
+    }
+}
+
+// Flush the pending content and chunk references, in that order. The
+// receiver answers the references with how many of them it expanded; the
+// chunks it is missing are sent as content, and the peer's chunks we
+// remembered are forgotten.
+// Returns 1 on success or -1 on error.
+int flushChunkedPackets(ChunkSender *sender) {
+    if (sender->dataSize > 0) {
+        sendDataPacket(sender->data, sender->dataSize);
+        sender->dataSize = 0;
+    }
+    if (sender->refCount == 0) {
+        return 1;
+    }
+
+    unsigned char reply[MAX_PAYLOAD_SIZE + 1];
+    if (writePacket(sender->refs, 1 + sender->refCount * SHA256_SIZE) < 0 || readPacket(reply) < 3 ||
+        reply[0] != chunkAckPacket) {
+        printf("ERROR: No answer to the chunk references.\n");
+        return -1;
+    }
+    int expanded = MIN(reply[1] * 256 + reply[2], sender->refCount);
+    if (expanded < sender->refCount) {
+        printf("Receiver chunk store is missing %d referenced chunks, sending their content.\n",
+               sender->refCount - expanded);
+        if (forgetPeerChunks(sender->store) < 0) {
+            return -1;
+        }
+        int offset = 0;
+        for (int i = 0; i < sender->refCount; i++) {
+            if (i >= expanded) {
+                bytesAvoided -= sender->heldSizes[i];
+                queueChunkContent(sender, sender->held + offset, sender->heldSizes[i]);
+                if (addPeerChunk(sender->store, sender->refs + 1 + i * SHA256_SIZE) < 0) {
+                    return -1;
+                }
             }
-            else if (result == 0) {
-                printf("\nDidn't receive any response, resending packet...\n");
-                zeroResponse = TRUE;
+            offset += sender->heldSizes[i];
+        }
+        if (sender->dataSize > 0) {
+            sendDataPacket(sender->data, sender->dataSize);
+            sender->dataSize = 0;
+        }
+    }
+    sender->refCount = 0;
+    sender->heldSize = 0;
+    return 1;
+}
+
+// Send the stream split into content-defined chunks: the chunks the
+// receiver's store already holds are replaced by a reference (their hash).
+// Returns 1 on success or -1 on error.
+int sendChunkedStream(FileStream *stream, ChunkStore *store, Sha256 *hash) {
+    unsigned char *chunk = malloc(MAX_CHUNK_SIZE);
+    ChunkSender *sender = malloc(sizeof(ChunkSender));
+    unsigned char *held = malloc(CHUNK_REFS_PER_PACKET * MAX_CHUNK_SIZE);
+    if (chunk == NULL || sender == NULL || held == NULL) {
+        free(chunk);
+        free(sender);
+        free(held);
+        return -1;
+    }
+    sender->store = store;
+    sender->dataSize = 0;
+    sender->refs[0] = chunkRefPacket;
+    sender->refCount = 0;
+    sender->held = held;
+    sender->heldSize = 0;
+    int maxRefs = MIN(CHUNK_REFS_PER_PACKET, (linkCapabilities.maxPayloadSize - 1) / SHA256_SIZE);
+
+    Chunker chunker;
+    initChunker(&chunker);
+    int filled = 0, scanned = 0, eof = FALSE;
+    uint64_t bytesWritten = 0;
+    int result = 1;
+    while (result > 0) {
+        if (scanned == filled && !eof) {
+            int got = readStream(stream, chunk + filled, MAX_CHUNK_SIZE - filled);
+            if (got < 0) {
+                result = -1;
+                break;
             }
-            else {
-                printf("\nExceeded number of retransmissions, aborting...\n");
-                exit(-1);
+            sha256Update(hash, chunk + filled, got);
+            filled += got;
+            eof = (got == 0);
+        }
+
+        // Find where the current chunk ends (the last one ends with the stream)
+        int cut = -1;
+        if (scanned < filled) {
+            int boundary = findChunkBoundary(&chunker, chunk + scanned, filled - scanned);
+            cut = (boundary >= 0) ? scanned + boundary : -1;
+            scanned = (boundary >= 0) ? cut : filled;
+        }
+        if (cut < 0 && eof) {
+            cut = filled;
+        }
+        if (cut < 0) {
+            continue;
+        }
+        if (cut == 0) {
+            break;
+        }
+
+        unsigned char chunkHash[SHA256_SIZE];
+        sha256(chunk, cut, chunkHash);
+        if (peerHasChunk(store, chunkHash)) {
+            // Content queued before the reference must be sent first
+            if (sender->dataSize > 0) {
+                sendDataPacket(sender->data, sender->dataSize);
+                sender->dataSize = 0;
+            }
+            if (sender->refCount == maxRefs) {
+                result = flushChunkedPackets(sender);
+            }
+            memcpy(sender->refs + 1 + sender->refCount * SHA256_SIZE, chunkHash, SHA256_SIZE);
+            memcpy(sender->held + sender->heldSize, chunk, cut);
+            sender->heldSizes[sender->refCount++] = cut;
+            sender->heldSize += cut;
+            bytesAvoided += cut;
+        }
+        else {
+            if (sender->refCount > 0) {
+                result = flushChunkedPackets(sender);
+            }
+            queueChunkContent(sender, chunk, cut);
+            if (addPeerChunk(store, chunkHash) < 0) {
+                result = -1;
             }
+        }
+
+        bytesWritten += cut;
+        metricsContent(bytesWritten);
+        updateProgressBar(FALSE);
+        memmove(chunk, chunk + cut, filled - cut);
+        filled -= cut;
+        scanned = 0;
+    }
+
+    if (result > 0) {
+        result = flushChunkedPackets(sender);
+    }
+    free(chunk);
+    free(held);
+    free(sender);
+    return result;
+}
+
+// Expand a chunk reference packet: the chunks are read from the store, up
+// to the first one it doesn't have.
+// Returns the number of references expanded or -1 on error.
+int applyChunkRefPacket(FileStream *stream, ChunkStore *store, ChunkBuffer *received, const unsigned char *packet,
+                        int packetSize, Checkpoint *checkpoint) {
+    unsigned char *chunk = malloc(MAX_CHUNK_SIZE);
+    if (chunk == NULL) {
+        return -1;
+    }
+
+    int expanded = 0;
+    for (int i = 1; i + SHA256_SIZE <= packetSize; i += SHA256_SIZE) {
+        int size = readChunk(store, packet + i, chunk);
+        if (size < 0) {
+            printf("Chunk store is missing a referenced chunk, asking for its content.\n");
+            break;
+        }
+        // The chunk also goes through the chunker to keep it in step with the transmitter's
+        if (writeStream(stream, chunk, size) < 0 || storeStreamBytes(store, received, chunk, size) < 0) {
+            free(chunk);
             return -1;
         }
+        sha256Update(&checkpoint->hash, chunk, size);
+        checkpoint->offset += size;
+        bytesAvoided += size;
+        expanded++;
     }
 
-    free(packet);
+    free(chunk);
+    return expanded;
+}
 
-    return 0;
+// Answer a packet of the transmitter with a short packet: | type | value (2 bytes) |.
+// Returns 1 on success or -1 on error.
+int sendAnswer(unsigned char type, int value) {
+    unsigned char packet[3] = {type, (value >> 8) & 0xFF, value & 0xFF};
+    return writePacket(packet, sizeof(packet));
 }
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate, int nTries, int timeout, const char *filename) {
     // Set up Link Layer Connection Parameters
     LinkLayer connectionParameters;
-    strcpy(connectionParameters.serialPort, serialPort);
+    snprintf(connectionParameters.serialPort, sizeof(connectionParameters.serialPort), "%s", serialPort);
     connectionParameters.role = (strcmp(role, "tx") == 0) ? LlTx : LlRx;
     connectionParameters.baudRate = baudRate;
     connectionParameters.nRetransmissions = nTries;
     connectionParameters.timeout = timeout;
 
     // Open link Layer Connection
+    // The content written to the standard output must not be mixed with the log
+    if (connectionParameters.role == LlRx && isStdioName(filename)) {
+        stdoutSink = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
     int fd = llopen(connectionParameters);
     if (fd < 0) {
         perror("ERROR: Failed to open connection.\n");
@@ -166,75 +1374,150 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate, in
 
     switch (connectionParameters.role) {
         case LlTx: {
-            // Open file for reading
-            FILE *file = fopen(filename, "rb");
-            if (file == NULL) {
+            // Build the manifest: a directory is sent as a batch of all its files,
+            // the standard input or a pipe is streamed until its end
+            FileStream stream = {0};
+            int batch = FALSE;
+            struct stat st;
+            if (isStdioName(filename)) {
+                st.st_mode = S_IFIFO | 0644;
+            }
+            else if (stat(filename, &st) < 0) {
                 perror("ERROR: Couldn't open File.\n");
                 exit(-1);
             }
 
-            // Determine File Size
-            int prev = ftell(file);
-            fseek(file, 0l, SEEK_END);
-            int fileSize = ftell(file) - prev;
-            fseek(file, prev, SEEK_SET);
+            if (S_ISDIR(st.st_mode)) {
+                batch = TRUE;
+                stream.root = filename;
+                if (scanDirectory(&stream, "") < 0) {
+                    exit(-1);
+                }
+            }
+            else {
+                FileEntry *entry = addFileEntry(&stream);
+                snprintf(entry->name, sizeof(entry->name), "%s", filename);
+                entry->size = S_ISREG(st.st_mode) ? (uint64_t) st.st_size : UNKNOWN_SIZE;
+                entry->mode = st.st_mode & 0777;
+            }
+
+            uint64_t fileSize = streamSize(&stream);
+            int fileCount = batch ? stream.count : 0;
+            int streaming = (fileSize == UNKNOWN_SIZE);
+
+            if (batch) {
+                printf("Sending directory %s with %d files and %llu bytes...\n", filename, stream.count,
+                       (unsigned long long) fileSize);
+            }
+            else if (streaming) {
+                printf("Streaming %s until its end...\n", filename);
+            }
+            else {
+                printf("Sending file %s with size %llu...\n", filename, (unsigned long long) fileSize);
+            }
+
+            metricsTotal(streaming ? 0 : fileSize);
 
-            printf("Sending file %s with size %d...\n", filename, fileSize);
+            // Data packets must fit the payload the receiver accepts
+            packetContentSize = MIN(MAX_CONTENT_SIZE, linkCapabilities.maxPayloadSize - 3);
+            const char *frameSize = getenv(FRAME_SIZE_VARIABLE);
+            fixedContentSize = frameSize != NULL && atoi(frameSize) > 0;
+            if (fixedContentSize) {
+                packetContentSize = MIN(atoi(frameSize), packetContentSize);
+            }
+
+            // Chunks already held by the receiver's store don't need to be sent again
+            ChunkStore store;
+            const char *storeDirectory = getenv(CHUNK_STORE_VARIABLE);
+            int chunkStore = storeDirectory != NULL && openChunkStore(&store, storeDirectory) > 0;
 
-            // Assemble and send Starting Packet
-            while (sendControlPacket(startPacket, filename, fileSize) < 0) {
+            // Assemble and send Starting Packet (a single file can resume an aborted transfer)
+            ControlPacket control = {.type = startPacket, .fileSize = streaming ? 0 : fileSize,
+                                     .sizeUnknown = streaming, .fileCount = fileCount,
+                                     .resumeQuery = !batch && !streaming, .chunkQuery = chunkStore};
+            snprintf(control.filename, sizeof(control.filename), "%s", filename);
+            while (sendControlPacket(&control) < 0) {
                 printf("Resending Start Packet due to failed transmission.\n");
             }
 
             printf("Start packet Successfully sent!\n");
 
-            // Send Data Packets
-            unsigned char* buf = (unsigned char*) malloc(MAX_PAYLOAD_SIZE-3);
-            int contentSize;
-            int bytesWritten = 0;
-            while (TRUE) {
-                contentSize = fread(buf, 1, MAX_PAYLOAD_SIZE - 3, file);
+            unsigned char* buf = (unsigned char*) malloc(MAX_PAYLOAD_SIZE + 1);
+            Sha256 hash;
+            Negotiation negotiation = {0};
+            sha256Init(&hash);
+            if ((control.resumeQuery || chunkStore) &&
+                negotiateTransmitter(&stream, buf, &hash, chunkStore ? &store : NULL, &negotiation) < 0) {
+                perror("ERROR: Failed to negotiate the transfer with the receiver.\n");
+                exit(-1);
+            }
+            if (batch && sendManifest(&stream) < 0) {
+                exit(-1);
+            }
+            if (negotiation.delta && sendDelta(&stream, &negotiation, &hash) < 0) {
+                exit(-1);
+            }
+            free(negotiation.signatures);
 
-                if (contentSize <= 0) {
-                    break;
-                }
+            // Send Data Packets: file contents are streamed back to back, so
+            // short files share data packets with their neighbours
+            if (negotiation.chunking && sendChunkedStream(&stream, &store, &hash) < 0) {
+                exit(-1);
+            }
+            int contentSize;
+            uint64_t bytesWritten = negotiation.offset;
+            metricsContent(bytesWritten);
+            while (!negotiation.delta && !negotiation.chunking) {
+                contentSize = readStream(&stream, buf, nextContentSize());
 
-                if (contentSize > MAX_PAYLOAD_SIZE - 3) {
-                    printf("ERROR: Content block exceeds maximum size.\n");
+                if (contentSize < 0) {
                     exit(-1);
                 }
 
-                if (sendDataPacket(buf, contentSize) < 0) {
-                    if (rejected || zeroResponse) {
-                        fseek(file, -contentSize, SEEK_CUR);
-                        printf("Resending the same content block due to failed transmission.\n");
-                        rejected = FALSE;
-                        zeroResponse = FALSE;
-                    }
-                    else {
-                        printf("Exceeded number of retransmissions, aborting...\n");
-                        exit(-1);
-                    }
+                if (contentSize == 0) {
+                    break;
                 }
 
-                else {
-                    updateProgressBar(bytesWritten, fileSize);
-                    bytesWritten += contentSize;
-                }
+                sha256Update(&hash, buf, contentSize);
+                sendDataPacket(buf, contentSize);
+                bytesWritten += contentSize;
+                metricsContent(bytesWritten);
+                updateProgressBar(FALSE);
             }
-            free(buf);
+            updateProgressBar(TRUE);
             printf("\n");
-            fclose(file);
+            freeStream(&stream);
 
             printf("All Data Packets Successfully sent!\n");
 
-            // Assemble and send Ending Packet
-            while (sendControlPacket(endPacket, filename, fileSize) < 0) {
+            // Assemble and send Ending Packet, with the hash of the whole content
+            // (and the size of a stream, now that it is known)
+            control.type = endPacket;
+            control.resumeQuery = FALSE;
+            control.sizeUnknown = FALSE;
+            control.fileSize = hash.length;
+            control.hasHash = TRUE;
+            sha256Digest(&hash, control.hash);
+            while (sendControlPacket(&control) < 0) {
                 printf("Resending End Packet due to failed transmission.\n");
             }
 
             printf("End packet Successfully sent!\n");
 
+            // The receiver has stored every chunk sent in full once it confirms the content
+            if (chunkStore) {
+                if (negotiation.chunking) {
+                    if (readPacket(buf) >= 3 && buf[0] == resultPacket && buf[2] == 1) {
+                        commitPeerChunks(&store);
+                    }
+                    else {
+                        printf("Receiver didn't confirm the content, its chunks are not recorded.\n");
+                    }
+                }
+                closeChunkStore(&store);
+            }
+            free(buf);
+
             // Terminate Connection
             if (llclose(fd) < 0) {
                 perror("ERROR: Failed to close connection\n");
@@ -246,45 +1529,200 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate, in
 
         case LlRx: {
             // Read Start Packet
-            size_t packetSize;
-            char *newFilename;
-            unsigned char *buffer = (unsigned char*) malloc(MAX_PAYLOAD_SIZE);
+            ControlPacket control;
+            unsigned char *buffer = (unsigned char*) malloc(MAX_PAYLOAD_SIZE + 1); // llread also stores BCC2
 
             printf("Waiting for Start Packet...\n");
 
-            if (readControlPacket(startPacket, buffer, &packetSize, newFilename) < 0) {
+            if (readControlPacket(startPacket, buffer, &control) < 0) {
                 perror("ERROR: Failed to read Start Packet.\n");
                 exit(-1);
             }
 
             printf("Start packet Successfully received!\n");
 
-            // Create file for Writing
-            FILE *newFile = fopen(filename, "wb+");
-            if (newFile == NULL) {
-                perror("ERROR: Couldn't create File.\n");
-                exit(-1);
+            // A batch is received into a directory named after the given filename,
+            // a single file is written to the given filename
+            // The checkpoint keeps the running hash of everything received
+            FileStream stream = {0};
+            Negotiation negotiation = {0};
+            FILE *basis = NULL;
+            ChunkStore store;
+            ChunkBuffer *received = NULL;
+            const char *storeDirectory = getenv(CHUNK_STORE_VARIABLE);
+            int chunkStore = control.chunkQuery && storeDirectory != NULL && openChunkStore(&store, storeDirectory) > 0;
+            int unbounded = control.sizeUnknown;
+            metricsTotal(unbounded ? 0 : control.fileSize);
+            int seekable = !isStdioName(filename);
+            Checkpoint checkpoint = {.fileSize = control.fileSize};
+            snprintf(checkpoint.name, sizeof(checkpoint.name), "%s", control.filename);
+            sha256Init(&checkpoint.hash);
+            if (control.fileCount > 0) {
+                if (mkdir(filename, 0755) < 0 && errno != EEXIST) {
+                    perror("ERROR: Couldn't create Directory.\n");
+                    exit(-1);
+                }
+                stream.root = filename;
+                printf("Receiving batch %s with %d files into %s...\n", control.filename, control.fileCount, filename);
+                if (control.chunkQuery &&
+                    negotiateReceiver(&stream, &control, buffer, &checkpoint, chunkStore ? &store : NULL, &negotiation) < 0) {
+                    perror("ERROR: Failed to negotiate the transfer with the transmitter.\n");
+                    exit(-1);
+                }
+            }
+            else {
+                FileEntry *entry = addFileEntry(&stream);
+                snprintf(entry->name, sizeof(entry->name), "%s", filename);
+                entry->size = unbounded ? UNKNOWN_SIZE : control.fileSize;
+                int opened = (control.resumeQuery || control.chunkQuery)
+                                 ? negotiateReceiver(&stream, &control, buffer, &checkpoint, chunkStore ? &store : NULL,
+                                                     &negotiation)
+                                 : openStreamEntry(&stream);
+                if (opened < 0) {
+                    perror("ERROR: Couldn't create File.\n");
+                    exit(-1);
+                }
+                if (negotiation.delta && (basis = fopen(filename, "rb")) == NULL) {
+                    perror("ERROR: Couldn't open the previous version of the File.\n");
+                    exit(-1);
+                }
+            }
+            uint64_t lastCheckpoint = checkpoint.offset;
+            if (negotiation.chunking) {
+                received = malloc(sizeof(ChunkBuffer));
+                if (received == NULL) {
+                    exit(-1);
+                }
+                received->size = 0;
+                initChunker(&received->chunker);
             }
 
-            // Read Content sent from the Serial Port and write it in the file
-            free(buffer);
-            int contentSize;
+            // Read Content sent from the Serial Port and write it in the file(s)
+            int packetSize;
             printf("Receiving file content...\n");
-            while ((contentSize = llread(buffer) > 0)) {
+            while ((packetSize = llread(buffer)) >= 0) {
+                if (packetSize == 0) {
+                    continue; // Duplicated frame
+                }
                 if (buffer[0] == endPacket) {
+                    if (readControlPacketFields(buffer, packetSize, &control) < 0) {
+                        exit(-1);
+                    }
                     break;
                 }
-                fwrite(buffer + 3, 1, buffer[1] * 256 + buffer[2], newFile);
+                if (buffer[0] == manifestPacket) {
+                    if (parseManifest(&stream, buffer, packetSize) < 0) {
+                        printf("ERROR: Invalid Manifest Packet.\n");
+                        exit(-1);
+                    }
+                    continue;
+                }
+                if (buffer[0] == deltaPacket && basis != NULL) {
+                    if (applyDeltaPacket(&stream, basis, negotiation.blockSize, buffer, packetSize, &checkpoint.hash) < 0) {
+                        exit(-1);
+                    }
+                    metricsContent(checkpoint.hash.length);
+                    continue;
+                }
+                if (buffer[0] == chunkRefPacket && received != NULL) {
+                    int expanded = applyChunkRefPacket(&stream, &store, received, buffer, packetSize, &checkpoint);
+                    if (expanded < 0 || sendAnswer(chunkAckPacket, expanded) < 0) {
+                        exit(-1);
+                    }
+                    metricsContent(checkpoint.hash.length);
+                    continue;
+                }
+                if (buffer[0] == dataPacket) {
+                    int contentSize = buffer[1] * 256 + buffer[2];
+                    if (writeStream(&stream, buffer + 3, contentSize) < 0) {
+                        exit(-1);
+                    }
+                    if (received != NULL && storeStreamBytes(&store, received, buffer + 3, contentSize) < 0) {
+                        exit(-1);
+                    }
+                    sha256Update(&checkpoint.hash, buffer + 3, contentSize);
+                    checkpoint.offset += contentSize;
+                    metricsContent(checkpoint.hash.length);
+
+                    // Persist the progress of a single file every now and then
+                    if (stream.root == NULL && basis == NULL && seekable && stream.file != NULL &&
+                        checkpoint.offset - lastCheckpoint >= CHECKPOINT_INTERVAL) {
+                        saveCheckpoint(filename, stream.file, &checkpoint);
+                        lastCheckpoint = checkpoint.offset;
+                    }
+                }
+            }
+
+            // The end of the stream also ends the last chunk
+            if (received != NULL) {
+                flushChunkBuffer(&store, received);
+                free(received);
+            }
+            if (chunkStore) {
+                closeChunkStore(&store);
+            }
+
+            // A stream of unknown size ends here if the END packet confirms its size
+            if (unbounded && control.fileSize == checkpoint.offset && stream.current < stream.count &&
+                (stream.file != NULL || openStreamEntry(&stream) > 0)) {
+                closeStreamEntry(&stream);
+            }
+
+            // Files still missing their content (e.g. empty files at the end of a batch)
+            unsigned char digest[SHA256_SIZE];
+            sha256Digest(&checkpoint.hash, digest);
+            int complete = FALSE;
+            if (writeStream(&stream, buffer, 0) < 0 || stream.current < stream.count) {
+                printf("ERROR: Transfer ended before all announced content was received.\n");
+            }
+            else if (control.hasHash && memcmp(digest, control.hash, SHA256_SIZE) != 0) {
+                printf("ERROR: Content hash mismatch, the received data is corrupted.\n");
+            }
+            else {
+                complete = TRUE;
+                if (control.fileCount > 0) {
+                    printf("Received %d files.\n", stream.count);
+                }
+            }
+            // The transmitter only records the chunks we hold once we confirm the content
+            if (negotiation.chunking && sendAnswer(resultPacket, complete) < 0) {
+                printf("ERROR: Couldn't confirm the content to the transmitter.\n");
+            }
+
+            // An incomplete transfer keeps its checkpoint to be resumed
+            if (complete && stream.root == NULL && seekable) {
+                removeCheckpoint(filename);
+            }
+            else if (!complete && stream.root == NULL && seekable && basis == NULL) {
+                printf("The partial file %s and its checkpoint were kept: run the transfer again to resume it.\n",
+                       filename);
+            }
+            else if (!complete && stream.root != NULL) {
+                printf("The files received so far were kept in %s.\n", filename);
+            }
+
+            // The rebuilt file replaces the previous version only if it is correct
+            if (basis != NULL) {
+                fclose(basis);
+                if (complete && rename(stream.entries[0].name, filename) < 0) {
+                    perror("ERROR: Couldn't replace the previous version of the File.\n");
+                }
+                else if (!complete) {
+                    unlink(stream.entries[0].name);
+                }
             }
 
             free(buffer);
-            fclose(newFile);
+            freeStream(&stream);
 
             // Terminate Connection
             if (llclose(fd) < 0) {
                 perror("ERROR: Failed to close connection\n");
                 exit(-1);
             }
+            if (!complete) {
+                exit(-1);
+            }
             printf("SUCCESS!\n");
             break;
         }
@@ -292,4 +1730,4 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate, in
         default:
             exit(-1);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,85 @@
+// Receiver-side checkpoints implementation
+
+#include "checkpoint.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Identifies checkpoint files (and their layout version)
+#define CHECKPOINT_MAGIC "LLCKPT01"
+
+// Path of the checkpoint kept next to the output file
+void checkpointPath(const char *filename, char *path, size_t pathSize) {
+    snprintf(path, pathSize, "%s.ckpt", filename);
+}
+
+int loadCheckpoint(const char *filename, Checkpoint *checkpoint) {
+    char path[4096];
+    checkpointPath(filename, path, sizeof(path));
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+
+    char magic[sizeof(CHECKPOINT_MAGIC) - 1];
+    int valid = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) == 0 &&
+                fread(checkpoint, sizeof(Checkpoint), 1, file) == 1;
+    fclose(file);
+
+    if (!valid) {
+        printf("Ignoring corrupted checkpoint %s.\n", path);
+        return -1;
+    }
+
+    // The committed bytes must still be in the output file
+    struct stat st;
+    if (stat(filename, &st) < 0 || (uint64_t) st.st_size < checkpoint->offset ||
+        checkpoint->hash.length != checkpoint->offset) {
+        printf("Ignoring stale checkpoint %s.\n", path);
+        return -1;
+    }
+
+    checkpoint->name[sizeof(checkpoint->name) - 1] = '\0';
+    return 1;
+}
+
+int saveCheckpoint(const char *filename, FILE *output, const Checkpoint *checkpoint) {
+    // The data must reach the disk before the checkpoint claims it
+    if (fflush(output) != 0 || fsync(fileno(output)) < 0) {
+        perror("ERROR: Couldn't commit the received data.\n");
+        return -1;
+    }
+
+    char path[4096], temporary[4100];
+    checkpointPath(filename, path, sizeof(path));
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL) {
+        perror(temporary);
+        return -1;
+    }
+
+    int written = fwrite(CHECKPOINT_MAGIC, 1, sizeof(CHECKPOINT_MAGIC) - 1, file) == sizeof(CHECKPOINT_MAGIC) - 1 &&
+                  fwrite(checkpoint, sizeof(Checkpoint), 1, file) == 1 &&
+                  fflush(file) == 0 && fsync(fileno(file)) == 0;
+    fclose(file);
+
+    if (!written || rename(temporary, path) < 0) {
+        perror("ERROR: Couldn't write checkpoint.\n");
+        unlink(temporary);
+        return -1;
+    }
+
+    return 1;
+}
+
+void removeCheckpoint(const char *filename) {
+    char path[4096];
+    checkpointPath(filename, path, sizeof(path));
+    unlink(path);
+}
@@ -0,0 +1,356 @@
+// Content-defined chunking and persistent chunk store implementation
+
+#include "chunk_store.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Boundary when the top 13 bits of the rolling hash are zero (1 in 8192 bytes)
+#define BOUNDARY_MASK 0xFFF8000000000000ULL
+
+// Size of the header of a chunk in the pack: hash and size (big endian)
+#define RECORD_HEADER_SIZE (SHA256_SIZE + 4)
+
+// Random values of the gear hash, identical on both sides of the link
+uint64_t gear[256];
+int gearReady = 0;
+
+// splitmix64 generator, used to fill the gear table from a fixed seed
+uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void initChunker(Chunker *chunker) {
+    if (!gearReady) {
+        uint64_t seed = 0x6C696E6B6C617972ULL;
+        for (int i = 0; i < 256; i++) {
+            gear[i] = splitmix64(&seed);
+        }
+        gearReady = 1;
+    }
+    chunker->hash = 0;
+    chunker->size = 0;
+}
+
+int findChunkBoundary(Chunker *chunker, const unsigned char *data, int size) {
+    for (int i = 0; i < size; i++) {
+        chunker->hash = (chunker->hash << 1) + gear[data[i]];
+        chunker->size++;
+        if ((chunker->size >= MIN_CHUNK_SIZE && (chunker->hash & BOUNDARY_MASK) == 0) ||
+            chunker->size >= MAX_CHUNK_SIZE) {
+            initChunker(chunker);
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+// Slot of a hash in the index (or the empty slot where it would go)
+uint32_t indexSlot(const ChunkIndex *index, const unsigned char hash[SHA256_SIZE]) {
+    uint32_t slot;
+    memcpy(&slot, hash, sizeof(slot));
+    slot &= index->capacity - 1;
+    while (index->sizes[slot] != 0 && memcmp(index->hashes[slot], hash, SHA256_SIZE) != 0) {
+        slot = (slot + 1) & (index->capacity - 1);
+    }
+    return slot;
+}
+
+// Insert a chunk in the index, growing it when it becomes too full.
+// Returns 1 on success or -1 on error.
+int indexInsert(ChunkIndex *index, const unsigned char hash[SHA256_SIZE], uint64_t offset, uint32_t size) {
+    if ((index->count + 1) * 2 > index->capacity) {
+        ChunkIndex grown = {.capacity = index->capacity ? index->capacity * 2 : 1024};
+        grown.hashes = malloc(grown.capacity * SHA256_SIZE);
+        grown.offsets = malloc(grown.capacity * sizeof(uint64_t));
+        grown.sizes = calloc(grown.capacity, sizeof(uint32_t));
+        if (grown.hashes == NULL || grown.offsets == NULL || grown.sizes == NULL) {
+            free(grown.hashes);
+            free(grown.offsets);
+            free(grown.sizes);
+            return -1;
+        }
+        for (uint32_t i = 0; i < index->capacity; i++) {
+            if (index->sizes[i] != 0) {
+                indexInsert(&grown, index->hashes[i], index->offsets[i], index->sizes[i]);
+            }
+        }
+        free(index->hashes);
+        free(index->offsets);
+        free(index->sizes);
+        *index = grown;
+    }
+
+    uint32_t slot = indexSlot(index, hash);
+    if (index->sizes[slot] == 0) {
+        memcpy(index->hashes[slot], hash, SHA256_SIZE);
+        index->offsets[slot] = offset;
+        index->sizes[slot] = size;
+        index->count++;
+    }
+    return 1;
+}
+
+// Check whether the index holds a chunk
+int indexContains(const ChunkIndex *index, const unsigned char hash[SHA256_SIZE]) {
+    return index->capacity > 0 && index->sizes[indexSlot(index, hash)] != 0;
+}
+
+void freeIndex(ChunkIndex *index) {
+    free(index->hashes);
+    free(index->offsets);
+    free(index->sizes);
+    memset(index, 0, sizeof(ChunkIndex));
+}
+
+// Read the identifier of the store, creating a new random one for a new store
+int loadStoreId(ChunkStore *store) {
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/id", store->directory);
+
+    FILE *file = fopen(path, "r");
+    if (file != NULL) {
+        unsigned long long id;
+        int valid = fscanf(file, "%llx", &id) == 1;
+        fclose(file);
+        if (valid) {
+            store->id = id;
+            return 1;
+        }
+    }
+
+    // A new store must not be mistaken for an older one a peer remembers
+    FILE *random = fopen("/dev/urandom", "rb");
+    if (random == NULL || fread(&store->id, sizeof(store->id), 1, random) != 1) {
+        store->id = ((uint64_t) time(NULL) << 32) ^ (uint64_t) getpid();
+    }
+    if (random != NULL) {
+        fclose(random);
+    }
+
+    file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(file, "%016llx\n", (unsigned long long) store->id);
+    fclose(file);
+    return 1;
+}
+
+int openChunkStore(ChunkStore *store, const char *directory) {
+    memset(store, 0, sizeof(ChunkStore));
+    snprintf(store->directory, sizeof(store->directory), "%s", directory);
+    if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+        perror(directory);
+        return -1;
+    }
+    if (loadStoreId(store) < 0) {
+        return -1;
+    }
+
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/chunks.pack", directory);
+    store->pack = fopen(path, "ab+");
+    if (store->pack == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    // Index the chunks of the pack, dropping a record cut short by a crash
+    unsigned char header[RECORD_HEADER_SIZE];
+    off_t offset = 0;
+    struct stat st;
+    if (fstat(fileno(store->pack), &st) < 0) {
+        perror(path);
+        return -1;
+    }
+    fseeko(store->pack, 0, SEEK_SET);
+    while (fread(header, 1, RECORD_HEADER_SIZE, store->pack) == RECORD_HEADER_SIZE) {
+        uint32_t size = (uint32_t) header[SHA256_SIZE] << 24 | header[SHA256_SIZE + 1] << 16 |
+                        header[SHA256_SIZE + 2] << 8 | header[SHA256_SIZE + 3];
+        if (size == 0 || size > MAX_CHUNK_SIZE || st.st_size < offset + RECORD_HEADER_SIZE + size ||
+            fseeko(store->pack, size, SEEK_CUR) < 0) {
+            break;
+        }
+        if (indexInsert(&store->index, header, offset + RECORD_HEADER_SIZE, size) < 0) {
+            return -1;
+        }
+        offset += RECORD_HEADER_SIZE + size;
+    }
+    if (ftruncate(fileno(store->pack), offset) < 0) {
+        perror(path);
+        return -1;
+    }
+
+    printf("Chunk store %s: %u chunks.\n", directory, store->index.count);
+    return 1;
+}
+
+void closeChunkStore(ChunkStore *store) {
+    if (store->pack != NULL) {
+        fclose(store->pack);
+        store->pack = NULL;
+    }
+    freeIndex(&store->index);
+    freeIndex(&store->known);
+    free(store->pending);
+    store->pending = NULL;
+    store->pendingCount = store->pendingCapacity = 0;
+}
+
+int readChunk(ChunkStore *store, const unsigned char hash[SHA256_SIZE], unsigned char *data) {
+    if (!indexContains(&store->index, hash)) {
+        return -1;
+    }
+    uint32_t slot = indexSlot(&store->index, hash);
+    uint32_t size = store->index.sizes[slot];
+    if (fseeko(store->pack, store->index.offsets[slot], SEEK_SET) < 0 ||
+        fread(data, 1, size, store->pack) != size) {
+        return -1;
+    }
+    return size;
+}
+
+int addChunk(ChunkStore *store, const unsigned char *data, int size, const unsigned char hash[SHA256_SIZE]) {
+    if (indexContains(&store->index, hash)) {
+        return 1;
+    }
+
+    if (fseeko(store->pack, 0, SEEK_END) < 0) {
+        return -1;
+    }
+    off_t offset = ftello(store->pack);
+    unsigned char header[RECORD_HEADER_SIZE];
+    memcpy(header, hash, SHA256_SIZE);
+    header[SHA256_SIZE] = size >> 24;
+    header[SHA256_SIZE + 1] = size >> 16;
+    header[SHA256_SIZE + 2] = size >> 8;
+    header[SHA256_SIZE + 3] = size;
+
+    if (fwrite(header, 1, RECORD_HEADER_SIZE, store->pack) != RECORD_HEADER_SIZE ||
+        fwrite(data, 1, size, store->pack) != (size_t) size || fflush(store->pack) != 0) {
+        perror("ERROR: Couldn't write to the chunk store.\n");
+        return -1;
+    }
+    return indexInsert(&store->index, hash, offset + RECORD_HEADER_SIZE, size);
+}
+
+// Path of the list of chunks held by the peer store
+void peerChunksPath(const ChunkStore *store, char *path, size_t pathSize) {
+    snprintf(path, pathSize, "%s/peer-%016llx.known", store->directory, (unsigned long long) store->peer);
+}
+
+int openPeerChunks(ChunkStore *store, uint64_t peer) {
+    char path[4200];
+    freeIndex(&store->known);
+    store->peer = peer;
+    store->pendingCount = 0;
+    peerChunksPath(store, path, sizeof(path));
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 1;
+    }
+    unsigned char hash[SHA256_SIZE];
+    while (fread(hash, 1, SHA256_SIZE, file) == SHA256_SIZE) {
+        if (indexInsert(&store->known, hash, 0, 1) < 0) {
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    return 1;
+}
+
+int peerHasChunk(const ChunkStore *store, const unsigned char hash[SHA256_SIZE]) {
+    return indexContains(&store->known, hash);
+}
+
+int addPeerChunk(ChunkStore *store, const unsigned char hash[SHA256_SIZE]) {
+    if (peerHasChunk(store, hash)) {
+        return 1;
+    }
+    if (store->pendingCount == store->pendingCapacity) {
+        uint32_t capacity = store->pendingCapacity ? store->pendingCapacity * 2 : 256;
+        void *grown = realloc(store->pending, capacity * SHA256_SIZE);
+        if (grown == NULL) {
+            return -1;
+        }
+        store->pending = grown;
+        store->pendingCapacity = capacity;
+    }
+    memcpy(store->pending[store->pendingCount++], hash, SHA256_SIZE);
+    return indexInsert(&store->known, hash, 0, 1);
+}
+
+int forgetPeerChunks(ChunkStore *store) {
+    char path[4200];
+    peerChunksPath(store, path, sizeof(path));
+    if (unlink(path) < 0 && errno != ENOENT) {
+        perror(path);
+        return -1;
+    }
+    freeIndex(&store->known);
+    for (uint32_t i = 0; i < store->pendingCount; i++) {
+        if (indexInsert(&store->known, store->pending[i], 0, 1) < 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int commitPeerChunks(ChunkStore *store) {
+    if (store->pendingCount == 0) {
+        return 1;
+    }
+
+    char path[4200];
+    peerChunksPath(store, path, sizeof(path));
+    FILE *file = fopen(path, "ab");
+    if (file == NULL ||
+        fwrite(store->pending, SHA256_SIZE, store->pendingCount, file) != store->pendingCount) {
+        perror(path);
+        if (file != NULL) {
+            fclose(file);
+        }
+        return -1;
+    }
+    fclose(file);
+    store->pendingCount = 0;
+    return 1;
+}
+
+int storeStreamBytes(ChunkStore *store, ChunkBuffer *buffer, const unsigned char *data, int size) {
+    while (size > 0) {
+        int boundary = findChunkBoundary(&buffer->chunker, data, size);
+        int used = boundary < 0 ? size : boundary;
+        memcpy(buffer->data + buffer->size, data, used);
+        buffer->size += used;
+        data += used;
+        size -= used;
+
+        if (boundary >= 0 && flushChunkBuffer(store, buffer) < 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int flushChunkBuffer(ChunkStore *store, ChunkBuffer *buffer) {
+    if (buffer->size == 0) {
+        return 1;
+    }
+    unsigned char hash[SHA256_SIZE];
+    sha256(buffer->data, buffer->size, hash);
+    int result = addChunk(store, buffer->data, buffer->size, hash);
+    buffer->size = 0;
+    return result;
+}
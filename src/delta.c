@@ -0,0 +1,225 @@
+// Delta transfer implementation: the receiver signs the blocks of the file it
+// already has, the transmitter looks for those blocks at every offset of the
+// new file using a rolling checksum and only sends what isn't found.
+
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Bounds of the block size
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+
+#define FALSE 0
+#define TRUE 1
+
+// Longest literal run handed to the sink at once
+#define MAX_LITERAL_RUN 4096
+
+int deltaBlockSize(uint64_t fileSize) {
+    // Square root of the file size (rounded to 64 bytes) balances the size of
+    // the signatures against the bytes resent around every change
+    uint64_t size = MIN_BLOCK_SIZE;
+    while (size < MAX_BLOCK_SIZE && size * size < fileSize) {
+        size += 64;
+    }
+    return size;
+}
+
+uint32_t weakChecksum(const unsigned char *data, int size) {
+    uint32_t a = 0, b = 0;
+    for (int i = 0; i < size; i++) {
+        a += data[i];
+        b += (uint32_t) (size - i) * data[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+// Slide the window of the checksum one byte forward
+uint32_t rollChecksum(uint32_t sum, unsigned char out, unsigned char in, int size) {
+    uint32_t a = sum & 0xFFFF, b = sum >> 16;
+    a = (a - out + in) & 0xFFFF;
+    b = (b - (uint32_t) size * out + a) & 0xFFFF;
+    return a | (b << 16);
+}
+
+// Truncated SHA-256 of a block
+void strongHash(const unsigned char *data, int size, unsigned char strong[DELTA_STRONG_SIZE]) {
+    unsigned char digest[SHA256_SIZE];
+    sha256(data, size, digest);
+    memcpy(strong, digest, DELTA_STRONG_SIZE);
+}
+
+int computeSignatures(FILE *file, int blockSize, BlockSignature **signatures) {
+    unsigned char *block = malloc(blockSize);
+    int count = 0, capacity = 0;
+    *signatures = NULL;
+    if (block == NULL) {
+        return -1;
+    }
+
+    while (fread(block, 1, blockSize, file) == (size_t) blockSize) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            BlockSignature *grown = realloc(*signatures, capacity * sizeof(BlockSignature));
+            if (grown == NULL) {
+                free(block);
+                free(*signatures);
+                return -1;
+            }
+            *signatures = grown;
+        }
+        (*signatures)[count].weak = weakChecksum(block, blockSize);
+        strongHash(block, blockSize, (*signatures)[count].strong);
+        count++;
+    }
+
+    free(block);
+    if (ferror(file)) {
+        free(*signatures);
+        *signatures = NULL;
+        return -1;
+    }
+    return count;
+}
+
+int buildDeltaIndex(DeltaIndex *index, const BlockSignature *signatures, int count, int blockSize) {
+    uint32_t buckets = 16;
+    while (buckets < (uint32_t) count * 2) {
+        buckets *= 2;
+    }
+
+    index->signatures = signatures;
+    index->count = count;
+    index->blockSize = blockSize;
+    index->mask = buckets - 1;
+    index->heads = malloc(buckets * sizeof(int));
+    index->next = malloc((count + 1) * sizeof(int));
+    if (index->heads == NULL || index->next == NULL) {
+        freeDeltaIndex(index);
+        return -1;
+    }
+
+    memset(index->heads, -1, buckets * sizeof(int));
+    // Insert backwards so each bucket lists its blocks in file order
+    for (int i = count - 1; i >= 0; i--) {
+        uint32_t bucket = (signatures[i].weak ^ (signatures[i].weak >> 16)) & index->mask;
+        index->next[i] = index->heads[bucket];
+        index->heads[bucket] = i;
+    }
+    return 1;
+}
+
+void freeDeltaIndex(DeltaIndex *index) {
+    free(index->heads);
+    free(index->next);
+    index->heads = NULL;
+    index->next = NULL;
+}
+
+// Find a block of the receiver's file equal to data.
+// Returns the block number or -1 if there is none.
+int findBlock(const DeltaIndex *index, uint32_t weak, const unsigned char *data) {
+    int hashed = FALSE;
+    unsigned char strong[DELTA_STRONG_SIZE];
+    for (int i = index->heads[(weak ^ (weak >> 16)) & index->mask]; i >= 0; i = index->next[i]) {
+        if (index->signatures[i].weak != weak) {
+            continue;
+        }
+        // The strong hash is only computed when the weak checksum matches
+        if (!hashed) {
+            strongHash(data, index->blockSize, strong);
+            hashed = TRUE;
+        }
+        if (memcmp(strong, index->signatures[i].strong, DELTA_STRONG_SIZE) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int deltaEncode(FILE *source, const DeltaIndex *index, Sha256 *hash, DeltaSink *sink) {
+    int blockSize = index->blockSize;
+    size_t capacity = 4 * (size_t) blockSize + MAX_LITERAL_RUN;
+    unsigned char *buf = malloc(capacity);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    size_t start = 0;       // First byte of the pending literal run
+    size_t pos = 0;         // Start of the window being matched
+    size_t end = 0;         // Number of valid bytes in buf
+    int eof = FALSE;
+    int valid = FALSE;      // TRUE if weak holds the checksum of the window
+    uint32_t weak = 0;
+
+    while (TRUE) {
+        // Keep at least one whole window in the buffer
+        if (end - pos < (size_t) blockSize && !eof) {
+            if (pos > start && sink->literal(sink->context, buf + start, pos - start) < 0) {
+                free(buf);
+                return -1;
+            }
+            memmove(buf, buf + pos, end - pos);
+            end -= pos;
+            start = pos = 0;
+
+            size_t got = fread(buf + end, 1, capacity - end, source);
+            if (got == 0) {
+                if (ferror(source)) {
+                    free(buf);
+                    return -1;
+                }
+                eof = TRUE;
+            }
+            sha256Update(hash, buf + end, got);
+            end += got;
+            continue;
+        }
+
+        if (end - pos < (size_t) blockSize) {
+            break;
+        }
+
+        if (!valid) {
+            weak = weakChecksum(buf + pos, blockSize);
+            valid = TRUE;
+        }
+
+        int block = index->count > 0 ? findBlock(index, weak, buf + pos) : -1;
+        if (block >= 0) {
+            if ((pos > start && sink->literal(sink->context, buf + start, pos - start) < 0) ||
+                sink->copy(sink->context, block) < 0) {
+                free(buf);
+                return -1;
+            }
+            pos += blockSize;
+            start = pos;
+            valid = FALSE;
+            continue;
+        }
+
+        // No match: the first byte of the window becomes a literal
+        if (pos + blockSize < end) {
+            weak = rollChecksum(weak, buf[pos], buf[pos + blockSize], blockSize);
+        }
+        else {
+            valid = FALSE;
+        }
+        pos++;
+
+        if (pos - start >= MAX_LITERAL_RUN) {
+            if (sink->literal(sink->context, buf + start, pos - start) < 0) {
+                free(buf);
+                return -1;
+            }
+            start = pos;
+        }
+    }
+
+    // Tail shorter than a block
+    int result = (end > start) ? sink->literal(sink->context, buf + start, end - start) : 1;
+    free(buf);
+    return result < 0 ? -1 : 1;
+}
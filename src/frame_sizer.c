@@ -0,0 +1,83 @@
+// Frame-size controller implementation
+
+#include "frame_sizer.h"
+
+// base^exponent by squaring (no libm, like the simulated link)
+static double power(double base, int exponent) {
+    double result = 1;
+    while (exponent > 0) {
+        if (exponent & 1) {
+            result *= base;
+        }
+        base *= base;
+        exponent >>= 1;
+    }
+    return result;
+}
+
+// Byte error rate e at which frames of n bytes fail with probability fer,
+// i.e. 1 - (1 - e)^n = fer, by bisection
+static double byteErrorRate(double fer, int n) {
+    if (fer <= 0 || n <= 0) {
+        return 0;
+    }
+    double low = 0, high = 1;
+    for (int i = 0; i < 50; i++) {
+        double e = (low + high) / 2;
+        if (1 - power(1 - e, n) < fer) {
+            low = e;
+        }
+        else {
+            high = e;
+        }
+    }
+    return low;
+}
+
+void frameSizerInit(FrameSizer *sizer, int minSize, int maxSize, int startSize, double byteNs, double timeoutNs) {
+    sizer->minSize = minSize < maxSize ? minSize : maxSize;
+    sizer->maxSize = maxSize;
+    sizer->size = startSize < sizer->minSize ? sizer->minSize : startSize > maxSize ? maxSize : startSize;
+    sizer->attempts = SIZER_PRIOR;
+    sizer->sent = 0;
+    sizer->errors = 0;
+    sizer->timeouts = 0;
+    sizer->bytes = SIZER_PRIOR * (double) (sizer->size + SIZER_OVERHEAD);
+    sizer->byteNs = byteNs;
+    sizer->turnaroundNs = 0;
+    sizer->timeoutNs = timeoutNs;
+}
+
+void frameSizerRecord(FrameSizer *sizer, int payloadSize, int outcome, uint64_t cycleNs) {
+    sizer->attempts = sizer->attempts * SIZER_DECAY + 1;
+    sizer->sent = sizer->sent * SIZER_DECAY + 1;
+    sizer->errors = sizer->errors * SIZER_DECAY + (outcome != SIZER_ACKED ? 1 : 0);
+    sizer->timeouts = sizer->timeouts * SIZER_DECAY + (outcome == SIZER_TIMED_OUT ? 1 : 0);
+    sizer->bytes = sizer->bytes * SIZER_DECAY + payloadSize + SIZER_OVERHEAD;
+    if (outcome == SIZER_ACKED) {
+        double turnaround = cycleNs - (payloadSize + SIZER_OVERHEAD) * sizer->byteNs;
+        if (turnaround < 0) {
+            turnaround = 0;
+        }
+        sizer->turnaroundNs += (turnaround - sizer->turnaroundNs) / 8;
+    }
+
+    // Goodput of the candidate sizes under the estimated byte error rate
+    double e = byteErrorRate(sizer->errors / sizer->attempts, (int) (sizer->bytes / sizer->attempts + 0.5));
+    double lossNs = sizer->timeouts / sizer->attempts * sizer->timeoutNs;
+    int largest = sizer->size * SIZER_GROWTH < sizer->maxSize ? (int) (sizer->size * SIZER_GROWTH) : sizer->maxSize;
+    double bestGoodput = -1;
+    for (int step = 0; step <= SIZER_STEPS; step++) {
+        int size = sizer->minSize + (largest - sizer->minSize) * step / SIZER_STEPS;
+        double cycle = (size + SIZER_OVERHEAD) * sizer->byteNs + sizer->turnaroundNs + lossNs + 1;
+        double goodput = size * power(1 - e, size + SIZER_OVERHEAD) / cycle;
+        if (goodput > bestGoodput) {
+            bestGoodput = goodput;
+            sizer->size = size;
+        }
+    }
+}
+
+double frameSizerErrorRate(const FrameSizer *sizer) {
+    return sizer->sent > 0 ? sizer->errors / sizer->sent : 0;
+}
@@ -1,11 +1,19 @@
 // Link layer protocol implementation
 
 #include "link_layer.h"
+#include "frame.h"
+#include "frame_sizer.h"
+#include "link_stats.h"
+#include "metrics.h"
+#include "serial_port.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <termios.h>
+#include <unistd.h>
 
 // State machine states
 typedef enum {
@@ -22,31 +30,51 @@ typedef enum {
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
-// Frame delimiters: Page 10 of the protocol
-#define FLAG 0x7E
-
-// Address field: Pages 10 and 11 of the protocol
-#define A_TX 0x03
-#define A_RX 0x01
-
-// Control field for Supervision and Unnumbered frames: Page 10 of the protocol
-#define C_SET 0x03      // Set up connection: Tx
-#define C_UA 0x07       // Unnumbered acknowledgment: Rx
-#define C_RR0 0xAA      // Receiver ready 0: Rx
-#define C_RR1 0xAB      // Receiver ready 1: Rx
-#define C_REJ0 0x54     // Reject 0: Rx
-#define C_REJ1 0x55     // Reject 1: Rx
-#define C_DISC 0x0B     // Disconnect: Tx | Rx
-
-// Control field for Information frames: Page 11 of the protocol
-#define C_N0 0x00       // Information frame control field (frame 0)
-#define C_N1 0x80       // Information frame control field (frame 1)
+// Information frames carry the address of their sender and are acknowledged
+// with the same address, so either side can send data (e.g. replies of the
+// receiver to the transmitter's control packets)
+#define A_OWN ((role == LlTx) ? A_TX : A_RX)
+#define A_PEER ((role == LlTx) ? A_RX : A_TX)
+
 #define TX 0            // Transmitter
 #define RX 1            // Receiver
 
-// Byte stuffing: Page 17 of the protocol
-#define ESCAPE 0x7D     // Escape character
-#define STUFF 0x20      // XOR value for byte stuffing
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Largest payload of the peers without capabilities
+#define BASE_PAYLOAD_SIZE 1000
+
+// Parameter frames (capabilities and baud rate changes):
+// | FLAG | A | C | BCC1 | TLV ... | BCC2 | FLAG |
+// with TLVs | T | L | V (L bytes, big endian) |. Unknown types are skipped, and
+// peers that predate them drop the whole frame, like any unknown control field.
+#define CAP_MAX_PAYLOAD 0
+#define CAP_WINDOW 1
+#define CAP_MODULUS 2
+#define CAP_FCS 3
+#define CAP_FEATURES 4
+#define CAP_MAX_BAUD 5
+#define CAP_MIN_PAYLOAD 6
+#define BAUD_RATE 0     // C_BAUD and C_BAUD_DONE
+#define BAUD_PROBES 1   // C_REPORT
+#define PARAMETER_SIZE 160
+#define PARAMETER_FRAME_SIZE (2 * PARAMETER_SIZE + 6)
+#define NO_DEADLINE UINT64_MAX
+
+// Baud rate switch: the transmitter probes the new rate with PROBE_FRAMES
+// frames of | index | PROBE_SIZE pattern bytes |, and the receiver goes back to
+// the old rate unless they all arrive and the transmitter confirms it within
+// PROBE_WAIT.
+#define PROBE_FRAMES 4
+#define PROBE_SIZE 128
+#define PROBE_WAIT 1000000000ULL
+
+// Baud rate fallback: the transmitter steps the rate down (not below the one
+// llopen started at) when the frame error rate of BAUD_FALLBACK_FRAMES frames
+// sent at it exceeds BAUD_FALLBACK_ERRORS
+#define BAUD_FALLBACK_FRAMES 16
+#define BAUD_FALLBACK_ERRORS 0.25
 
 // Global variables
 int alarmTriggered = FALSE;
@@ -57,14 +85,34 @@ int rejected = FALSE;
 unsigned char tramaTx = 0;
 unsigned char tramaRx = 0;
 
-int framesSent, framesReceived = 0;
-time_t startTime, startTimeConnection, endTime;
+int framesSent = 0, framesReceived = 0;
+
+// Information frame of the peer received (and acknowledged) by llwrite, kept
+// for the next llread
+unsigned char pendingPacket[MAX_PAYLOAD_SIZE + 1];
+int pendingSize = 0;
+unsigned long long bytesAvoided = 0;
+LinkStats stats;
+SerialPhase currentPhase = SERIAL_PHASE_OPEN;
+int phaseStartFrames = 0;
+
+// Today's protocol, which is also what a peer without capabilities runs
+const LinkCapabilities baseCapabilities = {BASE_PAYLOAD_SIZE, 1, 1, 2, LL_FCS_XOR, 0, 0};
+LinkCapabilities ownCapabilities;
+LinkCapabilities linkCapabilities;
+LinkCapabilities peerCapabilities;
+int peerAdvertised = FALSE;
+int lineBaudRate = 0;               // Baud rate of the line (0 if the transport has none)
+int openBaudRate = 0;               // Baud rate llopen started at
+FrameSizer frameSizer;
+int linkPayloadSize = BASE_PAYLOAD_SIZE;
 
 
 // Alarm function handler
 void alarmHandler(int signal){
     alarmTriggered = TRUE;
     alarmCount++;
+    TRACE_INSTANT(TRACE_ALARM, alarmCount);
     printf("Alarm #%d\n", alarmCount);
 }
 
@@ -72,6 +120,561 @@ int retransmissions;
 int timeout;
 LinkLayerRole role;
 
+// Write bytes to the serial port, counting them for the statistics
+int writeFrame(const unsigned char *frame, int size) {
+    int written = writeBytesSerialPort(frame, size);
+    if (written > 0) {
+        stats.bytesWritten += written;
+    }
+    return written;
+}
+
+// Read a byte from the serial port, counting it for the statistics
+int readByte(unsigned char *byte) {
+    int result = readByteSerialPort(byte);
+    if (result > 0) {
+        stats.bytesRead++;
+    }
+    return result;
+}
+
+// Credit the frames sent and received since the last call to the current phase
+void countPhaseFrames() {
+    int frames = framesSent + framesReceived;
+    stats.phaseFrames[currentPhase] += frames - phaseStartFrames;
+    phaseStartFrames = frames;
+}
+
+// Account the following serial port I/O (and frames) to another protocol phase
+void enterPhase(SerialPhase next) {
+    countPhaseFrames();
+    currentPhase = next;
+    setSerialPhase(next);
+}
+
+// Append a capability to a TLV list
+void putCapability(unsigned char *tlv, int *pos, unsigned char type, unsigned int value) {
+    int length = 1;
+    while (length < 4 && (value >> (8 * length)) != 0) {
+        length++;
+    }
+    tlv[(*pos)++] = type;
+    tlv[(*pos)++] = length;
+    for (int i = length - 1; i >= 0; i--) {
+        tlv[(*pos)++] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+// Read a TLV from a list.
+// Returns its value, or fallback if the list doesn't have it.
+unsigned int getCapability(const unsigned char *tlv, int length, unsigned char type, unsigned int fallback) {
+    for (int pos = 0; pos + 2 <= length && pos + 2 + tlv[pos + 1] <= length; pos += 2 + tlv[pos + 1]) {
+        if (tlv[pos] == type) {
+            unsigned int value = 0;
+            for (int i = 0; i < tlv[pos + 1] && i < 4; i++) {
+                value = (value << 8) | tlv[pos + 2 + i];
+            }
+            return value;
+        }
+    }
+    return fallback;
+}
+
+// Build a parameter frame carrying length bytes of data.
+// Returns its size.
+int buildParameterFrame(unsigned char *frame, unsigned char control, const unsigned char *data, int length) {
+    int size = 0;
+    frame[size++] = FLAG;
+    frame[size++] = A_OWN;
+    frame[size++] = control;
+    frame[size++] = A_OWN ^ control;
+    unsigned char BCC2 = 0;
+    for (int i = 0; i <= length; i++) {
+        unsigned char byte = i < length ? data[i] : BCC2;
+        BCC2 ^= byte;
+        if (byte == FLAG || byte == ESCAPE) {
+            frame[size++] = ESCAPE;
+            frame[size++] = byte ^ STUFF;
+        }
+        else {
+            frame[size++] = byte;
+        }
+    }
+    frame[size++] = FLAG;
+    return size;
+}
+
+// Build the frame advertising our capabilities.
+// Returns its size.
+int buildCapabilitiesFrame(unsigned char *frame) {
+    const LinkCapabilities *own = &ownCapabilities;
+    unsigned char tlv[32];
+    int length = 0;
+    putCapability(tlv, &length, CAP_MAX_PAYLOAD, own->maxPayloadSize);
+    putCapability(tlv, &length, CAP_WINDOW, own->windowSize);
+    putCapability(tlv, &length, CAP_MODULUS, own->sequenceModulus);
+    putCapability(tlv, &length, CAP_FCS, own->fcsTypes);
+    putCapability(tlv, &length, CAP_FEATURES, own->features);
+    putCapability(tlv, &length, CAP_MAX_BAUD, own->maxBaudRate);
+    putCapability(tlv, &length, CAP_MIN_PAYLOAD, own->minPayloadSize);
+    return buildParameterFrame(frame, C_CAPS, tlv, length);
+}
+
+// Read the rest of a parameter frame from the peer, once its control field was
+// read, up to and including the closing flag.
+// Returns the length of its data, or -1 if the frame is damaged.
+int receiveParameters(unsigned char control, unsigned char *data) {
+    unsigned char byte;
+    int length = 0;
+    int escaped = FALSE;
+
+    if (readByte(&byte) <= 0 || byte != (A_PEER ^ control)) {
+        return -1;
+    }
+    while (readByte(&byte) > 0 && byte != FLAG) {
+        if (length == PARAMETER_SIZE + 1) {
+            return -1;
+        }
+        if (byte == ESCAPE) {
+            escaped = TRUE;
+            continue;
+        }
+        data[length++] = escaped ? byte ^ STUFF : byte;
+        escaped = FALSE;
+    }
+    if (byte != FLAG || length == 0) {
+        return -1;
+    }
+    unsigned char check = 0;
+    for (int i = 0; i < length; i++) {
+        check ^= data[i];
+    }
+    if (check != 0) {
+        return -1;
+    }
+    framesReceived++;
+    return length - 1;
+}
+
+// Read the capabilities frame from the peer, once its control field was read.
+// A damaged frame is ignored.
+void receiveCapabilities() {
+    unsigned char data[PARAMETER_SIZE + 1];
+    int length = receiveParameters(C_CAPS, data);
+    if (length < 0) {
+        return;
+    }
+
+    // Capabilities the peer leaves out are those of today's protocol
+    peerCapabilities.maxPayloadSize = getCapability(data, length, CAP_MAX_PAYLOAD, baseCapabilities.maxPayloadSize);
+    peerCapabilities.windowSize = getCapability(data, length, CAP_WINDOW, baseCapabilities.windowSize);
+    peerCapabilities.sequenceModulus = getCapability(data, length, CAP_MODULUS, baseCapabilities.sequenceModulus);
+    peerCapabilities.fcsTypes = getCapability(data, length, CAP_FCS, baseCapabilities.fcsTypes);
+    peerCapabilities.features = getCapability(data, length, CAP_FEATURES, baseCapabilities.features);
+    peerCapabilities.maxBaudRate = getCapability(data, length, CAP_MAX_BAUD, baseCapabilities.maxBaudRate);
+    peerCapabilities.minPayloadSize = getCapability(data, length, CAP_MIN_PAYLOAD, baseCapabilities.minPayloadSize);
+    peerAdvertised = TRUE;
+}
+
+// Settle the capabilities of the link once the handshake is done
+void negotiateCapabilities() {
+    linkCapabilities = baseCapabilities;
+    linkCapabilities.minPayloadSize = MIN(ownCapabilities.minPayloadSize, baseCapabilities.maxPayloadSize);
+    if (!peerAdvertised) {
+        printf("Peer advertised no capabilities, using the base protocol\n");
+        return;
+    }
+    linkCapabilities.maxPayloadSize = MIN(ownCapabilities.maxPayloadSize, peerCapabilities.maxPayloadSize);
+    linkCapabilities.minPayloadSize = MIN(MAX(ownCapabilities.minPayloadSize, peerCapabilities.minPayloadSize),
+                                          linkCapabilities.maxPayloadSize);
+    linkCapabilities.windowSize = MIN(ownCapabilities.windowSize, peerCapabilities.windowSize);
+    linkCapabilities.sequenceModulus = MIN(ownCapabilities.sequenceModulus, peerCapabilities.sequenceModulus);
+    linkCapabilities.fcsTypes = ownCapabilities.fcsTypes & peerCapabilities.fcsTypes;
+    linkCapabilities.features = ownCapabilities.features & peerCapabilities.features;
+    linkCapabilities.maxBaudRate = MIN(ownCapabilities.maxBaudRate, peerCapabilities.maxBaudRate);
+    printf("Link capabilities: payload %d to %d bytes, window %d, modulus %d, FCS 0x%X, features 0x%X, max baud %d\n",
+           linkCapabilities.minPayloadSize, linkCapabilities.maxPayloadSize, linkCapabilities.windowSize, linkCapabilities.sequenceModulus,
+           linkCapabilities.fcsTypes, linkCapabilities.features, linkCapabilities.maxBaudRate);
+}
+
+// Answer a SET: our capabilities (only to a peer that sent its own) and UA
+void answerSet() {
+    unsigned char frame[PARAMETER_FRAME_SIZE + 5];
+    int uaSize = peerAdvertised ? buildCapabilitiesFrame(frame) : 0;
+    unsigned char ua[5] = {FLAG, A_RX, C_UA, (A_RX ^ C_UA), FLAG};
+    memcpy(frame + uaSize, ua, 5);
+    uaSize += 5;
+    if (writeFrame(frame, uaSize) < 0) {
+        perror("ERROR: Error on writing to serial port. (2)\n");
+    }
+    framesSent += peerAdvertised ? 2 : 1;
+}
+
+// Send a parameter frame with a single TLV
+void sendParameter(unsigned char control, unsigned char type, unsigned int value) {
+    unsigned char tlv[8];
+    int length = 0;
+    putCapability(tlv, &length, type, value);
+    unsigned char frame[PARAMETER_FRAME_SIZE];
+    int size = buildParameterFrame(frame, control, tlv, length);
+    if (writeFrame(frame, size) < 0) {
+        perror("ERROR: Error on writing to serial port. (7)\n");
+    }
+    framesSent++;
+}
+
+// Read frames from the peer until a valid one arrives or the monotonic clock
+// reaches deadline. Parameter frames are read whole into data; of the others
+// only the header is read.
+// Returns the length of the data (0 for other frames), or -1 at the deadline.
+int readParameterFrame(unsigned char *control, unsigned char *data, uint64_t deadline) {
+    unsigned char byte;
+    LinkLayerState state = START;
+    while (monotonicNs() < deadline) {
+        if (readByte(&byte) <= 0) {
+            continue;
+        }
+        switch (state) {
+            case START:
+                if (byte == FLAG) {
+                    state = FLAG_RCV;
+                }
+                break;
+
+            case FLAG_RCV:
+                if (byte == A_PEER) {
+                    state = A_RCV;
+                }
+                else if (byte != FLAG) {
+                    state = START;
+                }
+                break;
+
+            case A_RCV:
+                *control = byte;
+                if (byte == C_CAPS || byte == C_BAUD || byte == C_PROBE || byte == C_REPORT || byte == C_BAUD_DONE) {
+                    int length = receiveParameters(byte, data);
+                    if (length >= 0) {
+                        return length;
+                    }
+                    state = START;
+                }
+                else {
+                    state = byte == FLAG ? FLAG_RCV : C_RCV;
+                }
+                break;
+
+            case C_RCV:
+                if (byte == (A_PEER ^ *control)) {
+                    return 0;
+                }
+                state = byte == FLAG ? FLAG_RCV : START;
+                break;
+
+            default:
+                state = START;
+                break;
+        }
+    }
+    return -1;
+}
+
+// Wait for a parameter frame of the given control field.
+// Returns the value of its TLV type, or -1 if none arrived before deadline.
+long waitParameter(unsigned char control, unsigned char type, uint64_t deadline) {
+    unsigned char answer;
+    unsigned char data[PARAMETER_SIZE + 1];
+    int length;
+    while ((length = readParameterFrame(&answer, data, deadline)) >= 0) {
+        if (answer == control) {
+            return getCapability(data, length, type, 0);
+        }
+    }
+    return -1;
+}
+
+// Send a parameter frame until the receiver echoes it.
+// Returns TRUE once echoed, FALSE after the retransmissions ran out.
+int exchangeParameter(unsigned char control, unsigned char type, unsigned int value) {
+    for (int attempt = 0; attempt < retransmissions; attempt++) {
+        sendParameter(control, type, value);
+        if (waitParameter(control, type, monotonicNs() + timeout * 1000000000ULL) == value) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Pattern byte i of probe frame index
+unsigned char probeByte(int index, int i) {
+    return (unsigned char) (i * 7 + index);
+}
+
+// Try a baud rate on the transmitter: ask the receiver to switch, follow it
+// once its answer arrives (at a frame boundary, since it switches when its
+// answer has left) and probe the new rate.
+// Returns 1 if the link now runs at rate, 0 if both went back to baudRate, or
+// -1 if the receiver didn't answer.
+int tryBaudRate(int baudRate, int rate) {
+    if (!exchangeParameter(C_BAUD, BAUD_RATE, rate)) {
+        return -1;
+    }
+    setBaudRateSerialPort(rate);
+
+    unsigned char frames[PROBE_FRAMES * PARAMETER_FRAME_SIZE];
+    int size = 0;
+    for (int index = 0; index < PROBE_FRAMES; index++) {
+        unsigned char probe[PROBE_SIZE + 1];
+        probe[0] = index;
+        for (int i = 0; i < PROBE_SIZE; i++) {
+            probe[1 + i] = probeByte(index, i);
+        }
+        size += buildParameterFrame(frames + size, C_PROBE, probe, PROBE_SIZE + 1);
+    }
+    if (writeFrame(frames, size) < 0) {
+        perror("ERROR: Error on writing to serial port. (8)\n");
+    }
+    drainSerialPort();
+    framesSent += PROBE_FRAMES;
+
+    // The receiver reports within PROBE_WAIT of switching, or not at all
+    long received = waitParameter(C_REPORT, BAUD_PROBES, monotonicNs() + PROBE_WAIT + PROBE_WAIT / 4);
+    if (received == PROBE_FRAMES && exchangeParameter(C_BAUD_DONE, BAUD_RATE, rate)) {
+        return 1;
+    }
+    printf("Baud rate %d failed the probe (%ld of %d frames), back to %d\n", rate, received < 0 ? 0 : received,
+           PROBE_FRAMES, baudRate);
+
+    // The receiver goes back on its own, after its report or PROBE_WAIT
+    setBaudRateSerialPort(baudRate);
+    return 0;
+}
+
+// Raise the baud rate of the transmitter to a faster one both sides allow
+// that passes the probe, then tell the receiver the switching is done. The
+// fastest rate is tried first; if it fails, the rates below it are bisected,
+// keeping the first that passes, so at most 1 + log2(rates) probes fail.
+// Returns the baud rate settled on.
+int raiseBaudRate(int baudRate) {
+    int low = 0, high = -1;
+    for (int i = 0; serialBaudRates[i] != 0; i++) {
+        if (serialBaudRates[i] <= baudRate) {
+            low = i + 1;
+        }
+        if (serialBaudRates[i] <= linkCapabilities.maxBaudRate) {
+            high = i;
+        }
+    }
+    int next = high;
+    while (low <= high) {
+        int result = tryBaudRate(baudRate, serialBaudRates[next]);
+        if (result > 0) {
+            printf("Baud rate raised from %d to %d\n", baudRate, serialBaudRates[next]);
+            return serialBaudRates[next];
+        }
+        if (result < 0) {
+            break;
+        }
+        high = next - 1;
+        next = (low + high + 1) / 2;
+    }
+    if (!exchangeParameter(C_BAUD_DONE, BAUD_RATE, baudRate)) {
+        printf("Receiver didn't confirm the baud rate, staying at %d\n", baudRate);
+    }
+    return baudRate;
+}
+
+// Step the baud rate of the transmitter down to the next slower rate, once the
+// frames sent at the current one fail too often. The receiver switches once
+// its echo of the request has left; if the echo is lost, the receiver may have
+// switched anyway, so the request is repeated at the new rate before going
+// back. The frame error estimate starts over either way.
+void lowerBaudRate() {
+    int rate = 0;
+    for (int i = 0; serialBaudRates[i] != 0 && serialBaudRates[i] < lineBaudRate; i++) {
+        if (serialBaudRates[i] >= openBaudRate) {
+            rate = serialBaudRates[i];
+        }
+    }
+    double errorRate = frameSizerErrorRate(&frameSizer);
+    if (rate != 0) {
+        int echoed = exchangeParameter(C_BAUD, BAUD_RATE, rate);
+        setBaudRateSerialPort(rate);
+        if (echoed || exchangeParameter(C_BAUD, BAUD_RATE, rate)) {
+            printf("Frame error rate %.2f, baud rate lowered from %d to %d\n", errorRate, lineBaudRate, rate);
+            lineBaudRate = rate;
+        }
+        else {
+            setBaudRateSerialPort(lineBaudRate);
+        }
+    }
+    frameSizerInit(&frameSizer, frameSizer.minSize, frameSizer.maxSize, frameSizer.size, 1e10 / lineBaudRate,
+                   timeout * 1e9);
+}
+
+// Receive the probe frames at a new baud rate and report them.
+// Returns TRUE if they all arrived and the transmitter settled on the rate.
+int receiveProbes(int rate) {
+    unsigned char control;
+    unsigned char data[PARAMETER_SIZE + 1];
+    int length;
+    int received = 0;
+    uint64_t deadline = monotonicNs() + PROBE_WAIT;
+    while ((length = readParameterFrame(&control, data, deadline)) >= 0) {
+        if (control != C_PROBE || length != PROBE_SIZE + 1) {
+            continue;
+        }
+        int intact = TRUE;
+        for (int i = 0; i < PROBE_SIZE; i++) {
+            intact = intact && data[1 + i] == probeByte(data[0], i);
+        }
+        received += intact;
+        if (data[0] == PROBE_FRAMES - 1) {
+            break;
+        }
+    }
+
+    // Nothing readable: the transmitter gives up without a report
+    if (received == 0) {
+        return FALSE;
+    }
+    sendParameter(C_REPORT, BAUD_PROBES, received);
+    drainSerialPort();
+    if (received < PROBE_FRAMES) {
+        return FALSE;
+    }
+    if (waitParameter(C_BAUD_DONE, BAUD_RATE, monotonicNs() + PROBE_WAIT) != rate) {
+        return FALSE;
+    }
+    sendParameter(C_BAUD_DONE, BAUD_RATE, rate);
+    return TRUE;
+}
+
+// Follow the baud rate changes of the transmitter on the receiver, until it
+// is done with them.
+// Returns the baud rate settled on.
+int followBaudRate(int baudRate) {
+    unsigned char control;
+    unsigned char data[PARAMETER_SIZE + 1];
+    int length;
+    while ((length = readParameterFrame(&control, data, NO_DEADLINE)) >= 0) {
+        if (control == C_SET) {
+            // Our UA was lost
+            answerSet();
+        }
+        else if (control == C_BAUD) {
+            int rate = getCapability(data, length, BAUD_RATE, 0);
+            if (rate <= 0 || rate > linkCapabilities.maxBaudRate) {
+                continue;
+            }
+            // Switch once the answer has left, so the next frame is at the new rate
+            sendParameter(C_BAUD, BAUD_RATE, rate);
+            drainSerialPort();
+            if (setBaudRateSerialPort(rate) == 0 && receiveProbes(rate)) {
+                printf("Baud rate raised from %d to %d\n", baudRate, rate);
+                return rate;
+            }
+            setBaudRateSerialPort(baudRate);
+        }
+        else if (control == C_BAUD_DONE) {
+            sendParameter(C_BAUD_DONE, BAUD_RATE, getCapability(data, length, BAUD_RATE, 0));
+            return baudRate;
+        }
+        else if (control == C_N0 || control == C_N1) {
+            // The transmitter went on without us (it resends the frame)
+            return baudRate;
+        }
+    }
+    return baudRate;
+}
+
+// Acknowledge an information frame from the peer (RR with the next expected sequence number)
+void sendReceiverReady() {
+    unsigned char c = tramaRx % 2 == 0 ? C_RR0 : C_RR1;
+    unsigned char frame[5] = {FLAG, A_OWN, c, (A_OWN ^ c), FLAG};
+    if (writeFrame(frame, 5) < 0) {
+        perror("ERROR: Error on writing to serial port. (4)\n");
+    }
+    framesSent++;
+}
+
+// Read the rest of an information frame from the peer, once its header was
+// read, into packet (destuffed) and answer it: RR if its BCC2 is right, REJ if
+// not. Stops early if the alarm fires.
+// Returns the length of its data (0 for a repeated frame), or -1 if the frame
+// was rejected or cut short.
+int receiveInformation(unsigned char field, unsigned char *packet, uint64_t frameStart) {
+    unsigned char byte;
+    int escaped = FALSE;
+    int i = 0;
+    while (TRUE) {
+        int result = readByte(&byte);
+        if (result < 0) {
+            return -1;
+        }
+        if (result == 0) {
+            if (alarmTriggered) {
+                return -1;
+            }
+            continue;
+        }
+        if (byte == FLAG) {
+            break;
+        }
+        // Longer than the payload we accepted (and its BCC2): a flag was lost
+        if (i > linkCapabilities.maxPayloadSize) {
+            return -1;
+        }
+        if (byte == ESCAPE) {
+            escaped = TRUE;
+            continue;
+        }
+        packet[i++] = escaped ? byte ^ STUFF : byte;
+        escaped = FALSE;
+    }
+    if (i == 0) {
+        return -1;
+    }
+    framesReceived++;
+    recordLatency(&stats.wire, monotonicNs() - frameStart);
+
+    // Check BCC2
+    unsigned char BCC2 = packet[--i];
+    unsigned char check = 0;
+    for (int j = 0; j < i; j++) {
+        check ^= packet[j];
+    }
+
+    // If BCC2 is incorrect, send REJ
+    if (BCC2 != check) {
+        unsigned char c = tramaRx % 2 == 0 ? C_REJ0 : C_REJ1;
+        unsigned char frame[5] = {FLAG, A_OWN, c, (A_OWN ^ c), FLAG};
+        if (writeFrame(frame, 5) < 0) {
+            perror("ERROR: Error on writing to serial port. (5)\n");
+        }
+        framesSent++;
+        stats.retransmissionsRej++;
+        metricsRetransmission(TRUE);
+        TRACE_INSTANT(TRACE_REJ, tramaRx);
+        return -1;
+    }
+
+    // If BCC2 is correct, send RR
+    if ((tramaRx % 2 == 0 && field == C_N0) || (tramaRx % 2 == 1 && field == C_N1)) {
+        tramaRx = (tramaRx + 1) % 2;
+        stats.payloadBytes += i;
+        metricsAcked(i);
+    }
+    else {
+        // Our RR was lost and the peer timed out
+        stats.retransmissionsTimeout++;
+        metricsRetransmission(FALSE);
+        i = 0;
+    }
+    sendReceiverReady();
+    return i;
+}
+
 // Auxiliar function to make Tx receive the Rx's response (RR or REJ)
 unsigned char readControlFrame() {
     unsigned char byte;
@@ -80,7 +683,7 @@ unsigned char readControlFrame() {
     int result;
 
     while(state != STOP){
-        result = readByteSerialPort(&byte, 1);
+        result = readByte(&byte);
         if (result > 0) {
             switch (state){
                 case START: {
@@ -149,18 +752,38 @@ unsigned char readControlFrame() {
 // LLOPEN
 ////////////////////////////////////////////////
 int llopen(LinkLayer connectionParameters){
-    time(&startTime);
+    memset(&stats, 0, sizeof(stats));
+    stats.start = monotonicNs();
+    currentPhase = SERIAL_PHASE_OPEN;
+    phaseStartFrames = framesSent + framesReceived;
+    linkCapabilities = baseCapabilities;
+    peerAdvertised = FALSE;
 
     // Open serial port
     fd = openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate);
     if (fd < 0) {
         return -1;
     }
+    stats.start = monotonicNs(); // A simulated link brings its own clock
+
+    // Offer a faster baud rate when asked to (LL_MAX_BAUD) and the port has one
+    ownCapabilities = baseCapabilities;
+    ownCapabilities.maxPayloadSize = MAX_PAYLOAD_SIZE;
+    ownCapabilities.minPayloadSize = MIN_PAYLOAD_SIZE;
+    const char *maxBaud = getenv("LL_MAX_BAUD");
+    if (maxBaud != NULL && maxBaudRateSerialPort() > 0) {
+        ownCapabilities.maxBaudRate = MIN(atoi(maxBaud), maxBaudRateSerialPort());
+        if (ownCapabilities.maxBaudRate > connectionParameters.baudRate) {
+            ownCapabilities.features |= LL_FEATURE_BAUD_RATE;
+        }
+    }
 
     // Set global variables
     retransmissions = connectionParameters.nRetransmissions;
     timeout = connectionParameters.timeout;
     role = connectionParameters.role;
+    traceInit(role == LlTx ? "tx" : "rx");
+    metricsStart(role == LlTx ? "tx" : "rx");
 
     // Establish connection
     int currentTransmission = retransmissions;
@@ -171,20 +794,24 @@ int llopen(LinkLayer connectionParameters){
             (void) signal(SIGALRM, alarmHandler);
             alarmTriggered = FALSE;
 
-            // Send SET frame
-            unsigned char frame_set[5] = {FLAG, A_TX, C_SET, (A_TX ^ C_SET), FLAG};
+            // Send our capabilities and the SET frame
+            unsigned char frame_set[PARAMETER_FRAME_SIZE + 5];
+            int setSize = buildCapabilitiesFrame(frame_set);
+            unsigned char set[5] = {FLAG, A_TX, C_SET, (A_TX ^ C_SET), FLAG};
+            memcpy(frame_set + setSize, set, 5);
+            setSize += 5;
             while (currentTransmission && state != STOP) {
-                if (writeBytesSerialPort(frame_set, 5) < 0) {
+                if (writeFrame(frame_set, setSize) < 0) {
                     perror("ERROR: Error on writing to serial port. (1)\n");
                 }
-                framesSent++;
+                framesSent += 2;
                 alarmTriggered = FALSE;
-                alarm(timeout);
+                alarmSerialPort(timeout);
                 while (!alarmTriggered && state != STOP) {
                     // Read UA frame
                     unsigned char byte;
                     int result;
-                    result = readByteSerialPort(&byte, 1);
+                    result = readByte(&byte);
                     if (result > 0) {
                         switch (state) {
                             case START:
@@ -206,6 +833,10 @@ int llopen(LinkLayer connectionParameters){
                                 if (byte == C_UA) {
                                     state = C_RCV;
                                 }
+                                else if (byte == C_CAPS) {
+                                    receiveCapabilities();
+                                    state = START;
+                                }
                                 else if (byte == FLAG) {
                                     state = FLAG_RCV;
                                 }
@@ -265,7 +896,7 @@ int llopen(LinkLayer connectionParameters){
             unsigned char byte;
             int result;
             while (state != STOP) {
-                result = readByteSerialPort(&byte, 1);
+                result = readByte(&byte);
                 if (result > 0) {
                     switch (state) {
                         case START: {
@@ -289,6 +920,10 @@ int llopen(LinkLayer connectionParameters){
                             if (byte == C_SET) {
                                 state = C_RCV;
                             }
+                            else if (byte == C_CAPS) {
+                                receiveCapabilities();
+                                state = START;
+                            }
                             else if (byte == FLAG) {
                                 state = FLAG_RCV;
                             }
@@ -332,10 +967,7 @@ int llopen(LinkLayer connectionParameters){
             }
 
 
-            unsigned char frame[5] = {FLAG, A_RX, C_UA, (A_RX ^ C_UA), FLAG};
-            if (writeBytesSerialPort(frame, 5) < 0) {
-                perror("ERROR: Error on writing to serial port. (2)\n");
-            }
+            answerSet();
             break;
         }
 
@@ -343,7 +975,24 @@ int llopen(LinkLayer connectionParameters){
             return -1;
     }
 
-    time(&startTimeConnection); // Track time when connection was established and packet transfer started
+    negotiateCapabilities();
+    lineBaudRate = maxBaudRateSerialPort() > 0 ? connectionParameters.baudRate : 0;
+    openBaudRate = connectionParameters.baudRate;
+    if ((linkCapabilities.features & LL_FEATURE_BAUD_RATE) && linkCapabilities.maxBaudRate > connectionParameters.baudRate) {
+        if (role == LlTx) {
+            lineBaudRate = raiseBaudRate(connectionParameters.baudRate);
+        }
+        else {
+            lineBaudRate = followBaudRate(connectionParameters.baudRate);
+        }
+    }
+
+    // Frames start at the size of the base protocol, 10 bits per byte (8-N-1)
+    frameSizerInit(&frameSizer, linkCapabilities.minPayloadSize, linkCapabilities.maxPayloadSize, BASE_PAYLOAD_SIZE,
+                   lineBaudRate > 0 ? 1e10 / lineBaudRate : 0, timeout * 1e9);
+    linkPayloadSize = frameSizer.size;
+    stats.connected = monotonicNs(); // Track time when connection was established and packet transfer started
+    enterPhase(SERIAL_PHASE_DATA);
     alarmCount = 0;
     return 1;
 }
@@ -352,6 +1001,17 @@ int llopen(LinkLayer connectionParameters){
 // LLWRITE
 ////////////////////////////////////////////////
 int llwrite(const unsigned char *buf, int bufSize) {
+    if (role == LlTx && lineBaudRate > openBaudRate && frameSizer.sent >= BAUD_FALLBACK_FRAMES &&
+        frameSizerErrorRate(&frameSizer) > BAUD_FALLBACK_ERRORS) {
+        lowerBaudRate();
+    }
+    uint64_t encodeStart = monotonicNs();
+    if (bufSize > linkCapabilities.maxPayloadSize) {
+        printf("ERROR: %d bytes exceed the payload accepted by the peer (%d bytes).\n", bufSize,
+               linkCapabilities.maxPayloadSize);
+        return -1;
+    }
+
     // Frame structure: | FLAG | A | C | BCC1 | D1 | D2 | ... | DN | BCC2 | FLAG 
     // Initialize frame to write
     int frameSize = bufSize+6;
@@ -360,9 +1020,9 @@ int llwrite(const unsigned char *buf, int bufSize) {
     // Construct frame:
     // Frame header
     frame[0] = FLAG;
-    frame[1] = A_TX;
+    frame[1] = A_OWN;
     frame[2] = (tramaTx % 2 == 0) ? C_N0 : C_N1;    // Sequence number
-    frame[3] = (A_TX ^ frame[2]);                   // BCC1
+    frame[3] = (A_OWN ^ frame[2]);                  // BCC1
 
     // Calculate BCC2
     unsigned char BCC2 = 0;
@@ -383,9 +1043,18 @@ int llwrite(const unsigned char *buf, int bufSize) {
         }
     }
 
-    // Finish information frame
-    frame[frameCount++] = BCC2;
+    // Finish information frame (BCC2 is stuffed like the data it protects)
+    if (BCC2 == FLAG || BCC2 == ESCAPE) {
+        frame = realloc(frame, ++frameSize);
+        frame[frameCount++] = ESCAPE;
+        frame[frameCount++] = BCC2 ^ STUFF;
+    }
+    else {
+        frame[frameCount++] = BCC2;
+    }
     frame[frameCount] = FLAG;
+    recordLatency(&stats.encode, monotonicNs() - encodeStart);
+    TRACE_SPAN(TRACE_FRAME_ENCODED, encodeStart, frameSize);
 
     // Send frame
     int currentTransmission = retransmissions;
@@ -395,13 +1064,20 @@ int llwrite(const unsigned char *buf, int bufSize) {
     (void) signal(SIGALRM, alarmHandler);
 
     while (currentTransmission > 0 && !accepted && !rejected) {
-        if (writeBytesSerialPort(frame, frameSize) < 0) {
+        // The frame has left once the port's output queue is drained
+        uint64_t writeStart = monotonicNs();
+        if (writeFrame(frame, frameSize) < 0) {
             perror("ERROR: Error on writing to serial port. (3)\n");
         }
+        drainSerialPort();
+        uint64_t sentAt = monotonicNs();
+        recordLatency(&stats.wire, sentAt - writeStart);
+        TRACE_SPAN(TRACE_FRAME_WRITTEN, writeStart, frameSize);
+        metricsInFlight(1);
         framesSent++;
         alarmTriggered = FALSE;
         rejected = FALSE;
-        alarm(timeout);
+        alarmSerialPort(timeout);
 
         while (!alarmTriggered && !accepted && !rejected) {
             unsigned char response;
@@ -409,7 +1085,7 @@ int llwrite(const unsigned char *buf, int bufSize) {
             LinkLayerState state = START;
             int result;
             while (state != STOP && !alarmTriggered) {
-                result = readByteSerialPort(&byte, 1);
+                result = readByte(&byte);
                 if (result > 0) {
                     switch (state){
                         case START: {
@@ -420,7 +1096,7 @@ int llwrite(const unsigned char *buf, int bufSize) {
                         }
 
                         case FLAG_RCV: {
-                            if (byte == A_RX) {
+                            if (byte == A_PEER) {
                                 state = A_RCV;
                             }
                             else if (byte != FLAG) {
@@ -430,7 +1106,8 @@ int llwrite(const unsigned char *buf, int bufSize) {
                         }
 
                         case A_RCV: {
-                            if (byte == C_RR0 || byte == C_RR1 || byte == C_REJ0 || byte == C_REJ1 || byte == C_DISC) {
+                            if (byte == C_RR0 || byte == C_RR1 || byte == C_REJ0 || byte == C_REJ1 || byte == C_DISC ||
+                                byte == C_N0 || byte == C_N1) {
                                 state = C_RCV;
                                 response = byte;
                             }
@@ -444,7 +1121,24 @@ int llwrite(const unsigned char *buf, int bufSize) {
                         }
 
                         case C_RCV: {
-                            if (byte == (A_RX ^ response)) {
+                            if (byte == (A_PEER ^ response) && (response == C_N0 || response == C_N1)) {
+                                // The peer only starts sending a new information frame after
+                                // receiving ours, so it implicitly acknowledges it. The peer's
+                                // frame is answered here and kept for the next llread (if it
+                                // is rejected, the peer resends it to llread).
+                                // A repeated frame means our RR was lost: acknowledge it again.
+                                if ((response == C_N0) == (tramaRx % 2 == 0)) {
+                                    int size = receiveInformation(response, pendingPacket, monotonicNs());
+                                    pendingSize = size > 0 ? size : 0;
+                                    response = C_RR0;
+                                    state = STOP;
+                                }
+                                else {
+                                    sendReceiverReady();
+                                    state = START;
+                                }
+                            }
+                            else if (byte == (A_PEER ^ response)) {
                                 state = BCC_OK;
                             }
                             else if (byte == FLAG) {
@@ -475,17 +1169,31 @@ int llwrite(const unsigned char *buf, int bufSize) {
                             return -1;
                     }
                 }
+                else if (result < 0) {
+                    // The port failed (e.g. the peer closed it): no answer will come
+                    alarmTriggered = TRUE;
+                    currentTransmission = 1;
+                }
             }
             if (state != STOP) {
                 continue;
             }
 
             if (response == C_RR0 || response == C_RR1) {
+                recordLatency(&stats.ackRtt, monotonicNs() - sentAt);
+                metricsRtt(monotonicNs() - sentAt);
+                metricsAcked(bufSize);
+                TRACE_INSTANT(TRACE_ACK_RECEIVED, tramaTx);
+                stats.payloadBytes += bufSize;
                 accepted = TRUE;
                 tramaTx = (tramaTx + 1) % 2;
                 break;
             }
             else if (response == C_REJ0 || response == C_REJ1) {
+                // The application layer resends the frame
+                stats.retransmissionsRej++;
+                metricsRetransmission(TRUE);
+                TRACE_INSTANT(TRACE_REJ, tramaTx);
                 alarmTriggered = FALSE;
                 rejected = TRUE;
                 break;
@@ -494,13 +1202,22 @@ int llwrite(const unsigned char *buf, int bufSize) {
                 return -1;
             }
         }
+        frameSizerRecord(&frameSizer, bufSize, accepted ? SIZER_ACKED : rejected ? SIZER_REJECTED : SIZER_TIMED_OUT,
+                         accepted ? monotonicNs() - writeStart : 0);
+        linkPayloadSize = frameSizer.size;
         if (accepted || rejected) {
             break;
         }
         currentTransmission--;
+        if (currentTransmission > 0) {
+            stats.retransmissionsTimeout++;
+            metricsRetransmission(FALSE);
+        }
     }
+    metricsInFlight(0);
 
     free(frame);
+    alarmSerialPort(0);
     alarmCount = 0;
 
     if (accepted) {
@@ -516,11 +1233,23 @@ int llwrite(const unsigned char *buf, int bufSize) {
 ////////////////////////////////////////////////
 int llread(unsigned char *packet){
     unsigned char byte, field;
-    int i = 0;
+    uint64_t frameStart = 0;
+    uint64_t readStart = TRACE_NOW();
     int result;
+
+    // A frame the peer sent while we were waiting for the answer to ours
+    if (pendingSize > 0) {
+        int size = pendingSize;
+        memcpy(packet, pendingPacket, size);
+        pendingSize = 0;
+        TRACE_SPAN(TRACE_LLREAD, readStart, size);
+        return size;
+    }
+
+    alarmTriggered = FALSE;
     LinkLayerState state = START;
     while (state != STOP) {
-        result = readByteSerialPort(&byte, 1);
+        result = readByte(&byte);
         if (result > 0) {
             switch (state){
                 case START: {
@@ -531,7 +1260,8 @@ int llread(unsigned char *packet){
                 }
 
                 case FLAG_RCV: {
-                    if (byte == A_TX) {
+                    if (byte == A_PEER) {
+                        frameStart = monotonicNs();
                         state = A_RCV;
                     }
                     else if (byte != FLAG) {
@@ -545,18 +1275,29 @@ int llread(unsigned char *packet){
                         state = C_RCV;
                         field = byte;
                     }
-                    else if (byte == FLAG) {
-                        state = FLAG_RCV;
-                    }
-                    else {
+                    else if (byte == C_BAUD && role == LlRx) {
+                        // The transmitter steps the rate down: switch once our echo has left
+                        unsigned char data[PARAMETER_SIZE + 1];
+                        int length = receiveParameters(C_BAUD, data);
+                        int rate = length >= 0 ? getCapability(data, length, BAUD_RATE, 0) : 0;
+                        if (rate >= openBaudRate && rate <= linkCapabilities.maxBaudRate) {
+                            sendParameter(C_BAUD, BAUD_RATE, rate);
+                            drainSerialPort();
+                            if (rate != lineBaudRate && setBaudRateSerialPort(rate) == 0) {
+                                printf("Baud rate lowered from %d to %d\n", lineBaudRate, rate);
+                                lineBaudRate = rate;
+                            }
+                        }
                         state = START;
                     }
-                    break;
-                }
-
-                case C_RCV: {
-                    if (byte == (field ^ A_TX)) {
-                        state = DATA_RCV;
+                    else if (byte == C_BAUD_DONE && role == LlRx) {
+                        // Our echo of the end of the baud rate switch was lost
+                        unsigned char data[PARAMETER_SIZE + 1];
+                        int length = receiveParameters(C_BAUD_DONE, data);
+                        if (length >= 0) {
+                            sendParameter(C_BAUD_DONE, BAUD_RATE, getCapability(data, length, BAUD_RATE, 0));
+                        }
+                        state = START;
                     }
                     else if (byte == FLAG) {
                         state = FLAG_RCV;
@@ -567,116 +1308,87 @@ int llread(unsigned char *packet){
                     break;
                 }
 
-                case DATA_RCV: {
-                    if (byte == ESCAPE) {
-                        state = FOUND_DATA;
+                case C_RCV: {
+                    if (byte == (field ^ A_PEER)) {
+                        int size = receiveInformation(field, packet, frameStart);
+                        if (size >= 0) {
+                            TRACE_SPAN(TRACE_LLREAD, readStart, size);
+                            return size;
+                        }
+                        state = START;
                     }
                     else if (byte == FLAG) {
-                        framesReceived++;
-                        // Check BCC2
-                        unsigned char BCC2 = packet[i - 1];
-                        i--;
-                        packet[i] = '\0';
-                        unsigned char check = packet[0];
-
-                        // Calculate BCC2
-                        for (unsigned int j = 1; j < i; j++) {
-                            check ^= packet[j];
-                        }
-
-                        // If BCC2 is correct, send RR
-                        if (BCC2 == check) {
-                            int c;
-                            c = tramaRx % 2 == 0 ? C_RR0 : C_RR1;
-                            unsigned char frame[5] = {FLAG, A_RX, c, (A_RX ^ c), FLAG};
-                            if (writeBytesSerialPort(frame, 5) < 0) {
-                                perror("ERROR: Error on writing to serial port. (4)\n");
-                            }
-                            framesSent++;
-                            if ((tramaRx % 2 == 0 && field == C_N0) || (tramaRx % 2 == 1 && field == C_N1)) {
-                                tramaRx = (tramaRx + 1) % 2;
-                            }
-                            else {
-                                i = 0;
-                            }
-                            return i;
-                        }
-
-                        // If BCC2 is incorrect, send REJ
-                        else {
-                            int c;
-                            if (tramaRx % 2 == 0) c = C_REJ0;
-                            else c = C_REJ1;
-                            unsigned char frame[5] = {FLAG, A_RX, c, (A_RX ^ c), FLAG};
-                            if (writeBytesSerialPort(frame, 5) < 0) {
-                                perror("ERROR: Error on writing to serial port. (5)\n");
-                            }
-                            framesSent++;
-                            state = START;
-                            i = 0;
-                            continue;
-                        }
-
+                        state = FLAG_RCV;
                     }
-
-                    // Data
                     else {
-                        packet[i++] = byte;
+                        state = START;
                     }
                     break;
                 }
 
-                case FOUND_DATA: {
-                    state = DATA_RCV;
-                    packet[i++] = byte ^ STUFF;
+                default:
                     break;
-                }
             }
         }
+        else if (result < 0) {
+            return -1;
+        }
     }
+    return -1;
 }
 
 void printStats(role) {
+    double runtime = elapsedSeconds(stats.start, stats.end);
+    double transferTime = elapsedSeconds(stats.connected, stats.end);
+
+    printf("\n");
+    printf("╔════════════════════════════════════════════════════════╗\n");
     switch (role) {
         case LlTx:
-            printf("\n");
-            printf("╔════════════════════════════════════════════════════════╗\n");
             printf("║      Displaying Statistics for Transmitter (LlTx)      ║\n");
-            printf("╠═════════════════════════╦══════════════════════════════╣\n");
-            printf("║      Total Runtime      ║     %10ld seconds       ║\n", endTime - startTime);
-            printf("╠═════════════════════════╬══════════════════════════════╣\n");
-            printf("║       Frames Sent       ║     %10d               ║\n", framesSent);
-            printf("╠═════════════════════════╬══════════════════════════════╣\n");
-            printf("║     Frames Received     ║     %10d               ║\n", framesReceived);
-            printf("╠═════════════════════════╬══════════════════════════════╣\n");
-            printf("║    Data Transfer Time   ║     %10ld seconds       ║\n", endTime - startTimeConnection);
-            printf("╚═════════════════════════╩══════════════════════════════╝\n\n");
             break;
 
         case LlRx:
-            printf("\n");
-            printf("╔════════════════════════════════════════════════════════╗\n");
             printf("║     Displaying Statistics for Receiver (LlRx)          ║\n");
-            printf("╠═════════════════════════╦══════════════════════════════╣\n");
-            printf("║      Total Runtime      ║     %10ld seconds       ║\n", endTime - startTime);
-            printf("╠═════════════════════════╬══════════════════════════════╣\n");
-            printf("║       Frames Sent       ║     %10d               ║\n", framesSent);
-            printf("╠═════════════════════════╬══════════════════════════════╣\n");
-            printf("║     Frames Received     ║     %10d               ║\n", framesReceived);
-            printf("╠═════════════════════════╬══════════════════════════════╣\n");
-            printf("║    Data Transfer Time   ║     %10ld seconds       ║\n", endTime - startTimeConnection);
-            printf("╚═════════════════════════╩══════════════════════════════╝\n\n");
             break;
 
         default:
             break;
     }
+    printf("╠═════════════════════════╦══════════════════════════════╣\n");
+    printf("║      Total Runtime      ║     %10.6f seconds       ║\n", runtime);
+    printf("╠═════════════════════════╬══════════════════════════════╣\n");
+    printf("║       Frames Sent       ║     %10d               ║\n", framesSent);
+    printf("╠═════════════════════════╬══════════════════════════════╣\n");
+    printf("║     Frames Received     ║     %10d               ║\n", framesReceived);
+    printf("╠═════════════════════════╬══════════════════════════════╣\n");
+    printf("║    Data Transfer Time   ║     %10.6f seconds       ║\n", transferTime);
+    printf("╠═════════════════════════╬══════════════════════════════╣\n");
+    printf("║         Goodput         ║     %10.0f bit/s         ║\n", goodput(&stats));
+    printf("╠═════════════════════════╬══════════════════════════════╣\n");
+    printf("║     Wire Efficiency     ║     %10.1f %%             ║\n", 100 * wireEfficiency(&stats));
+    printf("╠═════════════════════════╬══════════════════════════════╣\n");
+    printf("║  Retransmissions (REJ)  ║     %10llu               ║\n", (unsigned long long) stats.retransmissionsRej);
+    printf("╠═════════════════════════╬══════════════════════════════╣\n");
+    printf("║ Retransmissions (timer) ║     %10llu               ║\n", (unsigned long long) stats.retransmissionsTimeout);
+    printf("╠═════════════════════════╬══════════════════════════════╣\n");
+    printf("║      Bytes Avoided      ║     %10llu bytes         ║\n", bytesAvoided);
+    printf("╚═════════════════════════╩══════════════════════════════╝\n\n");
+    if (role == LlTx) {
+        printf("Frame size: next payload %d bytes (%d to %d), frame error rate %.4f\n", frameSizer.size,
+               frameSizer.minSize, frameSizer.maxSize, frameSizerErrorRate(&frameSizer));
+    }
+
+    printHistograms(&stats);
+    printIoStats(&stats);
+    exportStats(&stats, role == LlTx ? "tx" : "rx", framesSent, framesReceived, bytesAvoided);
 }
 
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
 int llclose(int showStatistics){
+    enterPhase(SERIAL_PHASE_CLOSE);
     LinkLayerState state = START;
     unsigned char byte;
     alarmTriggered = FALSE;
@@ -691,18 +1403,18 @@ int llclose(int showStatistics){
             // Send DISC frame
             unsigned char frame_disc[5] = {FLAG, A_TX, C_DISC, A_TX ^ C_DISC, FLAG};
             while (currentTransmission && state != STOP) {
-                if (writeBytesSerialPort(frame_disc, 5) < 0) {
+                if (writeFrame(frame_disc, 5) < 0) {
                     perror("ERROR: Error on writing to serial port. (6)\n");
                 }
                 framesSent++;
                 alarmTriggered = FALSE;
-                alarm(timeout);
+                alarmSerialPort(timeout);
 
                 // Read DISC frame
                 while (!alarmTriggered && state != STOP) {
                     unsigned char byte;
                     int result;
-                    result = readByteSerialPort(&byte, 1);
+                    result = readByte(&byte);
                     if (result > 0) {
                         switch (state) {
                             case START: {
@@ -769,7 +1481,7 @@ int llclose(int showStatistics){
         case (LlRx): {
             // Read DISC frame
             while (state != STOP) {
-                int result = readByteSerialPort(&byte, 1);
+                int result = readByte(&byte);
                 if (result > 0) {
                     switch (state) {
                         case START:
@@ -822,29 +1534,37 @@ int llclose(int showStatistics){
                             break;
                     }
                 }
+                else if (result < 0) {
+                    break; // The port failed: the DISC will never come
+                }
             }
 
             // Send DISC frame
-            unsigned char frame_disc[5] = {FLAG, A_RX, C_DISC, A_RX ^ C_DISC, FLAG};
-            if (writeBytesSerialPort(frame_disc, 5) < 0) {
-                perror("ERROR: Error on writing to serial port. (7)\n");
+            if (state == STOP) {
+                unsigned char frame_disc[5] = {FLAG, A_RX, C_DISC, A_RX ^ C_DISC, FLAG};
+                if (writeFrame(frame_disc, 5) < 0) {
+                    perror("ERROR: Error on writing to serial port. (7)\n");
+                }
+                framesSent++;
             }
-            framesSent++;
         }
 
         default:
             break;
     }
 
-    time(&endTime);
+    stats.end = monotonicNs();
+    countPhaseFrames();
 
     if (state != STOP) {
         return -1;
     }
 
-    alarm(0);
+    alarmSerialPort(0);
 
     printStats(role);
+    traceDump();
+    metricsStop();
 
     int clstat = closeSerialPort();
     return clstat;
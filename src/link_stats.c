@@ -0,0 +1,235 @@
+// Link layer statistics implementation
+
+#include "link_stats.h"
+#include "sim_port.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+uint64_t monotonicNs() {
+    // A simulated link runs on its virtual clock
+    if (simulationActive()) {
+        return simulationClock();
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Bucket of a sample: floor(log2(microseconds)), clamped to the histogram
+int latencyBucket(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (us > 1 && bucket < STATS_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void recordLatency(LatencyHistogram *histogram, uint64_t ns) {
+    if (histogram->count == 0 || ns < histogram->min) histogram->min = ns;
+    if (ns > histogram->max) histogram->max = ns;
+    histogram->count++;
+    histogram->sum += ns;
+    histogram->buckets[latencyBucket(ns)]++;
+}
+
+// Seconds elapsed between two instants of the monotonic clock
+double elapsedSeconds(uint64_t from, uint64_t to) {
+    return to > from ? (to - from) / 1e9 : 0;
+}
+
+// Application bits delivered per second of data transfer
+double goodput(const LinkStats *stats) {
+    double seconds = elapsedSeconds(stats->connected, stats->end);
+    return seconds > 0 ? stats->payloadBytes * 8 / seconds : 0;
+}
+
+// Share of the bytes crossing the port (both directions) that is application data
+double wireEfficiency(const LinkStats *stats) {
+    uint64_t wireBytes = stats->bytesWritten + stats->bytesRead;
+    return wireBytes > 0 ? (double) stats->payloadBytes / wireBytes : 0;
+}
+
+double meanMicroseconds(const LatencyHistogram *histogram) {
+    return histogram->count > 0 ? histogram->sum / 1e3 / histogram->count : 0;
+}
+
+void printHistogram(const char *name, const LatencyHistogram *histogram) {
+    if (histogram->count == 0) {
+        return;
+    }
+    printf("%s: %llu samples, mean %.1f us, min %.1f us, max %.1f us\n", name,
+           (unsigned long long) histogram->count, meanMicroseconds(histogram), histogram->min / 1e3,
+           histogram->max / 1e3);
+
+    uint64_t largest = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        if (histogram->buckets[i] > largest) largest = histogram->buckets[i];
+    }
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        if (histogram->buckets[i] == 0) {
+            continue;
+        }
+        int width = (int) (histogram->buckets[i] * 40 / largest);
+        printf("  %9llu us | %8llu | ", i ? 1ULL << i : 0ULL, (unsigned long long) histogram->buckets[i]);
+        for (int j = 0; j < width; j++) printf("#");
+        printf("\n");
+    }
+}
+
+void printHistograms(const LinkStats *stats) {
+    printHistogram("Frame encode time", &stats->encode);
+    printHistogram("Frame time on wire", &stats->wire);
+    printHistogram("Acknowledgement RTT", &stats->ackRtt);
+    printf("\n");
+}
+
+static const char *phaseNames[SERIAL_PHASES] = {"open", "data", "close"};
+
+// Average of a total over a number of events (0 without events)
+double perEvent(uint64_t total, uint64_t events) {
+    return events > 0 ? (double) total / events : 0;
+}
+
+void printIoStats(const LinkStats *stats) {
+    printf("Serial I/O %7s %9s %10s %8s %9s %9s %11s %8s %6s %9s %14s\n", "frames", "reads", "bytes/read", "empty",
+           "read ms", "writes", "bytes/write", "partial", "again", "write ms", "syscalls/frame");
+    for (int phase = 0; phase < SERIAL_PHASES; phase++) {
+        const SerialIoStats *io = getSerialIoStats(phase);
+        printf("  %-8s %7llu %9llu %10.2f %8llu %9.1f %9llu %11.2f %8llu %6llu %9.1f %14.1f\n", phaseNames[phase],
+               (unsigned long long) stats->phaseFrames[phase], (unsigned long long) io->readCalls,
+               perEvent(io->readBytes, io->readCalls), (unsigned long long) io->emptyReads, io->readNs / 1e6,
+               (unsigned long long) io->writeCalls, perEvent(io->writeBytes, io->writeCalls),
+               (unsigned long long) io->partialWrites, (unsigned long long) io->writeAgain, io->writeNs / 1e6,
+               perEvent(io->readCalls + io->writeCalls, stats->phaseFrames[phase]));
+    }
+    printf("\n");
+}
+
+// I/O accounting of a phase as a JSON object
+void writeIoJson(FILE *out, const LinkStats *stats, int phase) {
+    const SerialIoStats *io = getSerialIoStats(phase);
+    fprintf(out, "\"%s\":{\"frames\":%llu,\"read_calls\":%llu,\"read_bytes\":%llu,\"empty_reads\":%llu,"
+            "\"read_ms\":%.3f,\"write_calls\":%llu,\"write_bytes\":%llu,\"partial_writes\":%llu,"
+            "\"write_again\":%llu,\"write_ms\":%.3f}%s", phaseNames[phase],
+            (unsigned long long) stats->phaseFrames[phase], (unsigned long long) io->readCalls,
+            (unsigned long long) io->readBytes, (unsigned long long) io->emptyReads, io->readNs / 1e6,
+            (unsigned long long) io->writeCalls, (unsigned long long) io->writeBytes,
+            (unsigned long long) io->partialWrites, (unsigned long long) io->writeAgain, io->writeNs / 1e6,
+            phase == SERIAL_PHASES - 1 ? "" : ",");
+}
+
+void writeIoCsv(FILE *out, const char *role, const LinkStats *stats, int phase) {
+    const SerialIoStats *io = getSerialIoStats(phase);
+    const char *name = phaseNames[phase];
+    fprintf(out, "%s,io_%s_frames,%llu\n", role, name, (unsigned long long) stats->phaseFrames[phase]);
+    fprintf(out, "%s,io_%s_read_calls,%llu\n", role, name, (unsigned long long) io->readCalls);
+    fprintf(out, "%s,io_%s_read_bytes,%llu\n", role, name, (unsigned long long) io->readBytes);
+    fprintf(out, "%s,io_%s_empty_reads,%llu\n", role, name, (unsigned long long) io->emptyReads);
+    fprintf(out, "%s,io_%s_read_ms,%.3f\n", role, name, io->readNs / 1e6);
+    fprintf(out, "%s,io_%s_write_calls,%llu\n", role, name, (unsigned long long) io->writeCalls);
+    fprintf(out, "%s,io_%s_write_bytes,%llu\n", role, name, (unsigned long long) io->writeBytes);
+    fprintf(out, "%s,io_%s_partial_writes,%llu\n", role, name, (unsigned long long) io->partialWrites);
+    fprintf(out, "%s,io_%s_write_again,%llu\n", role, name, (unsigned long long) io->writeAgain);
+    fprintf(out, "%s,io_%s_write_ms,%.3f\n", role, name, io->writeNs / 1e6);
+}
+
+void writeHistogramJson(FILE *out, const char *name, const LatencyHistogram *histogram, int last) {
+    fprintf(out, "\"%s\":{\"count\":%llu,\"mean_us\":%.3f,\"min_us\":%.3f,\"max_us\":%.3f,\"buckets\":[", name,
+            (unsigned long long) histogram->count, meanMicroseconds(histogram), histogram->min / 1e3,
+            histogram->max / 1e3);
+    int first = 1;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        if (histogram->buckets[i] == 0) {
+            continue;
+        }
+        fprintf(out, "%s{\"ge_us\":%llu,\"count\":%llu}", first ? "" : ",", i ? 1ULL << i : 0ULL,
+                (unsigned long long) histogram->buckets[i]);
+        first = 0;
+    }
+    fprintf(out, "]}%s", last ? "" : ",");
+}
+
+void writeHistogramCsv(FILE *out, const char *role, const char *name, const LatencyHistogram *histogram) {
+    fprintf(out, "%s,%s_count,%llu\n", role, name, (unsigned long long) histogram->count);
+    fprintf(out, "%s,%s_mean_us,%.3f\n", role, name, meanMicroseconds(histogram));
+    fprintf(out, "%s,%s_min_us,%.3f\n", role, name, histogram->min / 1e3);
+    fprintf(out, "%s,%s_max_us,%.3f\n", role, name, histogram->max / 1e3);
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        if (histogram->buckets[i] > 0) {
+            fprintf(out, "%s,%s_bucket_ge_%llu_us,%llu\n", role, name, i ? 1ULL << i : 0ULL,
+                    (unsigned long long) histogram->buckets[i]);
+        }
+    }
+}
+
+void exportStats(const LinkStats *stats, const char *role, int framesSent, int framesReceived,
+                 unsigned long long bytesAvoided) {
+    const char *format = getenv(STATS_FORMAT_VARIABLE);
+    if (format == NULL || (strcmp(format, "json") != 0 && strcmp(format, "csv") != 0)) {
+        return;
+    }
+
+    const char *path = getenv(STATS_FILE_VARIABLE);
+    FILE *out = path != NULL ? fopen(path, "a") : stdout;
+    if (out == NULL) {
+        perror(path);
+        return;
+    }
+
+    if (strcmp(format, "json") == 0) {
+        // One object per line
+        fprintf(out, "{\"role\":\"%s\",\"runtime_s\":%.6f,\"transfer_s\":%.6f,", role,
+                elapsedSeconds(stats->start, stats->end), elapsedSeconds(stats->connected, stats->end));
+        fprintf(out, "\"frames_sent\":%d,\"frames_received\":%d,\"payload_bytes\":%llu,", framesSent,
+                framesReceived, (unsigned long long) stats->payloadBytes);
+        fprintf(out, "\"bytes_written\":%llu,\"bytes_read\":%llu,\"bytes_avoided\":%llu,",
+                (unsigned long long) stats->bytesWritten, (unsigned long long) stats->bytesRead, bytesAvoided);
+        fprintf(out, "\"goodput_bps\":%.1f,\"wire_efficiency\":%.4f,", goodput(stats), wireEfficiency(stats));
+        fprintf(out, "\"retransmissions\":{\"rej\":%llu,\"timeout\":%llu},",
+                (unsigned long long) stats->retransmissionsRej, (unsigned long long) stats->retransmissionsTimeout);
+        fprintf(out, "\"latency\":{");
+        writeHistogramJson(out, "encode", &stats->encode, 0);
+        writeHistogramJson(out, "wire", &stats->wire, 0);
+        writeHistogramJson(out, "ack_rtt", &stats->ackRtt, 1);
+        fprintf(out, "},\"io\":{");
+        for (int phase = 0; phase < SERIAL_PHASES; phase++) {
+            writeIoJson(out, stats, phase);
+        }
+        fprintf(out, "}}\n");
+    }
+    else {
+        // Long format: role,metric,value
+        if (path == NULL || ftell(out) == 0) {
+            fprintf(out, "role,metric,value\n");
+        }
+        fprintf(out, "%s,runtime_s,%.6f\n", role, elapsedSeconds(stats->start, stats->end));
+        fprintf(out, "%s,transfer_s,%.6f\n", role, elapsedSeconds(stats->connected, stats->end));
+        fprintf(out, "%s,frames_sent,%d\n", role, framesSent);
+        fprintf(out, "%s,frames_received,%d\n", role, framesReceived);
+        fprintf(out, "%s,payload_bytes,%llu\n", role, (unsigned long long) stats->payloadBytes);
+        fprintf(out, "%s,bytes_written,%llu\n", role, (unsigned long long) stats->bytesWritten);
+        fprintf(out, "%s,bytes_read,%llu\n", role, (unsigned long long) stats->bytesRead);
+        fprintf(out, "%s,bytes_avoided,%llu\n", role, bytesAvoided);
+        fprintf(out, "%s,goodput_bps,%.1f\n", role, goodput(stats));
+        fprintf(out, "%s,wire_efficiency,%.4f\n", role, wireEfficiency(stats));
+        fprintf(out, "%s,retransmissions_rej,%llu\n", role, (unsigned long long) stats->retransmissionsRej);
+        fprintf(out, "%s,retransmissions_timeout,%llu\n", role, (unsigned long long) stats->retransmissionsTimeout);
+        writeHistogramCsv(out, role, "encode", &stats->encode);
+        writeHistogramCsv(out, role, "wire", &stats->wire);
+        writeHistogramCsv(out, role, "ack_rtt", &stats->ackRtt);
+        for (int phase = 0; phase < SERIAL_PHASES; phase++) {
+            writeIoCsv(out, role, stats, phase);
+        }
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    else {
+        fflush(out);
+    }
+}
@@ -0,0 +1,205 @@
+// Live transfer metrics implementation
+
+#include "metrics.h"
+#include "link_stats.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+
+static LiveMetrics metrics;
+static const char *metricsRole = "";
+static const char *socketPath = NULL;
+static int listenFd = -1;
+static pthread_t server;
+
+void metricsContent(uint64_t contentBytes) {
+    STORE(metrics.contentBytes, contentBytes);
+
+    // Throughput: exponentially smoothed over samples at least METRICS_RATE_INTERVAL apart
+    uint64_t now = monotonicNs();
+    if (metrics.rateTime == 0) {
+        metrics.rateTime = now;
+        metrics.rateBytes = contentBytes;
+    }
+    else if (now - metrics.rateTime >= METRICS_RATE_INTERVAL) {
+        uint64_t sample = (contentBytes - metrics.rateBytes) * 1000000000ULL / (now - metrics.rateTime);
+        uint64_t previous = LOAD(metrics.throughput);
+        STORE(metrics.throughput, previous ? (previous * 7 + sample * 3) / 10 : sample);
+        metrics.rateTime = now;
+        metrics.rateBytes = contentBytes;
+    }
+}
+
+void metricsTotal(uint64_t totalBytes) {
+    STORE(metrics.totalBytes, totalBytes);
+}
+
+void metricsAcked(uint64_t bytes) {
+    ADD(metrics.bytesAcked, bytes);
+}
+
+// Smoothed like TCP's SRTT: 7/8 of the estimate plus 1/8 of the sample
+void metricsRtt(uint64_t sample) {
+    uint64_t rtt = LOAD(metrics.rtt);
+    STORE(metrics.rtt, rtt ? (rtt * 7 + sample) / 8 : sample);
+}
+
+void metricsInFlight(uint64_t frames) {
+    STORE(metrics.inFlight, frames);
+}
+
+void metricsRetransmission(int rejected) {
+    if (rejected) {
+        ADD(metrics.retransmissionsRej, 1);
+    }
+    else {
+        ADD(metrics.retransmissionsTimeout, 1);
+    }
+}
+
+void metricsSnapshot(LiveMetrics *snapshot) {
+    snapshot->contentBytes = LOAD(metrics.contentBytes);
+    snapshot->totalBytes = LOAD(metrics.totalBytes);
+    snapshot->bytesAcked = LOAD(metrics.bytesAcked);
+    snapshot->throughput = LOAD(metrics.throughput);
+    snapshot->rtt = LOAD(metrics.rtt);
+    snapshot->inFlight = LOAD(metrics.inFlight);
+    snapshot->window = LOAD(metrics.window);
+    snapshot->retransmissionsRej = LOAD(metrics.retransmissionsRej);
+    snapshot->retransmissionsTimeout = LOAD(metrics.retransmissionsTimeout);
+    snapshot->rateTime = snapshot->rateBytes = 0;
+}
+
+double metricsEta(const LiveMetrics *snapshot) {
+    if (snapshot->totalBytes == 0 || snapshot->throughput == 0) {
+        return -1;
+    }
+    uint64_t left = snapshot->totalBytes > snapshot->contentBytes ? snapshot->totalBytes - snapshot->contentBytes : 0;
+    return (double) left / snapshot->throughput;
+}
+
+// Metrics in the Prometheus text exposition format.
+// Returns the length of the text.
+int formatMetrics(char *text, int size) {
+    LiveMetrics m;
+    metricsSnapshot(&m);
+    double eta = metricsEta(&m);
+    char etaText[32] = "NaN";
+    if (eta >= 0) {
+        snprintf(etaText, sizeof(etaText), "%.1f", eta);
+    }
+
+    return snprintf(text, size,
+        "# HELP ll_info Role of this side of the link.\n"
+        "# TYPE ll_info gauge\n"
+        "ll_info{role=\"%s\"} 1\n"
+        "# HELP ll_content_bytes Content bytes acknowledged by (or written by) the receiver.\n"
+        "# TYPE ll_content_bytes gauge\n"
+        "ll_content_bytes %llu\n"
+        "# HELP ll_content_expected_bytes Content bytes of the transfer (0 if unknown).\n"
+        "# TYPE ll_content_expected_bytes gauge\n"
+        "ll_content_expected_bytes %llu\n"
+        "# HELP ll_acked_bytes_total Link payload bytes acknowledged (receiver: delivered).\n"
+        "# TYPE ll_acked_bytes_total counter\n"
+        "ll_acked_bytes_total %llu\n"
+        "# HELP ll_throughput_bytes_per_second Smoothed content throughput.\n"
+        "# TYPE ll_throughput_bytes_per_second gauge\n"
+        "ll_throughput_bytes_per_second %llu\n"
+        "# HELP ll_rtt_seconds Smoothed acknowledgement round-trip time.\n"
+        "# TYPE ll_rtt_seconds gauge\n"
+        "ll_rtt_seconds %.6f\n"
+        "# HELP ll_window_occupancy Frames sent and not yet acknowledged.\n"
+        "# TYPE ll_window_occupancy gauge\n"
+        "ll_window_occupancy %llu\n"
+        "# HELP ll_window_size Frames that may be in flight.\n"
+        "# TYPE ll_window_size gauge\n"
+        "ll_window_size %llu\n"
+        "# HELP ll_retransmissions_total Retransmitted frames by cause.\n"
+        "# TYPE ll_retransmissions_total counter\n"
+        "ll_retransmissions_total{cause=\"rej\"} %llu\n"
+        "ll_retransmissions_total{cause=\"timeout\"} %llu\n"
+        "# HELP ll_eta_seconds Estimated time left (NaN if unknown).\n"
+        "# TYPE ll_eta_seconds gauge\n"
+        "ll_eta_seconds %s\n",
+        metricsRole, (unsigned long long) m.contentBytes, (unsigned long long) m.totalBytes,
+        (unsigned long long) m.bytesAcked, (unsigned long long) m.throughput, m.rtt / 1e9,
+        (unsigned long long) m.inFlight, (unsigned long long) m.window, (unsigned long long) m.retransmissionsRej,
+        (unsigned long long) m.retransmissionsTimeout, etaText);
+}
+
+// Answer every connection with the current metrics, as an HTTP response
+// (curl --unix-socket works) after whatever request the client sent
+void *serveMetrics(void *unused) {
+    // The alarm of the link layer belongs to the transfer thread
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    char text[4096];
+    char response[4608];
+    int client;
+    while ((client = accept(listenFd, NULL, NULL)) >= 0) {
+        struct timeval wait = {.tv_sec = 0, .tv_usec = 100000};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+        char request[1024];
+        (void) !recv(client, request, sizeof(request), 0);
+
+        int length = formatMetrics(text, sizeof(text));
+        length = snprintf(response, sizeof(response),
+                          "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n%s",
+                          length, text);
+        (void) !send(client, response, length, MSG_NOSIGNAL);
+        close(client);
+    }
+    return NULL;
+}
+
+void metricsStart(const char *role) {
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.window = 1; // Stop-and-Wait
+    metricsRole = role;
+
+    socketPath = getenv(METRICS_SOCKET_VARIABLE);
+    if (socketPath == NULL) {
+        return;
+    }
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+    unlink(socketPath);
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+        listen(listenFd, 4) < 0 || pthread_create(&server, NULL, serveMetrics, NULL) != 0) {
+        perror(socketPath);
+        if (listenFd >= 0) {
+            close(listenFd);
+        }
+        listenFd = -1;
+        return;
+    }
+    printf("Serving metrics on %s\n", socketPath);
+}
+
+void metricsStop() {
+    if (listenFd < 0) {
+        return;
+    }
+    // Wakes up the server blocked in accept
+    shutdown(listenFd, SHUT_RDWR);
+    pthread_join(server, NULL);
+    close(listenFd);
+    unlink(socketPath);
+    listenFd = -1;
+}
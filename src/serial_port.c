@@ -2,13 +2,18 @@
 // DO NOT CHANGE THIS FILE
 
 #include "serial_port.h"
+#include "transport.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 // MISC
@@ -17,9 +22,51 @@
 int spfd = -1;           // File descriptor for open serial port
 struct termios oldtio; // Serial port settings to restore on closing
 
+SerialIoStats ioStats[SERIAL_PHASES];  // I/O accounting by protocol phase
+SerialPhase phase = SERIAL_PHASE_OPEN;
+
+// Backends, matched by prefix in this order (the tty matches everything)
+static const Transport *transports[] = {&simTransport, &socketTransport, &shmTransport, &ttyTransport};
+static const Transport *transport = &ttyTransport;
+static int transportFd = -1;    // Descriptor the transport returned on opening
+
+// Longest wait for the port to take more bytes after a write found it full
+#define WRITE_WAIT_MS 10
+
+// Current time of the monotonic clock, in nanoseconds
+static uint64_t ioClock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Baud rates of the serial port, in increasing order (0 terminated)
+// (the ones above 115200 are the Linux extensions USB-serial adapters reach)
+const int serialBaudRates[] = {1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200,
+                               230400, 460800, 500000, 576000, 921600, 1000000, 1152000,
+                               1500000, 2000000, 2500000, 3000000, 3500000, 4000000, 0};
+static const speed_t baudRateFlags[] = {B1200, B1800, B2400, B4800, B9600, B19200, B38400, B57600, B115200,
+                                        B230400, B460800, B500000, B576000, B921600, B1000000, B1152000,
+                                        B1500000, B2000000, B2500000, B3000000, B3500000, B4000000};
+
+// Convert a baud rate to its termios flag.
+// Returns 0 if the rate is not supported.
+static speed_t baudRateFlag(int baudRate)
+{
+    for (int i = 0; serialBaudRates[i] != 0; i++)
+    {
+        if (serialBaudRates[i] == baudRate)
+        {
+            return baudRateFlags[i];
+        }
+    }
+    return 0;
+}
+
 // Open and configure the serial port.
 // Returns -1 on error.
-int openSerialPort(const char *serialPort, int baudRate)
+static int openTty(const char *serialPort, int baudRate)
 {
     // Open with O_NONBLOCK to avoid hanging when CLOCAL
     // is not yet set on the serial port (changed later)
@@ -39,38 +86,12 @@ int openSerialPort(const char *serialPort, int baudRate)
     }
 
     // Convert baud rate to appropriate flag
-    tcflag_t br;
-    switch (baudRate)
+    tcflag_t br = baudRateFlag(baudRate);
+    if (br == 0)
     {
-    case 1200:
-        br = B1200;
-        break;
-    case 1800:
-        br = B1800;
-        break;
-    case 2400:
-        br = B2400;
-        break;
-    case 4800:
-        br = B4800;
-        break;
-    case 9600:
-        br = B9600;
-        break;
-    case 19200:
-        br = B19200;
-        break;
-    case 38400:
-        br = B38400;
-        break;
-    case 57600:
-        br = B57600;
-        break;
-    case 115200:
-        br = B115200;
-        break;
-    default:
-        fprintf(stderr, "Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200)\n");
+        fprintf(stderr, "Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200,\n"
+                        "230400, 460800, 500000, 576000, 921600, 1000000, 1152000, 1500000, 2000000, 2500000,\n"
+                        "3000000, 3500000, 4000000)\n");
         return -1;
     }
 
@@ -112,7 +133,7 @@ int openSerialPort(const char *serialPort, int baudRate)
 
 // Restore original port settings and close the serial port.
 // Returns -1 on error.
-int closeSerialPort()
+static int closeTty()
 {
     // Restore the old port settings
     if (tcsetattr(spfd, TCSANOW, &oldtio) == -1)
@@ -124,18 +145,185 @@ int closeSerialPort()
     return close(spfd);
 }
 
+static int readByteTty(unsigned char *byte)
+{
+    return read(spfd, byte, 1);
+}
+
+static int writeTty(const unsigned char *bytes, int numBytes)
+{
+    return write(spfd, bytes, numBytes);
+}
+
+static int drainTty()
+{
+    return tcdrain(spfd);
+}
+
+// Change the speed once the bytes already written have left.
+static int setBaudRateTty(int baudRate)
+{
+    struct termios tio;
+    speed_t br = baudRateFlag(baudRate);
+    if (br == 0 || tcgetattr(spfd, &tio) == -1)
+    {
+        return -1;
+    }
+    cfsetospeed(&tio, br);
+    cfsetispeed(&tio, br);
+    if (tcsetattr(spfd, TCSADRAIN, &tio) == -1)
+    {
+        perror("tcsetattr");
+        return -1;
+    }
+    return 0;
+}
+
+const Transport ttyTransport = {
+    .prefix = "",
+    .name = "serial port",
+    .open = openTty,
+    .close = closeTty,
+    .readByte = readByteTty,
+    .write = writeTty,
+    .drain = drainTty,
+    .alarm = alarm,
+    .setBaudRate = setBaudRateTty,
+};
+
+// Open the transport named by the port.
+// Returns -1 on error.
+int openSerialPort(const char *serialPort, int baudRate)
+{
+    memset(ioStats, 0, sizeof(ioStats));
+    phase = SERIAL_PHASE_OPEN;
+
+    for (int i = 0; i < (int)(sizeof(transports) / sizeof(transports[0])); i++)
+    {
+        if (strncmp(serialPort, transports[i]->prefix, strlen(transports[i]->prefix)) == 0)
+        {
+            transport = transports[i];
+            break;
+        }
+    }
+    transportFd = transport->open(serialPort + strlen(transport->prefix), baudRate);
+    return transportFd;
+}
+
+// Close the transport.
+// Returns -1 on error.
+int closeSerialPort()
+{
+    return transport->close();
+}
+
 // Wait for a byte received from the serial port and read it (must
 // check whether a byte was actually received from the return value).
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
 int readByteSerialPort(unsigned char *byte)
 {
-    return read(spfd, byte, 1);
+    SerialIoStats *stats = &ioStats[phase];
+    uint64_t start = ioClock();
+    int result = transport->readByte(byte);
+    stats->readNs += ioClock() - start;
+    stats->readCalls++;
+
+    if (result > 0)
+    {
+        stats->readBytes += result;
+    }
+    else if (result == 0 || errno == EAGAIN || errno == EINTR)
+    {
+        stats->emptyReads++;
+        result = 0;
+    }
+    return result;
 }
 
-// Write up to numBytes to the serial port (must check how many were actually
-// written in the return value).
+// Write numBytes to the serial port, retrying after short writes.
 // Returns -1 on error, otherwise the number of bytes written.
 int writeBytesSerialPort(const unsigned char *bytes, int numBytes)
 {
-    return write(spfd, bytes, numBytes);
+    SerialIoStats *stats = &ioStats[phase];
+    int written = 0;
+    while (written < numBytes)
+    {
+        uint64_t start = ioClock();
+        int result = transport->write(bytes + written, numBytes - written);
+        stats->writeNs += ioClock() - start;
+        stats->writeCalls++;
+
+        if (result < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+            {
+                stats->writeAgain++;
+                if (errno == EAGAIN && transportFd >= 0)
+                {
+                    // Wait for room rather than spinning on the full port
+                    struct pollfd pfd = {.fd = transportFd, .events = POLLOUT};
+                    poll(&pfd, 1, WRITE_WAIT_MS);
+                }
+                continue;
+            }
+            return -1;
+        }
+        if (result < numBytes - written)
+        {
+            stats->partialWrites++;
+        }
+        stats->writeBytes += result;
+        written += result;
+    }
+    return written;
+}
+
+// Wait until all the bytes written have been transmitted.
+// Returns -1 on error.
+int drainSerialPort()
+{
+    return transport->drain();
+}
+
+// Deliver SIGALRM after the given seconds of the port's clock (0 cancels).
+// Returns the seconds left of the previous alarm.
+unsigned int alarmSerialPort(unsigned int seconds)
+{
+    return transport->alarm(seconds);
+}
+
+// Change the baud rate of the open port (the bytes already written leave at
+// the old one).
+// Returns -1 on error or if the transport has no baud rate.
+int setBaudRateSerialPort(int baudRate)
+{
+    if (transport->setBaudRate == NULL)
+    {
+        return -1;
+    }
+    return transport->setBaudRate(baudRate);
+}
+
+// Highest baud rate the open port can be set to, or 0 if the transport has
+// no baud rate.
+int maxBaudRateSerialPort()
+{
+    int count = 0;
+    while (serialBaudRates[count] != 0)
+    {
+        count++;
+    }
+    return transport->setBaudRate == NULL ? 0 : serialBaudRates[count - 1];
+}
+
+// Account the following system calls to the given phase.
+void setSerialPhase(SerialPhase newPhase)
+{
+    phase = newPhase;
+}
+
+// I/O accounting of a phase.
+const SerialIoStats *getSerialIoStats(SerialPhase phase)
+{
+    return &ioStats[phase];
 }
@@ -0,0 +1,202 @@
+// Shared-memory transport implementation
+//
+// Both sides map the file shm:PATH, which holds one single-producer
+// single-consumer ring per direction. Each ring has one index written by its
+// producer and one by its consumer, on separate cache lines, so no lock or
+// system call is needed to move bytes; an empty ring is polled.
+
+#include "transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_PREFIX "shm:"
+#define SHM_MAGIC 0x53484D52U        // "SHMR"
+#define SHM_RING_SIZE (1 << 16)      // Power of two
+#define SHM_READ_TIMEOUT 100000000ULL // ns, like VTIME of the serial port
+#define SHM_WRITE_TIMEOUT 1000000000ULL // ns a full ring may stay full (the other side is gone)
+
+// Bytes from one side to the other
+typedef struct
+{
+    uint32_t tail;                   // Written by the producer
+    char tailLine[60];
+    uint32_t head;                   // Written by the consumer
+    char headLine[60];
+    unsigned char data[SHM_RING_SIZE];
+} ShmRing;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t arrived;                // Sides attached since the link was created
+    ShmRing rings[2];                // Indexed by the producing side
+} ShmLink;
+
+static ShmLink *shmLink = NULL;
+static int shmfd = -1;
+static int side = 0;                 // 0 created the link, 1 joined it
+
+static uint64_t shmClock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int openShmPort(const char *name, int baudRate)
+{
+    // Whoever creates the file sets the link up
+    shmfd = open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    int created = shmfd >= 0;
+    if (!created && errno == EEXIST)
+    {
+        shmfd = open(name, O_RDWR);
+    }
+    if (shmfd < 0)
+    {
+        perror(name);
+        return -1;
+    }
+
+    struct stat status = {0};
+    if (created && ftruncate(shmfd, sizeof(ShmLink)) < 0)
+    {
+        perror(name);
+        close(shmfd);
+        unlink(name);
+        return -1;
+    }
+    for (int tries = 0; tries < 5000 && (fstat(shmfd, &status) < 0 || status.st_size != sizeof(ShmLink)); tries++)
+    {
+        usleep(1000);
+    }
+    shmLink = status.st_size == sizeof(ShmLink)
+                  ? mmap(NULL, sizeof(ShmLink), PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0)
+                  : MAP_FAILED;
+    if (shmLink == MAP_FAILED)
+    {
+        fprintf(stderr, "%s is not a shared-memory link\n", name);
+        shmLink = NULL;
+        close(shmfd);
+        return -1;
+    }
+
+    if (created)
+    {
+        side = 0;
+        shmLink->arrived = 1;
+        __atomic_store_n(&shmLink->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+        printf("Shared-memory link %s created\n", name);
+        return shmfd;
+    }
+
+    for (int tries = 0; tries < 5000 && __atomic_load_n(&shmLink->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC; tries++)
+    {
+        usleep(1000);
+    }
+    uint32_t waiting = 1;
+    if (shmLink->magic != SHM_MAGIC ||
+        !__atomic_compare_exchange_n(&shmLink->arrived, &waiting, 2, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        fprintf(stderr, "%s is not a shared-memory link waiting for its other side (stale? remove it)\n", name);
+        munmap(shmLink, sizeof(ShmLink));
+        shmLink = NULL;
+        close(shmfd);
+        return -1;
+    }
+    side = 1;
+
+    // Both sides hold the mapping, so the name is free for the next link
+    unlink(name);
+    printf("Shared-memory link %s joined\n", name);
+    return shmfd;
+}
+
+static int closeShmPort()
+{
+    munmap(shmLink, sizeof(ShmLink));
+    shmLink = NULL;
+    return close(shmfd);
+}
+
+static int readByteShmPort(unsigned char *byte)
+{
+    ShmRing *in = &shmLink->rings[1 - side];
+    uint32_t head = in->head;
+    uint64_t start = 0;
+    while (__atomic_load_n(&in->tail, __ATOMIC_ACQUIRE) == head)
+    {
+        if (start == 0)
+        {
+            start = shmClock();
+        }
+        else if (shmClock() - start >= SHM_READ_TIMEOUT)
+        {
+            return 0;
+        }
+        sched_yield();
+    }
+    *byte = in->data[head % SHM_RING_SIZE];
+    __atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int writeShmPort(const unsigned char *bytes, int numBytes)
+{
+    ShmRing *out = &shmLink->rings[side];
+    uint32_t tail = out->tail;
+    uint32_t space;
+    uint64_t start = 0;
+    while ((space = SHM_RING_SIZE - (tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE))) == 0)
+    {
+        // A side that exited never makes room: fail like a hung-up port
+        if (start == 0)
+        {
+            start = shmClock();
+        }
+        else if (shmClock() - start >= SHM_WRITE_TIMEOUT)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+        sched_yield();
+    }
+
+    // Copy in at most two pieces (around the end of the ring), then publish
+    int count = numBytes < (int)space ? numBytes : (int)space;
+    int first = SHM_RING_SIZE - tail % SHM_RING_SIZE;
+    if (first > count)
+    {
+        first = count;
+    }
+    memcpy(&out->data[tail % SHM_RING_SIZE], bytes, first);
+    memcpy(out->data, bytes + first, count - first);
+    __atomic_store_n(&out->tail, tail + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+// Bytes written are already visible to the other side
+static int drainShmPort()
+{
+    return 0;
+}
+
+const Transport shmTransport = {
+    .prefix = SHM_PREFIX,
+    .name = "shared memory",
+    .open = openShmPort,
+    .close = closeShmPort,
+    .readByte = readByteShmPort,
+    .write = writeShmPort,
+    .drain = drainShmPort,
+    .alarm = alarm,
+};
@@ -0,0 +1,542 @@
+// Simulated serial port implementation
+//
+// Both ends of the link map the same file, which holds the wire (one queue of
+// timestamped bytes per direction) and a virtual clock. The clock stands still
+// while either end is running and, once both ends wait (for a byte, for the
+// line to drain or for an alarm), jumps to the earliest event either of them
+// waits for. Processing takes no virtual time, so a transfer runs as fast as
+// the protocol code allows while every timestamp is the one the wire would give.
+
+#include "sim_port.h"
+#include "transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_MAGIC 0x53494D4CU    // "SIML"
+#define NO_EVENT UINT64_MAX
+
+// Byte on the wire
+typedef struct
+{
+    uint64_t arrival;           // Virtual time its last bit reaches the other end
+    int baudRate;               // Speed it was sent at
+    unsigned char byte;
+} SimByte;
+
+// One direction of the link, written by one end and read by the other
+typedef struct
+{
+    SimByte queue[SIM_QUEUE_SIZE];
+    uint32_t head;              // Next byte to read
+    uint32_t tail;              // Next free slot
+    uint64_t lineFree;          // When the sender's UART finishes the last byte
+    uint64_t overruns;          // Bytes lost because the queue was full
+} SimDirection;
+
+// What a waiting end waits for
+typedef struct
+{
+    int attached;
+    pid_t pid;                  // Process of the end, to notice it exiting without closing
+    int waiting;
+    int forByte;                // Wakes up on a byte arrival
+    uint64_t until;             // Wakes up at this time
+    uint64_t alarm;             // Pending alarm (0 if none)
+    int baudRate;               // Speed of the end's UART
+} SimEnd;
+
+// The shared link
+typedef struct
+{
+    uint32_t magic;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint64_t now;               // Virtual clock, ns
+    int arrived;                // Ends attached since the link was created
+    uint64_t propDelay;         // ns
+    double byteErrorRate;
+    int maxBaudRate;            // Faster bytes get SIM_FAST_ERROR_RATE (0 if no limit)
+    uint64_t random;            // xorshift64* state
+    SimEnd ends[2];
+    SimDirection directions[2]; // Indexed by the sending end
+} SimLink;
+
+static SimLink *simLink = NULL;
+static int simfd = -1;
+static int self = 0;            // Our end: 0 created the link, 1 joined it
+static char linkPath[256];
+
+// Next number of the link's generator, so a seed gives the same errors on every run
+static uint64_t nextRandom()
+{
+    uint64_t x = simLink->random;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    simLink->random = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Earliest event the end waits for
+static uint64_t nextEvent(int end)
+{
+    const SimEnd *e = &simLink->ends[end];
+    if (!e->attached || !e->waiting)
+    {
+        return NO_EVENT;
+    }
+    uint64_t next = e->until;
+    if (e->alarm && e->alarm < next)
+    {
+        next = e->alarm;
+    }
+    const SimDirection *in = &simLink->directions[1 - end];
+    if (e->forByte && in->head != in->tail && in->queue[in->head % SIM_QUEUE_SIZE].arrival < next)
+    {
+        next = in->queue[in->head % SIM_QUEUE_SIZE].arrival;
+    }
+    return next;
+}
+
+// Whether a byte has reached our end
+static int byteArrived()
+{
+    const SimDirection *in = &simLink->directions[1 - self];
+    return in->head != in->tail && in->queue[in->head % SIM_QUEUE_SIZE].arrival <= simLink->now;
+}
+
+// Wait (with the lock held) until the clock reaches until, a byte arrives
+// (if forByte) or our alarm expires.
+// Returns 1 if the alarm expired.
+static int waitForEvent(uint64_t until, int forByte)
+{
+    SimEnd *e = &simLink->ends[self];
+    e->waiting = 1;
+    e->forByte = forByte;
+    e->until = until;
+
+    int alarmExpired = 0;
+    while (1)
+    {
+        if (e->alarm && e->alarm <= simLink->now)
+        {
+            e->alarm = 0;
+            alarmExpired = 1;
+            break;
+        }
+        if ((forByte && byteArrived()) || simLink->now >= until)
+        {
+            break;
+        }
+
+        // The clock only moves once both ends have joined and none is running
+        int idle = simLink->arrived == 2;
+        for (int end = 0; end < 2; end++)
+        {
+            if (simLink->ends[end].attached && !simLink->ends[end].waiting)
+            {
+                idle = 0;
+            }
+        }
+        // (an event already due belongs to the other end, which is waking up)
+        if (idle)
+        {
+            uint64_t next = nextEvent(0) < nextEvent(1) ? nextEvent(0) : nextEvent(1);
+            if (next > simLink->now)
+            {
+                simLink->now = next;
+                pthread_cond_broadcast(&simLink->changed);
+                continue;
+            }
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
+        if (pthread_cond_timedwait(&simLink->changed, &simLink->lock, &deadline) == ETIMEDOUT)
+        {
+            // An end that exited without closing (e.g. after giving up) left the link
+            SimEnd *peer = &simLink->ends[1 - self];
+            if (peer->attached && kill(peer->pid, 0) < 0 && errno == ESRCH)
+            {
+                peer->attached = 0;
+            }
+        }
+    }
+
+    e->waiting = 0;
+    return alarmExpired;
+}
+
+// Parse the options following the path of the link
+static int parseOptions(char *options, uint64_t *propDelay, double *ber, uint64_t *seed, int *maxBaudRate)
+{
+    char *option = strtok(options, ",");
+    while (option != NULL)
+    {
+        if (strncmp(option, "prop=", 5) == 0)
+        {
+            *propDelay = strtoull(option + 5, NULL, 10) * 1000ULL;
+        }
+        else if (strncmp(option, "ber=", 4) == 0)
+        {
+            *ber = atof(option + 4);
+            if (*ber < 0 || *ber >= 1)
+            {
+                fprintf(stderr, "Bad BER %s (must be 0 <= BER < 1)\n", option + 4);
+                return -1;
+            }
+        }
+        else if (strncmp(option, "maxbaud=", 8) == 0)
+        {
+            *maxBaudRate = atoi(option + 8);
+        }
+        else if (strncmp(option, "seed=", 5) == 0)
+        {
+            *seed = strtoull(option + 5, NULL, 10);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown simulated link option %s\n", option);
+            return -1;
+        }
+        option = strtok(NULL, ",");
+    }
+    return 0;
+}
+
+// Initialize a link we just created
+static int createLink(int baudRate, uint64_t propDelay, double ber, uint64_t seed, int maxBaudRate)
+{
+    if (ftruncate(simfd, sizeof(SimLink)) < 0)
+    {
+        perror(linkPath);
+        return -1;
+    }
+    simLink = mmap(NULL, sizeof(SimLink), PROT_READ | PROT_WRITE, MAP_SHARED, simfd, 0);
+    if (simLink == MAP_FAILED)
+    {
+        perror(linkPath);
+        return -1;
+    }
+
+    pthread_mutexattr_t lockAttributes;
+    pthread_mutexattr_init(&lockAttributes);
+    pthread_mutexattr_setpshared(&lockAttributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&simLink->lock, &lockAttributes);
+    pthread_condattr_t condAttributes;
+    pthread_condattr_init(&condAttributes);
+    pthread_condattr_setpshared(&condAttributes, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&simLink->changed, &condAttributes);
+
+    // Compute 1 - (1 - ber)^8 without libm, like the cable
+    double acc = 1 - ber;
+    acc *= acc;
+    acc *= acc;
+    acc *= acc;
+
+    simLink->now = SIM_EPOCH;
+    simLink->propDelay = propDelay;
+    simLink->byteErrorRate = 1 - acc;
+    simLink->maxBaudRate = maxBaudRate;
+    // Spread the seed over the state (splitmix64), so nearby seeds give unrelated errors
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    simLink->random = z ? z : 1;
+    simLink->ends[0].attached = 1;
+    simLink->ends[0].pid = getpid();
+    simLink->ends[0].baudRate = baudRate;
+    simLink->arrived = 1;
+    self = 0;
+    __atomic_store_n(&simLink->magic, SIM_MAGIC, __ATOMIC_RELEASE);
+
+    printf("Simulated link %s created: %d baud, %llu usec propagation delay, BER %g\n", linkPath, baudRate,
+           (unsigned long long) propDelay / 1000, ber);
+    return 0;
+}
+
+// Map a link created by the other end, once it is initialized
+static int joinLink()
+{
+    struct stat status;
+    for (int tries = 0; tries < 5000; tries++)
+    {
+        if (fstat(simfd, &status) == 0 && status.st_size == sizeof(SimLink))
+        {
+            break;
+        }
+        usleep(1000);
+    }
+    if (status.st_size != sizeof(SimLink))
+    {
+        fprintf(stderr, "%s is not a simulated link\n", linkPath);
+        return -1;
+    }
+    simLink = mmap(NULL, sizeof(SimLink), PROT_READ | PROT_WRITE, MAP_SHARED, simfd, 0);
+    if (simLink == MAP_FAILED)
+    {
+        perror(linkPath);
+        return -1;
+    }
+    for (int tries = 0; tries < 5000 && __atomic_load_n(&simLink->magic, __ATOMIC_ACQUIRE) != SIM_MAGIC; tries++)
+    {
+        usleep(1000);
+    }
+    if (simLink->magic != SIM_MAGIC)
+    {
+        fprintf(stderr, "%s is not a simulated link\n", linkPath);
+        return -1;
+    }
+
+    pthread_mutex_lock(&simLink->lock);
+    int waiting = simLink->arrived == 1 && simLink->ends[0].attached;
+    if (waiting)
+    {
+        simLink->ends[1].attached = 1;
+        simLink->ends[1].pid = getpid();
+        simLink->ends[1].baudRate = simLink->ends[0].baudRate;
+        simLink->arrived = 2;
+        pthread_cond_broadcast(&simLink->changed);
+    }
+    pthread_mutex_unlock(&simLink->lock);
+    if (!waiting)
+    {
+        fprintf(stderr, "%s is not a simulated link waiting for its other end (stale? remove it)\n", linkPath);
+        return -1;
+    }
+    self = 1;
+
+    // Both ends hold the mapping, so the name is free for the next link
+    unlink(linkPath);
+    printf("Simulated link %s joined\n", linkPath);
+    return 0;
+}
+
+int openSimulatedPort(const char *name, int baudRate)
+{
+    if (baudRate <= 0)
+    {
+        fprintf(stderr, "Bad baud rate %d\n", baudRate);
+        return -1;
+    }
+
+    char options[256] = "";
+    const char *comma = strchr(name, ',');
+    int pathLength = comma ? comma - name : (int) strlen(name);
+    if (pathLength == 0 || pathLength >= (int) sizeof(linkPath))
+    {
+        fprintf(stderr, "Bad simulated link name %s\n", name);
+        return -1;
+    }
+    snprintf(linkPath, sizeof(linkPath), "%.*s", pathLength, name);
+    if (comma)
+    {
+        snprintf(options, sizeof(options), "%s", comma + 1);
+    }
+
+    uint64_t propDelay = 0;
+    uint64_t seed = 1;
+    double ber = 0;
+    int maxBaudRate = 0;
+    if (parseOptions(options, &propDelay, &ber, &seed, &maxBaudRate) < 0)
+    {
+        return -1;
+    }
+
+    // Whoever creates the file sets the link up
+    simfd = open(linkPath, O_RDWR | O_CREAT | O_EXCL, 0600);
+    int created = simfd >= 0;
+    if (!created && errno == EEXIST)
+    {
+        simfd = open(linkPath, O_RDWR);
+    }
+    if (simfd < 0)
+    {
+        perror(linkPath);
+        return -1;
+    }
+    if ((created ? createLink(baudRate, propDelay, ber, seed, maxBaudRate) : joinLink()) < 0)
+    {
+        if (simLink != NULL && simLink != MAP_FAILED)
+        {
+            munmap(simLink, sizeof(SimLink));
+        }
+        simLink = NULL;
+        close(simfd);
+        if (created)
+        {
+            unlink(linkPath);
+        }
+        return -1;
+    }
+    return simfd;
+}
+
+int closeSimulatedPort()
+{
+    if (simLink == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&simLink->lock);
+    simLink->ends[self].attached = 0;
+    int joined = simLink->arrived == 2;
+    uint64_t overruns = simLink->directions[self].overruns;
+    pthread_cond_broadcast(&simLink->changed);
+    pthread_mutex_unlock(&simLink->lock);
+
+    // Nobody joined, so nobody freed the name
+    if (!joined)
+    {
+        unlink(linkPath);
+    }
+    if (overruns)
+    {
+        printf("Simulated link: %llu bytes lost to overruns\n", (unsigned long long) overruns);
+    }
+    munmap(simLink, sizeof(SimLink));
+    simLink = NULL;
+    return close(simfd);
+}
+
+int readByteSimulatedPort(unsigned char *byte)
+{
+    pthread_mutex_lock(&simLink->lock);
+    int alarmExpired = 0;
+    if (!byteArrived())
+    {
+        alarmExpired = waitForEvent(simLink->now + SIM_READ_TIMEOUT, 1);
+    }
+
+    // An alarm interrupts the read, like SIGALRM interrupts read(2)
+    int result = 0;
+    if (!alarmExpired && byteArrived())
+    {
+        SimDirection *in = &simLink->directions[1 - self];
+        const SimByte *received = &in->queue[in->head % SIM_QUEUE_SIZE];
+        *byte = received->byte;
+        // A UART set to another speed samples the bits at the wrong times
+        if (received->baudRate != simLink->ends[self].baudRate)
+        {
+            *byte ^= 1 + nextRandom() % 255;
+        }
+        in->head++;
+        result = 1;
+    }
+    pthread_mutex_unlock(&simLink->lock);
+
+    if (alarmExpired)
+    {
+        raise(SIGALRM);
+    }
+    return result;
+}
+
+int writeBytesSimulatedPort(const unsigned char *bytes, int numBytes)
+{
+    pthread_mutex_lock(&simLink->lock);
+    SimDirection *out = &simLink->directions[self];
+    uint64_t sent = out->lineFree > simLink->now ? out->lineFree : simLink->now;
+    int baudRate = simLink->ends[self].baudRate;
+    uint64_t byteTime = 10000000000ULL / baudRate; // 10 bit times (8-N-1)
+    double errorRate = simLink->byteErrorRate;
+    if (simLink->maxBaudRate && baudRate > simLink->maxBaudRate && errorRate < SIM_FAST_ERROR_RATE)
+    {
+        errorRate = SIM_FAST_ERROR_RATE;
+    }
+    for (int i = 0; i < numBytes; i++)
+    {
+        // The UART sends the bytes back to back, each corrupted (one bit) with
+        // the byte error rate
+        sent += byteTime;
+        unsigned char byte = bytes[i];
+        if (errorRate > 0 && (nextRandom() >> 11) * 0x1.0p-53 < errorRate)
+        {
+            byte ^= 1 << (nextRandom() % 8);
+        }
+
+        if (out->tail - out->head == SIM_QUEUE_SIZE)
+        {
+            out->overruns++;
+            continue;
+        }
+        out->queue[out->tail % SIM_QUEUE_SIZE].arrival = sent + simLink->propDelay;
+        out->queue[out->tail % SIM_QUEUE_SIZE].baudRate = baudRate;
+        out->queue[out->tail % SIM_QUEUE_SIZE].byte = byte;
+        out->tail++;
+    }
+    out->lineFree = sent;
+    pthread_cond_broadcast(&simLink->changed);
+    pthread_mutex_unlock(&simLink->lock);
+    return numBytes;
+}
+
+int drainSimulatedPort()
+{
+    pthread_mutex_lock(&simLink->lock);
+    int alarmExpired = waitForEvent(simLink->directions[self].lineFree, 0);
+    pthread_mutex_unlock(&simLink->lock);
+
+    if (alarmExpired)
+    {
+        raise(SIGALRM);
+    }
+    return 0;
+}
+
+unsigned int alarmSimulatedPort(unsigned int seconds)
+{
+    pthread_mutex_lock(&simLink->lock);
+    SimEnd *e = &simLink->ends[self];
+    unsigned int left = e->alarm > simLink->now ? (e->alarm - simLink->now + 999999999ULL) / 1000000000ULL : 0;
+    e->alarm = seconds ? simLink->now + seconds * 1000000000ULL : 0;
+    pthread_cond_broadcast(&simLink->changed);
+    pthread_mutex_unlock(&simLink->lock);
+    return left;
+}
+
+int setBaudRateSimulatedPort(int baudRate)
+{
+    if (baudRate <= 0)
+    {
+        return -1;
+    }
+    // The bytes already written keep the speed they were sent at
+    pthread_mutex_lock(&simLink->lock);
+    simLink->ends[self].baudRate = baudRate;
+    pthread_mutex_unlock(&simLink->lock);
+    return 0;
+}
+
+int simulationActive()
+{
+    return simLink != NULL;
+}
+
+uint64_t simulationClock()
+{
+    return __atomic_load_n(&simLink->now, __ATOMIC_RELAXED);
+}
+
+const Transport simTransport = {
+    .prefix = SIM_PREFIX,
+    .name = "simulated link",
+    .open = openSimulatedPort,
+    .close = closeSimulatedPort,
+    .readByte = readByteSimulatedPort,
+    .write = writeBytesSimulatedPort,
+    .drain = drainSimulatedPort,
+    .alarm = alarmSimulatedPort,
+    .setBaudRate = setBaudRateSimulatedPort,
+};
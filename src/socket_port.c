@@ -0,0 +1,158 @@
+// Unix socket transport implementation
+//
+// The first side to open unix:PATH listens on it and accepts the other side,
+// which connects; both then hold the two ends of a socket pair. Reads are
+// buffered, so the protocol reads its bytes one by one without a system call
+// each.
+
+#include "transport.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SOCKET_PREFIX "unix:"
+#define SOCKET_READ_TIMEOUT 100     // Milliseconds, like VTIME of the serial port
+#define SOCKET_BUFFER_SIZE 4096
+
+static int sockfd = -1;
+static unsigned char buffer[SOCKET_BUFFER_SIZE];
+static int bufferStart = 0;
+static int bufferEnd = 0;
+
+// Wait for the other side on path.
+// Returns the connected socket, or -1 on error (errno EADDRINUSE if it was faster).
+static int acceptPeer(const struct sockaddr_un *address)
+{
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0)
+    {
+        return -1;
+    }
+    if (bind(listenfd, (const struct sockaddr *)address, sizeof(*address)) < 0 || listen(listenfd, 1) < 0)
+    {
+        int error = errno;
+        close(listenfd);
+        errno = error;
+        return -1;
+    }
+    printf("Waiting for the other side on %s\n", address->sun_path);
+    int fd = accept(listenfd, NULL, NULL);
+    close(listenfd);
+
+    // Connected, so the name is free for the next link
+    unlink(address->sun_path);
+    return fd;
+}
+
+static int openSocketPort(const char *name, int baudRate)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(name) == 0 || strlen(name) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Bad socket path %s\n", name);
+        return -1;
+    }
+    strcpy(address.sun_path, name);
+    bufferStart = bufferEnd = 0;
+
+    // Connect to a listening side, or become it (both may race for it)
+    for (int tries = 0; tries < 10 && sockfd < 0; tries++)
+    {
+        sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sockfd < 0)
+        {
+            break;
+        }
+        if (connect(sockfd, (struct sockaddr *)&address, sizeof(address)) == 0)
+        {
+            break;
+        }
+        int error = errno;
+        close(sockfd);
+        sockfd = -1;
+        if (error != ENOENT && error != ECONNREFUSED)
+        {
+            errno = error;
+            break;
+        }
+
+        // Nobody listens there: a left-over socket is removed
+        if (error == ECONNREFUSED)
+        {
+            unlink(name);
+        }
+        sockfd = acceptPeer(&address);
+        if (sockfd < 0 && errno != EADDRINUSE)
+        {
+            break;
+        }
+    }
+    if (sockfd < 0)
+    {
+        perror(name);
+        return -1;
+    }
+    return sockfd;
+}
+
+static int closeSocketPort()
+{
+    int result = close(sockfd);
+    sockfd = -1;
+    return result;
+}
+
+static int readByteSocketPort(unsigned char *byte)
+{
+    if (bufferStart == bufferEnd)
+    {
+        struct pollfd ready = {.fd = sockfd, .events = POLLIN};
+        int result = poll(&ready, 1, SOCKET_READ_TIMEOUT);
+        if (result <= 0)
+        {
+            return result;
+        }
+        result = read(sockfd, buffer, sizeof(buffer));
+        if (result == 0)
+        {
+            // The peer closed its end: nothing will arrive any more
+            errno = EPIPE;
+            return -1;
+        }
+        if (result < 0)
+        {
+            return result;
+        }
+        bufferStart = 0;
+        bufferEnd = result;
+    }
+    *byte = buffer[bufferStart++];
+    return 1;
+}
+
+static int writeSocketPort(const unsigned char *bytes, int numBytes)
+{
+    return send(sockfd, bytes, numBytes, MSG_NOSIGNAL);
+}
+
+// Bytes sent are already with the other side
+static int drainSocketPort()
+{
+    return 0;
+}
+
+const Transport socketTransport = {
+    .prefix = SOCKET_PREFIX,
+    .name = "Unix socket",
+    .open = openSocketPort,
+    .close = closeSocketPort,
+    .readByte = readByteSocketPort,
+    .write = writeSocketPort,
+    .drain = drainSocketPort,
+    .alarm = alarm,
+};
@@ -0,0 +1,104 @@
+// Event tracer implementation
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Event as stored in the ring
+typedef struct {
+    uint64_t timestamp;     // Monotonic clock, ns
+    uint64_t duration;      // 0 for an instant event
+    uint64_t value;
+    TraceEventType type;
+} TraceEvent;
+
+static const char *eventNames[] = {
+    [TRACE_FRAME_ENCODED] = "frame encoded",
+    [TRACE_FRAME_WRITTEN] = "frame written",
+    [TRACE_ACK_RECEIVED] = "ack received",
+    [TRACE_REJ] = "REJ",
+    [TRACE_ALARM] = "alarm fired",
+    [TRACE_LLREAD] = "llread",
+    [TRACE_FWRITE] = "fwrite",
+};
+
+int traceEnabled = 0;
+
+// Ring buffer: head counts every event ever recorded, so head % capacity is
+// the next slot and min(head, capacity) the number of valid events
+static TraceEvent *ring = NULL;
+static uint64_t head = 0;
+static const char *tracePath = NULL;
+static const char *traceRole = NULL;
+
+void traceInit(const char *role) {
+    tracePath = getenv(TRACE_VARIABLE);
+    if (tracePath == NULL || ring != NULL) {
+        return;
+    }
+    ring = calloc(TRACE_CAPACITY, sizeof(TraceEvent));
+    if (ring == NULL) {
+        perror("ERROR: Couldn't allocate the trace buffer.\n");
+        return;
+    }
+    traceRole = role;
+    head = 0;
+    traceEnabled = 1;
+}
+
+void traceEvent(TraceEventType type, uint64_t timestamp, uint64_t duration, uint64_t value) {
+    // Claiming the slot is the only shared step, so producers never block
+    uint64_t slot = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED) % TRACE_CAPACITY;
+    ring[slot].timestamp = timestamp;
+    ring[slot].duration = duration;
+    ring[slot].value = value;
+    ring[slot].type = type;
+}
+
+void traceDump() {
+    if (!traceEnabled) {
+        return;
+    }
+    traceEnabled = 0;
+
+    FILE *out = fopen(tracePath, "w");
+    if (out == NULL) {
+        perror(tracePath);
+        free(ring);
+        ring = NULL;
+        return;
+    }
+
+    // Timestamps stay on the monotonic clock so the traces of both sides line up
+    int pid = getpid();
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", pid, traceRole);
+
+    uint64_t count = head < TRACE_CAPACITY ? head : TRACE_CAPACITY;
+    for (uint64_t i = head - count; i < head; i++) {
+        const TraceEvent *event = &ring[i % TRACE_CAPACITY];
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"link\",\"ph\":\"%s\",\"ts\":%.3f,", eventNames[event->type],
+                event->duration ? "X" : "i", event->timestamp / 1e3);
+        if (event->duration) {
+            fprintf(out, "\"dur\":%.3f,", event->duration / 1e3);
+        }
+        else {
+            fprintf(out, "\"s\":\"t\",");
+        }
+        fprintf(out, "\"pid\":%d,\"tid\":%d,\"args\":{\"value\":%llu}}", pid, pid, (unsigned long long) event->value);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    if (head > TRACE_CAPACITY) {
+        printf("Trace %s: kept the last %d of %llu events.\n", tracePath, TRACE_CAPACITY, (unsigned long long) head);
+    }
+    else {
+        printf("Trace %s: %llu events.\n", tracePath, (unsigned long long) head);
+    }
+    free(ring);
+    ring = NULL;
+}